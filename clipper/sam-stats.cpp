@@ -32,6 +32,7 @@
 #include <math.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include <string>
 #include <sparsehash/sparse_hash_map> // or sparse_hash_set, dense_hash_map, ...
@@ -43,7 +44,8 @@
 
 const char * VERSION = "1.38";
 
-#define SVNREV atoi(strchr("$LastChangedRevision$", ':')+1)
+// 0 when the keyword isn't expanded (not an svn checkout)
+#define SVNREV (strchr("$LastChangedRevision$", ':') ? atoi(strchr("$LastChangedRevision$", ':')+1) : 0)
 
 using namespace std;
 
@@ -58,7 +60,7 @@ void usage(FILE *f);
 #define meminit(l) (memset(&l,0,sizeof(l)))
 #define debugout(s,...) if (debug) fprintf(stderr,s,##__VA_ARGS__)
 #undef warn
-#define warn(s,...) ((++errs), fprintf(stderr,s,##__VA_ARGS__))
+#define warn(s,...) (__sync_fetch_and_add(&errs,1), fprintf(stderr,s,##__VA_ARGS__))
 #define stdev(cnt, sum, ssq) sqrt((((double)cnt)*ssq-pow((double)sum,2)) / ((double)cnt*((double)cnt-1)))
 
 template <class vtype> 
@@ -76,6 +78,8 @@ int histnum=30;
 bool isbwa=false;
 int rnamode = 0;
 bool allow_no_reads = false;
+int dupcbits = 16;		// -D count bits, the rest of 64 are the read-id fingerprint
+int dupmem = 0;			// -D table size in MB, fixed ... 0 grows with the number of ids
 
 // from http://programerror.com/2009/10/iterative-calculation-of-lies-er-stats/
 class cRunningStats
@@ -101,6 +105,37 @@ public:
     m_m2 += d * d_n * (m_n - 1);
     m_m1 += d_n;
   }
+  // same as pushing x, x+1 ... x+n-1, in O(1)
+  void PushRange(double x, long n)
+  {
+    if (n <= 0) return;
+    cRunningStats r;
+    double nn = n;
+    r.m_n = nn;
+    r.m_m1 = x + (nn - 1) / 2;
+    r.m_m2 = nn * (nn * nn - 1) / 12;           // consecutive integers: symmetric, so m3 is 0
+    r.m_m4 = nn * (nn * nn - 1) * (3 * nn * nn - 7) / 240;
+    Merge(r);
+  }
+  // combine with stats gathered elsewhere (pairwise update, same result as pushing every x)
+  void Merge(const cRunningStats &b)
+  {
+    if (b.m_n == 0) return;
+    if (m_n == 0) { *this = b; return; }
+    double na = m_n, nb = b.m_n, n = na + nb;
+    double d = b.m_m1 - m_m1;
+    double d2 = d * d, d3 = d2 * d, d4 = d2 * d2;
+    double m4 = m_m4 + b.m_m4 + d4 * na * nb * (na * na - na * nb + nb * nb) / (n * n * n) +
+                6 * d2 * (na * na * b.m_m2 + nb * nb * m_m2) / (n * n) +
+                4 * d * (na * b.m_m3 - nb * m_m3) / n;
+    double m3 = m_m3 + b.m_m3 + d3 * na * nb * (na - nb) / (n * n) +
+                3 * d * (na * b.m_m2 - nb * m_m2) / n;
+    m_m2 += b.m_m2 + d2 * na * nb / n;
+    m_m3 = m3;
+    m_m4 = m4;
+    m_m1 += d * nb / n;
+    m_n = n;
+  }
   double Mean() { return m_m1; }
   double StdDeviation() { return sqrt(Variance()); }
   double StdError() { return (m_n > 1.0) ? sqrt(Variance() / m_n) : 0.0; }
@@ -144,6 +179,164 @@ public:
 		++dat[v];
 		++tot;
 	}
+
+	void merge(const ibucket &o) {
+		int i;
+		for (i=0;i<dat.size() && i<o.dat.size();++i)
+			dat[i]+=o.dat[i];
+		tot+=o.tot;
+	}
+};
+
+// read-id -> count, for -D ... ids are hashed down to fingerprints in a flat open-addressed table
+// each slot is 64 bits: fingerprint in the high bits, count in the low "cbits" (saturates)
+// fewer count bits = longer fingerprints = fewer ids falsely counted as the same read
+// 8 bytes a slot, 35-70% full: 11-23 bytes per id, and 34 while it doubles (old and new table)
+// a fixed size table stops taking new ids at 70%: those aren't tracked, only counted
+class idcount {
+	vector<uint64_t> tab;
+	size_t n, mask;
+	size_t fixed;			// slots, if the table doesn't grow
+	size_t over;			// alignments of ids that didn't fit in a fixed table
+	int cbits;
+	uint64_t cmax;
+
+	static uint64_t hash(const char *s, size_t len) {
+		uint64_t h = 14695981039346656037ULL;		// fnv-1a, then murmur's finalizer
+		size_t i;
+		for (i=0;i<len;++i) {
+			h ^= (unsigned char) s[i];
+			h *= 1099511628211ULL;
+		}
+		h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+	// slot for fingerprint fp (fp is already shifted up), either holding it or empty
+	size_t find(uint64_t fp) const {
+		size_t i = (fp >> cbits) & mask;
+		while (tab[i] && (tab[i] & ~cmax) != fp)
+			i = (i+1) & mask;
+		return i;
+	}
+	void grow() {
+		vector<uint64_t> old;
+		old.swap(tab);
+		tab.resize(fixed ? fixed : old.size() ? old.size()*2 : 1024);
+		mask = tab.size()-1;
+		size_t i;
+		for (i=0;i<old.size();++i)
+			if (old[i]) 
+				tab[find(old[i] & ~cmax)] = old[i];
+	}
+public:
+	idcount(int count_bits = 16) : n(0), mask(0), fixed(0), over(0) { setbits(count_bits); }
+	void setbits(int count_bits) {
+		assert(!n);
+		cbits = count_bits;
+		cmax = (1ULL << cbits) - 1;
+	}
+	// fixed size table, the largest power of 2 slots that fit in mb megabytes (allocated on first use)
+	void setmem(int mb) {
+		assert(!n);
+		for (fixed=1024; fixed*2*sizeof(uint64_t) <= ((size_t) mb << 20); fixed*=2);
+	}
+
+	// add one to the count for id s, returns the new count
+	// when a fixed table is full, a new id returns 1 every time
+	int add(const char *s, size_t len) {
+		bool full = n*10 >= tab.size()*7;
+		if (full && (!fixed || !tab.size())) {
+			grow();
+			full = false;
+		}
+		uint64_t fp = hash(s, len) & ~cmax;
+		if (!fp) fp = cmax+1;				// 0 is an empty slot
+		size_t i = find(fp);
+		if (!tab[i]) {
+			if (full) {
+				++over;
+				return 1;
+			}
+			tab[i] = fp;
+			++n;
+		}
+		if ((tab[i] & cmax) < cmax)
+			++tab[i];
+		return tab[i] & cmax;
+	}
+
+	size_t size() const {return n;}
+	size_t untracked() const {return over;}
+
+	// walk the counts: slots() of them, count(i) is 0 for empty slots
+	size_t slots() const {return tab.size();}
+	int count(size_t i) const {return tab[i] & cmax;}
+};
+
+// integer histogram, exact below LB_CAP, log-bucketed above that (64 per doubling, <1% off)
+// constant ram, O(buckets) access ... same interface as ibucket, so quantile() works on it
+#define LB_CAP (1<<16)
+#define LB_SUB 6
+class lbucket {
+public:
+	long long tot;
+	vector<long long> dat;		// exact counts, grows up to the largest value seen
+	vector<long long> big;		// log buckets, values >= LB_CAP
+	lbucket() {tot=0;}
+	long long size() const {return tot;};
+
+	// walk the buckets: bins() of them, each with a value and a count
+	int bins() const {return dat.size()+big.size();}
+	int value(int i) const {
+		if (i < dat.size()) return i;
+		i -= dat.size();
+		int o = i >> LB_SUB;			// octave above LB_CAP
+		int sub = i & ((1<<LB_SUB)-1);
+		int shift = o + 16 - LB_SUB;
+		return (((1<<LB_SUB) + sub) << shift) + ((1<<shift)>>1);	// middle of the bucket
+	}
+	long long count(int i) const {return i < dat.size() ? dat[i] : big[i-dat.size()];}
+
+	int operator[] (long long n) const {
+		assert(n < size());
+		int i;
+		for (i=0;i<bins();++i) {
+			if (n < count(i)) {
+				return value(i);
+			}
+			n-=count(i);
+		}
+		return value(bins()-1);
+	}
+
+	void push(int v) {
+		assert(v >= 0);
+		if (v < LB_CAP) {
+			if (v >= dat.size()) dat.resize(v+1);
+			++dat[v];
+		} else {
+			int o = 0;
+			while ((v >> (o+16)) > 1) ++o;
+			int sub = (v >> (o + 16 - LB_SUB)) & ((1<<LB_SUB)-1);
+			int i = (o << LB_SUB) + sub;
+			if (i >= big.size()) big.resize(i+1);
+			++big[i];
+		}
+		++tot;
+	}
+
+	void merge(const lbucket &o) {
+		int i;
+		if (dat.size() < o.dat.size()) dat.resize(o.dat.size());
+		for (i=0;i<o.dat.size();++i)
+			dat[i]+=o.dat[i];
+		if (big.size() < o.big.size()) big.resize(o.big.size());
+		for (i=0;i<o.big.size();++i)
+			big[i]+=o.big[i];
+		tot+=o.tot;
+	}
 };
 
 class fqent {
@@ -156,13 +349,13 @@ class fqent {
 class sstats {
 public:
 	ibucket vmapq;			// all map qualities
-	sstats() : vmapq(MAX_MAPQ) {
+	sstats() : vmapq(MAX_MAPQ), dups(dupcbits) {
+		if (dupmem) dups.setmem(dupmem);
 		memset((void*)&dat,0,sizeof(dat));
-		covr.set_empty_key("-");
+		rids.set_empty_key("-");
 		petab.set_deleted_key("-");
-	}
-	~sstats() {
-		covr.clear();
+		lastref=-1;
+		sefq=pefq1=pefq2=NULL;
 	}
 	struct {
 		int n, mapn, secondary, mapzero;		// # of entries, # of mapped entries, 
@@ -181,17 +374,55 @@ public:
 		int disc_pos;
 		int dupmax;		// max dups found
 	} dat;
-	vector<int> visize;		// all insert sizes
-	google::dense_hash_map<std::string, scoverage> covr;	// # mapped per ref seq
-	google::sparse_hash_map<std::string, int> dups;		// alignments by read-id (not necessary for some pipes)
+	lbucket visize;			// insert size histogram
+	lbucket vlen;			// read length histogram
+	vector<scoverage> covr;			// # mapped per ref seq, by ref id (== bam tid)
+	vector<std::string> rnames;		// ref id -> name
+	google::dense_hash_map<std::string, int> rids;	// name -> ref id
+	int lastref;				// last looked-up id, sam is usually sorted
+	idcount dups;			// alignments by read-id (not necessary for some pipes)
 	google::sparse_hash_map<std::string, fqent> petab;		// peread table
 
-	// file-format neutral ... called per read... warning seq/qual are not necessarily null-terminated
-	void dostats(string name, int rlen, int bits, const string &ref, int pos, int mapq, const string &materef, int nmate, const string &seq, const char *qual, int nm, int del, int ins);
+	// file-format neutral ... called per read, true if the read's bases should be counted
+	bool dostats(const char *name, int rlen, int bits, int ref, int pos, int mapq, bool matediff, int nmate, int nm, int del, int ins);
+
+	// intern a reference name
+	int refid(const char *name);
+
+	// base/qual stats for an ascii read, qual is phred+33
+	void dobases(const char *seq, const char *qual, int len);
+
+	// dup tracking and fastq output ... seq/qual are null-terminated ascii
+	void dodup(const char *name, int bits, const char *seq, const char *qual);
+	string dname, fqseq, fqqual;	// scratch, so we don't allocate per read
+	FILE *sefq, *pefq1, *pefq2;	// fastq output
 
 	// read a bam/sam file and call dostats over and over
 	bool parse_bam(const char *in);
 	bool parse_sam(FILE *f);
+
+	// same as parse_bam, but split over index regions with nt threads, -1 if there's no index
+	int parse_bam_index(const char *in, int nt);
+
+	// one bam record, and the ref lengths from a bam header
+	void dobam(bam1_t *al, const bam_header_t *h);
+	void doheader(const bam_header_t *h);
+
+	// add stats collected by another sstats (not dups/petab)
+	void merge(const sstats &o);
+};
+
+// histogram bucket for a position
+static inline int histbin(int pos, int reflen) {
+	return histnum * ((double)pos / reflen);
+}
+
+// sort ref ids by name
+class refname_lt {
+	const vector<string> &names;
+public:
+	refname_lt(const vector<string> &n) : names(n) {}
+	bool operator()(int a, int b) const { return names[a] < names[b]; }
 };
 
 #define T_A 0
@@ -204,11 +435,29 @@ void build_basemap();
 
 int dupreads = 1000000;
 int max_chr = 1000;
+int nthreads = 1;
 bool trackdup=0;
-FILE *sefq = NULL;
-FILE *pefq1 = NULL;
-FILE *pefq2 = NULL;
 int basemap[256];
+unsigned char basepair[256][2];             // packed bam byte -> 2 basemap values
+// input files, shared by the worker threads
+class statspool {
+public:
+	vector<const char *> *todo;
+	int next;
+	pthread_mutex_t lock;
+	int fatal;
+	const char *ext;
+	int fq_out;
+	const char *rnafile;
+	bool inbam;
+	int nt;				// threads per file
+};
+
+static void *dopool(void *arg);
+static int dofile(const char *in, const char *ext, int fq_out, const char *rnafile, bool inbam, int nt);
+static void printstats(sstats &s, FILE *o, FILE *rnao);
+static string outbase(const char *in);
+
 int main(int argc, char **argv) {
 	const char *ext = NULL;
 	bool multi=0, newonly=0, inbam=0;
@@ -218,12 +467,14 @@ int main(int argc, char **argv) {
 	optind = 0;
     struct option long_options[] = {
                {"fastq", no_argument, NULL, 'o'},
+               {"dup-bits", required_argument, NULL, 'K'},
+               {"dup-mem", required_argument, NULL, 'Y'},
                {0,0,0,0},
     };
     int long_index=0;
     const char *prefix;
 
-    while ( (c = getopt_long(argc, argv, "?BzArR:Ddx:MhS:", long_options, &long_index)) != -1) {
+    while ( (c = getopt_long(argc, argv, "?BzArR:Ddx:MhS:t:", long_options, &long_index)) != -1) {
                 switch (c) {
                 case 'd': ++debug; break;                                       // increment debug level
                 case 'D': ++trackdup; break;
@@ -234,14 +485,27 @@ int main(int argc, char **argv) {
                 case 'O': prefix=optarg; break;
                 case 'S': histnum=atoi(optarg); break;
                 case 'x': ext=optarg; break;
+                case 't': nthreads=atoi(optarg); if (nthreads < 1) nthreads=1; break;
                 case 'M': newonly=1; break;
                 case 'z': allow_no_reads = true; break;
                 case 'o': fq_out=1; trackdup=1; break;                     // output suff
+                case 'K': dupcbits=atoi(optarg);
+                          if (dupcbits < 4 || dupcbits > 32) {
+                              fprintf(stderr, "--dup-bits should be between 4 and 32\n");
+                              return 1;
+                          }
+                          break;
+                case 'Y': dupmem=atoi(optarg);
+                          if (dupmem < 1) {
+                              fprintf(stderr, "--dup-mem should be at least 1 (MB)\n");
+                              return 1;
+                          }
+                          break;
                 case 'h': usage(stdout); return 0;
                 case '?':
                      if (!optopt) {
                         usage(stdout); return 0;
-                     } else if (optopt && strchr("ox", optopt))
+                     } else if (optopt && strchr("oxt", optopt))
                        fprintf (stderr, "Option -%c requires an argument.\n", optopt);
                      else if (isprint(optopt))
                        fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -262,404 +526,509 @@ int main(int argc, char **argv) {
 
 	multi = (argc-optind-1) > 0;                // more than 1 input? 
 	if (multi && !ext) 
-		ext = "stats";                          // force serial processed extension-mode
+		ext = "stats";                          // force extension-mode
 	
 	build_basemap();                            // precompute matrices for rabit base->integer (A->0, C->1,. ...etc) lookups
 
 	debugout("argc:%d, argv[1]:%s, multi:%d, ext:%s\n", argc,argv[optind],multi,ext);
 
-    FILE *rnao = NULL;
-
-
-	const char *p;
-	// for each input file
+	// -M: leave inputs alone if their output is already newer
+	vector<const char *> todo;
 	for (;optind < argc;++optind) {
-		sstats s;
 		const char *in = argv[optind];
-		FILE *f;
-		FILE *o=NULL;
-		FILE *rnao=NULL;
-		bool needpclose = 0;
-
-		// decide input format
-		string out;
-
-		if (!strcmp(in,"-")) {
-			// read sam/bam from stdin
-			if (ext||fq_out) {
-				warn("Can't use file extension with stdin\n");
+		if (newonly && ext && strcmp(in,"-")) {
+			string out = outbase(in) + '.' + ext;
+			struct stat si, so;
+			if (!stat(in, &si) && !stat(out.c_str(), &so) && so.st_mtime >= si.st_mtime) {
+				debugout("skip:%s, %s is newer\n", in, out.c_str());
 				continue;
 			}
-			f = stdin;
-			o = stdout;
-		} else {
-			if ((p = strrchr(in,'.')) && !strcmp(p, ".gz")) {
-				// maybe this is a gzipped sam file...
-				string cmd = string_format("gunzip -c '%s'", in);
-				f = popen(cmd.c_str(), "r");
-				needpclose=1;
-				if (f) {
-					char c;
-					if (!inbam) {
-						// guess file format with 1 char
-						c=getc(f); ungetc(c,f);
-						if (c==-1) {
-							warn("Can't unzip %s\n", in);
-							pclose(f);
-							continue;
-						}
-						if (c==31) {
-							// bam file... reopen to reset stream... can't pass directly
-							string cmd = string_format("gunzip -c '%s'", in);
-							f = popen(cmd.c_str(), "r");
-							inbam=1;
-						}
-					} else 
-						c = 31;	// user forced bam, no need to check/reopen
-
-					if (inbam) {
-						// why did you gzip a bam... weird? 
-						if (dup2(fileno(f),0) == -1) {
-						      warn("Can't dup2 STDIN\n");
-						      continue;
-						}
-						in = "-";
-					}
-				} else {
-					warn("Can't unzip %s: %s\n", in, strerror(errno));
-					continue;
-				}
-				// extension mode... output to file minus .gz
-				if (ext||fq_out) 
-					out=string(in, p-in);
-			} else {
-	 			f = fopen(in, "r");
-				if (!f) {
-					warn("Can't open %s: %s\n", in, strerror(errno));
-					continue;
-				}
-				// extension mode... output to file
-				if (ext||fq_out) 
-					out=in;
-			}
-            if (fq_out) {
-                sefq=fopen((out+".fq").c_str(),"w");
-                pefq1=fopen((out+".fq1").c_str(),"w");
-                pefq2=fopen((out+".fq2").c_str(),"w");
-            }
-			if (ext) {
-				( out += '.') += ext;
-				o=fopen(out.c_str(), "w");
-				if (!o) {
-					warn("Can't write %s: %s\n", out.c_str(), strerror(errno));
-					continue;
-				}
-			} else
-				o=stdout;
 		}
+		todo.push_back(in);
+	}
 
-		// more guessing
-		debugout("file:%s, f: %lx\n", in, (long int) f);
-		char c;
-		if (!inbam) {
-			// guess file format
-			c=getc(f); ungetc(c,f);
-			if (c==31 && !strcmp(in,"-")) {
-				// if bamtools api allowed me to pass a stream, this wouldn't be an issue....
-				warn("Specify -B to read a bam file from standard input\n");
-				continue;
-			}
-		} else 
-			c = 31;		// 31 == bam
-
-        if (rnafile) {
-            rnao=fopen(rnafile,"w");
-            if (!rnao) {
-                warn("Can't write %s: %s\n", rnafile, strerror(errno));
-                return 1;
-            }
-        } else {
-            rnao=o;
-        }
- 
-		// parse sam or bam as needed
-		if (c != 31) {
-			// (could be an uncompressed bam... but can't magic in 1 char)
-			if (!s.parse_sam(f)) {
-				if (needpclose) pclose(f); else fclose(f);
-				warn("Invalid or corrupt sam file %s\n", in);
-				continue;
-			}
-		} else {
-			if (!s.parse_bam(in)) {
-				if (needpclose) pclose(f); else fclose(f);
-				warn("Invalid or corrupt bam file %s\n", in);
-				continue;
-			}
-		}
-        int ret;
-		if (needpclose) ret=pclose(f); else ret=fclose(f);
-        if (ret!=0) {
-            warn("Error closing '%s': %s\n", in, strerror(errno));
-            continue;
-        } 
-
-        if (fq_out) {
-            if(sefq && s.dat.pe) {
-                fclose(sefq);
-                unlink((out+".fq").c_str());
-            }
-            if (pefq1 && !s.dat.pe) {
-                fclose(pefq1);
-                fclose(pefq2);
-                unlink((out+".fq1").c_str());
-                unlink((out+".fq2").c_str());
-            }
-        }
+	// multiple files run concurrently, splitting the threads between them
+	// (rna output all goes to one file, so that stays serial)
+	statspool sp;
+	sp.todo = &todo;
+	sp.next = 0;
+	sp.fatal = 0;
+	sp.ext = ext;
+	sp.fq_out = fq_out;
+	sp.rnafile = rnafile;
+	sp.inbam = inbam;
+	int pool = nthreads < (int) todo.size() ? nthreads : (int) todo.size();
+	if (rnafile || pool < 1) pool = 1;
+	sp.nt = nthreads / pool;
+	pthread_mutex_init(&sp.lock, NULL);
+
+	debugout("files:%d, pool:%d, threads per file:%d\n", (int) todo.size(), pool, sp.nt);
+
+	if (pool == 1) {
+		dopool(&sp);
+	} else {
+		vector<pthread_t> tids(pool);
+		int i;
+		for (i=0;i<pool;++i)
+			pthread_create(&tids[i], NULL, dopool, &sp);
+		for (i=0;i<pool;++i)
+			pthread_join(tids[i], NULL);
+	}
+	pthread_mutex_destroy(&sp.lock);
+
+	if (sp.fatal)
+		return 1;
+	return errs ? 1 : 0;
+}
 
-		// sort sstats
-		sort(s.visize.begin(), s.visize.end());
+static void *dopool(void *arg) {
+	statspool *sp = (statspool *) arg;
+	for (;;) {
+		pthread_mutex_lock(&sp->lock);
+		int i = sp->fatal ? sp->todo->size() : sp->next++;
+		pthread_mutex_unlock(&sp->lock);
+		if (i >= sp->todo->size())
+			break;
+		if (dofile((*sp->todo)[i], sp->ext, sp->fq_out, sp->rnafile, sp->inbam, sp->nt) < 0)
+			sp->fatal = 1;
+	}
+	return NULL;
+}
 
-		int phred = s.dat.qualmin < 64 ? 33 : 64;
-		if (!s.dat.n && ! allow_no_reads) {
-			warn("No reads in %s\n", in);
-			continue;
+// output name for an input, before the extension
+static string outbase(const char *in) {
+	const char *p;
+	if ((p = strrchr(in,'.')) && !strcmp(p, ".gz"))
+		return string(in, p-in);
+	return in;
+}
+
+// gzipped bams are read through stdin, one at a time
+pthread_mutex_t stdin_lock = PTHREAD_MUTEX_INITIALIZER;
+class lockguard {
+	pthread_mutex_t *m;
+public:
+	lockguard() : m(NULL) {}
+	void lock(pthread_mutex_t *x) {m=x; pthread_mutex_lock(m);}
+	~lockguard() {if (m) pthread_mutex_unlock(m);}
+};
+
+// output files are written as NAME.tmp, and renamed when they're complete
+static FILE *opentmp(const string &out) {
+	return fopen((out+".tmp").c_str(), "w");
+}
+static void closetmp(FILE *f, const string &out, bool keep) {
+	if (!f) return;
+	fclose(f);
+	if (keep)
+		rename((out+".tmp").c_str(), out.c_str());
+	else
+		unlink((out+".tmp").c_str());
+}
+
+// stats for one input file, -1 if we should give up on everything
+static int dofile(const char *in, const char *ext, int fq_out, const char *rnafile, bool inbam, int nt) {
+	sstats s;
+	FILE *f;
+	FILE *o=NULL;
+	FILE *rnao=NULL;
+	bool needpclose = 0;
+	lockguard stdlock;
+	const char *p;
+
+	// decide input format
+	string out;
+
+	if (!strcmp(in,"-")) {
+		// read sam/bam from stdin
+		if (ext||fq_out) {
+			warn("Can't use file extension with stdin\n");
+			return 0;
 		}
-		fprintf(o, "reads\t%d\n", s.dat.n);
-        if (s.dat.secondary > 0) {
-    		fprintf(o, "secondary\t%d\n", s.dat.secondary);
-        }
-		fprintf(o, "version\t%s.%d\n", VERSION, SVNREV);
-
-		// mapped reads is the number of reads that mapped at least once (either mated or not)
-		if (s.dat.mapn > 0) {
-			if (trackdup && s.dat.dupmax > (s.dat.pe+1)) {
-				google::sparse_hash_map<string,int>::iterator it = s.dups.begin();
-				vector<int> vtmp;
-				int amb = 0;
-				int sing = 0;
-				while(it!=s.dups.end()) {
-					// *not* making the distinction between 2 singleton mappings and 1 paired here
-					if (it->second > (s.dat.pe+1)) {
-						++amb;
+		f = stdin;
+	} else {
+		// extension mode... output to file (minus .gz)
+		if (ext||fq_out) 
+			out=outbase(in);
+		if ((p = strrchr(in,'.')) && !strcmp(p, ".gz")) {
+			// maybe this is a gzipped sam file...
+			string cmd = string_format("gunzip -c '%s'", in);
+			f = popen(cmd.c_str(), "r");
+			needpclose=1;
+			if (f) {
+				char c;
+				if (!inbam) {
+					// guess file format with 1 char
+					c=getc(f); ungetc(c,f);
+					if (c==-1) {
+						warn("Can't unzip %s\n", in);
+						pclose(f);
+						return 0;
+					}
+					if (c==31) {
+						// bam file... reopen to reset stream... can't pass directly
+						pclose(f);
+						string cmd = string_format("gunzip -c '%s'", in);
+						f = popen(cmd.c_str(), "r");
+						inbam=1;
 					}
-					if (it->second == 1 && s.dat.pe) {
-						++sing;	
+				} else 
+					c = 31;	// user forced bam, no need to check/reopen
+
+				if (inbam) {
+					// why did you gzip a bam... weird? 
+					stdlock.lock(&stdin_lock);
+					if (dup2(fileno(f),0) == -1) {
+					      warn("Can't dup2 STDIN\n");
+					      pclose(f);
+					      return 0;
 					}
-					++it;
+					in = "-";
 				}
-                int mapped = (int) s.dups.size()*(s.dat.pe+1)-sing;
-
-				fprintf(o,"mapped reads\t%d\n", mapped);
-				if (amb > 0) {
-                    int unmapped=s.dat.n-s.dat.mapn;
-					fprintf(o,"pct align\t%.6f\n", 100.0*((double)mapped/(double)(mapped+unmapped)));
-					fprintf(o,"ambiguous\t%d\n", amb*(s.dat.pe+1));
-					fprintf(o,"pct ambiguous\t%.6f\n", 100.0*((double)amb/(double)s.dups.size()));
-					fprintf(o,"max dup align\t%.d\n", s.dat.dupmax-s.dat.pe);
-				} else {
-                    // no ambiguous mappings... simple
-				    fprintf(o, "pct align\t%.6f\n", 100.0*(double)s.dat.mapn/(double)s.dat.n);
-                }
-				if (sing)
-					fprintf(o,"singleton mappings\t%.d\n", sing);
-				// number of total mappings
-				fprintf(o, "total mappings\t%d\n", s.dat.mapn);
 			} else {
-				// dup-id's not tracked
-				fprintf(o, "mapped reads\t%d\n", s.dat.mapn);
-				fprintf(o, "pct align\t%.6f\n", 100.0*(double)s.dat.mapn/(double)s.dat.n);
-				// todo: add support for bwa's multiple alignment tag
-				// fprintf(o, "total mappings\t%d\n", s.dat.mapn);
+				warn("Can't unzip %s: %s\n", in, strerror(errno));
+				return 0;
 			}
 		} else {
-			fprintf(o, "mapped reads\t%d\n", s.dat.mapn);
+ 			f = fopen(in, "r");
+			if (!f) {
+				warn("Can't open %s: %s\n", in, strerror(errno));
+				return 0;
+			}
 		}
+	}
 
-        if (s.dat.mapzero > 0) {
-			fprintf(o, "skipped mappings\t%d\n", s.dat.mapzero);
-        }
-
-		fprintf(o, "mapped bases\t%.0f\n", s.dat.tmapb);
-		if (s.dat.pe) {
-			fprintf(o, "library\tpaired-end\n");
+	// more guessing
+	debugout("file:%s, f: %lx\n", in, (long int) f);
+	char c;
+	if (!inbam) {
+		// guess file format
+		c=getc(f); ungetc(c,f);
+		if (c==31 && !strcmp(in,"-")) {
+			// if bamtools api allowed me to pass a stream, this wouldn't be an issue....
+			warn("Specify -B to read a bam file from standard input\n");
+			if (needpclose) pclose(f); else if (f != stdin) fclose(f);
+			return 0;
 		}
-		if (s.dat.disc > 0) {
-			fprintf(o, "discordant mates\t%d\n", s.dat.disc);
+	} else 
+		c = 31;		// 31 == bam
+
+	if (fq_out) {
+		s.sefq=opentmp(out+".fq");
+		s.pefq1=opentmp(out+".fq1");
+		s.pefq2=opentmp(out+".fq2");
+	}
+
+	// parse sam or bam as needed
+	bool ok;
+	if (c != 31) {
+		// (could be an uncompressed bam... but can't magic in 1 char)
+		if (!(ok = s.parse_sam(f))) 
+			warn("Invalid or corrupt sam file %s\n", in);
+	} else {
+		int r = -1;
+		// dups and fastq output need every read in one table, so those stay serial
+		if (nt > 1 && !trackdup && strcmp(in,"-"))
+			r = s.parse_bam_index(in, nt);
+		if (r < 0)
+			r = s.parse_bam(in);
+		if (!(ok = r))
+			warn("Invalid or corrupt bam file %s\n", in);
+	}
+	int ret;
+	if (needpclose) ret=pclose(f); else ret=fclose(f);
+	if (ok && ret!=0) {
+		warn("Error closing '%s': %s\n", in, strerror(errno));
+		ok = false;
+	} 
+
+	if (fq_out) {
+		// keep either the single or the paired files
+		closetmp(s.sefq, out+".fq", ok && !s.dat.pe);
+		closetmp(s.pefq1, out+".fq1", ok && s.dat.pe);
+		closetmp(s.pefq2, out+".fq2", ok && s.dat.pe);
+	}
+
+	if (!ok)
+		return 0;
+
+	if (!s.dat.n && ! allow_no_reads) {
+		warn("No reads in %s\n", in);
+		return 0;
+	}
+
+	if (ext) {
+		( out += '.') += ext;
+		o=opentmp(out);
+		if (!o) {
+			warn("Can't write %s: %s\n", out.c_str(), strerror(errno));
+			return 0;
 		}
-		if (s.dat.disc_pos > 0) {
-			fprintf(o, "distant mates\t%d\n", s.dat.disc_pos);
+	} else
+		o=stdout;
+
+	if (rnafile) {
+		rnao=fopen(rnafile,"w");
+		if (!rnao) {
+			warn("Can't write %s: %s\n", rnafile, strerror(errno));
+			if (o != stdout) closetmp(o, out, false);
+			return -1;
 		}
+	} else {
+		rnao=o;
+	}
 
-		if (s.dat.mapn > 0) {
-           if (s.dat.mapn > 100) {
-                // at least 100 mappings to call a meaningful "percentage" 
-    			fprintf(o, "pct forward\t%.3f\n", 100*(s.dat.nfor/(double)(s.dat.nfor+s.dat.nrev)));
-            }
+	printstats(s, o, rnao);
 
-			fprintf(o, "phred\t%d\n", phred);
-			fprintf(o, "forward\t%d\n", s.dat.nfor);
-			fprintf(o, "reverse\t%d\n", s.dat.nrev);
-			if (s.dat.lenmax != s.dat.lenmin) {
-				fprintf(o, "len max\t%d\n", s.dat.lenmax);	
-				fprintf(o, "len mean\t%.4f\n", s.dat.lensum/s.dat.mapn);	
-				fprintf(o, "len stdev\t%.4f\n", stdev(s.dat.mapn, s.dat.lensum, s.dat.lenssq));	
-			} else {
-				fprintf(o, "len max\t%d\n", s.dat.lenmax);	
-			}
-			fprintf(o, "mapq mean\t%.4f\n", s.dat.mapsum/s.dat.mapn);
-			fprintf(o, "mapq stdev\t%.4f\n", stdev(s.dat.mapn, s.dat.mapsum, s.dat.mapssq));
-
-			fprintf(o, "mapq Q1\t%.2f\n", quantile(s.vmapq,.25));
-			fprintf(o, "mapq median\t%.2f\n", quantile(s.vmapq,.50));
-			fprintf(o, "mapq Q3\t%.2f\n", quantile(s.vmapq,.75));
-
-			if (s.dat.lensum > 0) {
-				fprintf(o, "snp rate\t%.6f\n", s.dat.nmsum/s.dat.lensum);
-				if (s.dat.ins >0 ) fprintf(o, "ins rate\t%.6f\n", s.dat.ins/s.dat.lensum);
-				if (s.dat.del >0 ) fprintf(o, "del rate\t%.6f\n", s.dat.del/s.dat.lensum);
-				fprintf(o, "pct mismatch\t%.4f\n", 100.0*((double)s.dat.nmnz/s.dat.mapn));
-			}
+	if (rnafile)
+		fclose(rnao);
+	if (o != stdout)
+		closetmp(o, out, true);
+	return 0;
+}
 
-			if (s.visize.size() > 0) {
-				double p10 = quantile(s.visize, .10);
-				double p90 = quantile(s.visize, .90);
-				double matsum=0, matssq=0;
-				int matc = 0;
-				int i;
-				for(i=0;i<s.visize.size();++i) {
-					int v = s.visize[i];
-					if (v >= p10 && v <= p90) {
-						++matc;
-						matsum+=v;
-						matssq+=v*v;
-					}
+// the report
+static void printstats(sstats &s, FILE *o, FILE *rnao) {
+	int phred = s.dat.qualmin < 64 ? 33 : 64;
+	fprintf(o, "reads\t%d\n", s.dat.n);
+    if (s.dat.secondary > 0) {
+		fprintf(o, "secondary\t%d\n", s.dat.secondary);
+    }
+	fprintf(o, "version\t%s.%d\n", VERSION, SVNREV);
+
+	// mapped reads is the number of reads that mapped at least once (either mated or not)
+	if (s.dat.mapn > 0) {
+		if (trackdup && s.dat.dupmax > (s.dat.pe+1)) {
+			int amb = 0;
+			int sing = 0;
+			size_t i;
+			for (i=0;i<s.dups.slots();++i) {
+				int x = s.dups.count(i);
+				// *not* making the distinction between 2 singleton mappings and 1 paired here
+				if (x > (s.dat.pe+1)) {
+					++amb;
 				}
-				fprintf(o, "insert mean\t%.4f\n", matsum/matc);
-				if (matc > 1) {
-					fprintf(o, "insert stdev\t%.4f\n", stdev(matc, matsum, matssq));
-					fprintf(o, "insert Q1\t%.2f\n", quantile(s.visize, .25));
-					fprintf(o, "insert median\t%.2f\n", quantile(s.visize, .50));
-					fprintf(o, "insert Q3\t%.2f\n", quantile(s.visize, .75));
+				if (x == 1 && s.dat.pe) {
+					++sing;	
 				}
 			}
+            // alignments of ids a full --dup-mem table didn't take count as mapped once, never ambiguous
+            int mapped = (int) s.dups.size()*(s.dat.pe+1)-sing+s.dups.untracked();
+
+			fprintf(o,"mapped reads\t%d\n", mapped);
+			if (s.dups.untracked())
+				fprintf(o,"dup untracked\t%d\n", (int) s.dups.untracked());
+			if (amb > 0) {
+                int unmapped=s.dat.n-s.dat.mapn;
+				fprintf(o,"pct align\t%.6f\n", 100.0*((double)mapped/(double)(mapped+unmapped)));
+				fprintf(o,"ambiguous\t%d\n", amb*(s.dat.pe+1));
+				fprintf(o,"pct ambiguous\t%.6f\n", 100.0*((double)amb/(double)(s.dups.size()+s.dups.untracked())));
+				fprintf(o,"max dup align\t%.d\n", s.dat.dupmax-s.dat.pe);
+			} else {
+                // no ambiguous mappings... simple
+			    fprintf(o, "pct align\t%.6f\n", 100.0*(double)s.dat.mapn/(double)s.dat.n);
+            }
+			if (sing)
+				fprintf(o,"singleton mappings\t%.d\n", sing);
+			// number of total mappings
+			fprintf(o, "total mappings\t%d\n", s.dat.mapn);
+		} else {
+			// dup-id's not tracked
+			fprintf(o, "mapped reads\t%d\n", s.dat.mapn);
+			fprintf(o, "pct align\t%.6f\n", 100.0*(double)s.dat.mapn/(double)s.dat.n);
+			// todo: add support for bwa's multiple alignment tag
+			// fprintf(o, "total mappings\t%d\n", s.dat.mapn);
+		}
+	} else {
+		fprintf(o, "mapped reads\t%d\n", s.dat.mapn);
+	}
+
+    if (s.dat.mapzero > 0) {
+		fprintf(o, "skipped mappings\t%d\n", s.dat.mapzero);
+    }
+
+	fprintf(o, "mapped bases\t%.0f\n", s.dat.tmapb);
+	if (s.dat.pe) {
+		fprintf(o, "library\tpaired-end\n");
+	}
+	if (s.dat.disc > 0) {
+		fprintf(o, "discordant mates\t%d\n", s.dat.disc);
+	}
+	if (s.dat.disc_pos > 0) {
+		fprintf(o, "distant mates\t%d\n", s.dat.disc_pos);
+	}
+
+	if (s.dat.mapn > 0) {
+       if (s.dat.mapn > 100) {
+            // at least 100 mappings to call a meaningful "percentage" 
+			fprintf(o, "pct forward\t%.3f\n", 100*(s.dat.nfor/(double)(s.dat.nfor+s.dat.nrev)));
+        }
 
-			if (s.dat.nbase >0) {
-				fprintf(o,"base qual mean\t%.4f\n", (s.dat.qualsum/s.dat.nbase)-phred);
-				fprintf(o,"base qual stdev\t%.4f\n", stdev(s.dat.nbase, s.dat.qualsum, s.dat.qualssq));
-				fprintf(o,"%%A\t%.4f\n", 100.0*((double)s.dat.basecnt[T_A]/(double)s.dat.nbase));
-				fprintf(o,"%%C\t%.4f\n", 100.0*((double)s.dat.basecnt[T_C]/(double)s.dat.nbase));
-				fprintf(o,"%%G\t%.4f\n", 100.0*((double)s.dat.basecnt[T_G]/(double)s.dat.nbase));
-				fprintf(o,"%%T\t%.4f\n", 100.0*((double)s.dat.basecnt[T_T]/(double)s.dat.nbase));
-				if (s.dat.basecnt[T_N] > 0) {
-					fprintf(o,"%%N\t%.4f\n", 100.0*((double)s.dat.basecnt[T_N]/(double)s.dat.nbase));
+		fprintf(o, "phred\t%d\n", phred);
+		fprintf(o, "forward\t%d\n", s.dat.nfor);
+		fprintf(o, "reverse\t%d\n", s.dat.nrev);
+		if (s.dat.lenmax != s.dat.lenmin) {
+			fprintf(o, "len max\t%d\n", s.dat.lenmax);	
+			fprintf(o, "len mean\t%.4f\n", s.dat.lensum/s.dat.mapn);	
+			fprintf(o, "len stdev\t%.4f\n", stdev(s.dat.mapn, s.dat.lensum, s.dat.lenssq));	
+			fprintf(o, "len Q1\t%.2f\n", quantile(s.vlen, .25));
+			fprintf(o, "len median\t%.2f\n", quantile(s.vlen, .50));
+			fprintf(o, "len Q3\t%.2f\n", quantile(s.vlen, .75));
+		} else {
+			fprintf(o, "len max\t%d\n", s.dat.lenmax);	
+		}
+		fprintf(o, "mapq mean\t%.4f\n", s.dat.mapsum/s.dat.mapn);
+		fprintf(o, "mapq stdev\t%.4f\n", stdev(s.dat.mapn, s.dat.mapsum, s.dat.mapssq));
+
+		fprintf(o, "mapq Q1\t%.2f\n", quantile(s.vmapq,.25));
+		fprintf(o, "mapq median\t%.2f\n", quantile(s.vmapq,.50));
+		fprintf(o, "mapq Q3\t%.2f\n", quantile(s.vmapq,.75));
+
+		if (s.dat.lensum > 0) {
+			fprintf(o, "snp rate\t%.6f\n", s.dat.nmsum/s.dat.lensum);
+			if (s.dat.ins >0 ) fprintf(o, "ins rate\t%.6f\n", s.dat.ins/s.dat.lensum);
+			if (s.dat.del >0 ) fprintf(o, "del rate\t%.6f\n", s.dat.del/s.dat.lensum);
+			fprintf(o, "pct mismatch\t%.4f\n", 100.0*((double)s.dat.nmnz/s.dat.mapn));
+		}
+
+		if (s.visize.size() > 0) {
+			double p10 = quantile(s.visize, .10);
+			double p90 = quantile(s.visize, .90);
+			double matsum=0, matssq=0;
+			long long matc = 0;
+			int i;
+			for(i=0;i<s.visize.bins();++i) {
+				double v = s.visize.value(i);
+				long long c = s.visize.count(i);
+				if (c && v >= p10 && v <= p90) {
+					matc+=c;
+					matsum+=v*c;
+					matssq+=v*v*c;
 				}
 			}
-			// how many ref seqs have mapped bases?
-			int mseq=0;
-			google::dense_hash_map<string,scoverage>::iterator it = s.covr.begin();
-			vector<string> vtmp;
-			bool haverlen = 0;
-			while (it != s.covr.end()) {
-				if (it->second.mapb > 0) {
-					++mseq;								// number of mapped refseqs
-					if (mseq <= max_chr) vtmp.push_back(it->first);		// don't bother if too many chrs
-					if (it->second.reflen > 0) haverlen = 1;
-				}
-				++it;
+			fprintf(o, "insert mean\t%.4f\n", matsum/matc);
+			if (matc > 1) {
+				fprintf(o, "insert stdev\t%.4f\n", stdev(matc, matsum, matssq));
+				fprintf(o, "insert Q1\t%.2f\n", quantile(s.visize, .25));
+				fprintf(o, "insert median\t%.2f\n", quantile(s.visize, .50));
+				fprintf(o, "insert Q3\t%.2f\n", quantile(s.visize, .75));
 			}
-			// don't print per-seq percentages if size is huge, or is 1
-			if ((haverlen || mseq > 1) && mseq <= max_chr) {			// worth reporting
-				// sort the id's
-				sort(vtmp.begin(),vtmp.end());
-				vector<string>::iterator vit=vtmp.begin();
-				double logb=log(2);
-                vector<double> vcovrvar;
-                vector<double> vcovr;
-                vector<double> vskew;
-                // for each chromosome or reference sequence...
-				while (vit != vtmp.end()) {
-					scoverage &v = s.covr[*vit];                    // coverage vector
-					if (v.reflen && histnum > 0) {                  // user asked for histogram
-						string sig;
-						int d; double logd, lsum=0, lssq=0;
-
-						for (d=0;d<histnum;++d) {                   // log counts for each portion of the histogram
-                            logd = log(1+v.dist[d])/logb;
-                            lsum+=logd;
-                            lssq+=logd*logd;
-							sig += ('0' + (int) logd);
-						}
-                        if (rnamode) {
-                            // variability of coverage
-                            double cv = stdev(histnum, lsum, lssq)/(lsum/histnum);
-                            // percent coverage estimated using historgram... maybe track real coverage some day, for now this is fine
-                            double covr = 0;
-                            for (d=0;d<histnum;++d) {
-                                // VFAC = % greater than 1 that a bin must be to be considered 100%
-                                if (v.dist[d] > VFACTOR*v.reflen/histnum) {
-                                    ++covr;     // 100% covered this bin
-                                } else {
-                                    // calc bases/(factor * size of bin)
-                                    covr += ((double)v.dist[d] / ((double)VFACTOR*v.reflen/histnum));
-                                }
-                            }
-                            double origcovr = covr;
-                            covr /= (double) histnum;
-                            covr = min(100.0*((double)v.mapb/v.reflen),100.0*covr);
-                            // when dealing with "position skewness", you need to anchor things
-                            v.spos.Push(v.reflen);
-                            v.spos.Push(1);
-                            double skew = -v.spos.Skewness();
-                            // if there's some coverage
-                            if (v.mapr > 0) {
-                                if (v.mapr > 10) {
-                                    // summary stats
-                                    vcovr.push_back(covr);              // look at varition
-                                    vcovrvar.push_back(cv);             // look at varition
-                                    vskew.push_back(skew);              // and skew
-                                }
-                                if (rnao) {                         // "rna mode"  = more detailed output of coverage and skewness of coverage
-        						    fprintf(rnao,"%s\t%d\t%ld\t%.2f\t%.4f\t%.4f\t%s\n", vit->c_str(), v.reflen, v.mapr, covr, skew, cv, sig.c_str());
-                                }
+		}
+
+		if (s.dat.nbase >0) {
+			fprintf(o,"base qual mean\t%.4f\n", (s.dat.qualsum/s.dat.nbase)-phred);
+			fprintf(o,"base qual stdev\t%.4f\n", stdev(s.dat.nbase, s.dat.qualsum, s.dat.qualssq));
+			fprintf(o,"%%A\t%.4f\n", 100.0*((double)s.dat.basecnt[T_A]/(double)s.dat.nbase));
+			fprintf(o,"%%C\t%.4f\n", 100.0*((double)s.dat.basecnt[T_C]/(double)s.dat.nbase));
+			fprintf(o,"%%G\t%.4f\n", 100.0*((double)s.dat.basecnt[T_G]/(double)s.dat.nbase));
+			fprintf(o,"%%T\t%.4f\n", 100.0*((double)s.dat.basecnt[T_T]/(double)s.dat.nbase));
+			if (s.dat.basecnt[T_N] > 0) {
+				fprintf(o,"%%N\t%.4f\n", 100.0*((double)s.dat.basecnt[T_N]/(double)s.dat.nbase));
+			}
+		}
+		// how many ref seqs have mapped bases?
+		int mseq=0;
+		vector<int> vtmp;
+		bool haverlen = 0;
+		int r;
+		for (r=0;r<s.covr.size();++r) {
+			if (s.covr[r].mapb > 0) {
+				++mseq;								// number of mapped refseqs
+				if (mseq <= max_chr) vtmp.push_back(r);		// don't bother if too many chrs
+				if (s.covr[r].reflen > 0) haverlen = 1;
+			}
+		}
+		// don't print per-seq percentages if size is huge, or is 1
+		if ((haverlen || mseq > 1) && mseq <= max_chr) {			// worth reporting
+			// sort the id's by name
+			sort(vtmp.begin(),vtmp.end(),refname_lt(s.rnames));
+			vector<int>::iterator vit=vtmp.begin();
+			double logb=log(2);
+            vector<double> vcovrvar;
+            vector<double> vcovr;
+            vector<double> vskew;
+            // for each chromosome or reference sequence...
+			while (vit != vtmp.end()) {
+				scoverage &v = s.covr[*vit];                    // coverage vector
+				const char *vname = s.rnames[*vit].c_str();
+				if (v.reflen && histnum > 0) {                  // user asked for histogram
+					string sig;
+					int d; double logd, lsum=0, lssq=0;
+
+					for (d=0;d<histnum;++d) {                   // log counts for each portion of the histogram
+                        logd = log(1+v.dist[d])/logb;
+                        lsum+=logd;
+                        lssq+=logd*logd;
+						sig += ('0' + (int) logd);
+					}
+                    if (rnamode) {
+                        // variability of coverage
+                        double cv = stdev(histnum, lsum, lssq)/(lsum/histnum);
+                        // percent coverage estimated using historgram... maybe track real coverage some day, for now this is fine
+                        double covr = 0;
+                        for (d=0;d<histnum;++d) {
+                            // VFAC = % greater than 1 that a bin must be to be considered 100%
+                            if (v.dist[d] > VFACTOR*v.reflen/histnum) {
+                                ++covr;     // 100% covered this bin
+                            } else {
+                                // calc bases/(factor * size of bin)
+                                covr += ((double)v.dist[d] / ((double)VFACTOR*v.reflen/histnum));
                             }
-                        } else if (max_chr < 100) {                 // normal dna mode, just print percent alignment to each
-    						fprintf(o,"%%%s\t%.2f\t%s\n", vit->c_str(), 100.0*((double)v.mapb/s.dat.lensum), sig.c_str());
-                        } else {
-    						fprintf(o,"%%%s\t%.6f\t%s\n", vit->c_str(), 100.0*((double)v.mapb/s.dat.lensum), sig.c_str());
                         }
-					} else {
-                        if (max_chr < 100) {
-						    fprintf(o,"%%%s\t%.2f\n", vit->c_str(), 100.0*((double)v.mapb/s.dat.lensum));
-                        } else {
-						    fprintf(o,"%%%s\t%.6f\n", vit->c_str(), 100.0*((double)v.mapb/s.dat.lensum));
+                        double origcovr = covr;
+                        covr /= (double) histnum;
+                        covr = min(100.0*((double)v.mapb/v.reflen),100.0*covr);
+                        // when dealing with "position skewness", you need to anchor things
+                        v.spos.Push(v.reflen);
+                        v.spos.Push(1);
+                        double skew = -v.spos.Skewness();
+                        // if there's some coverage
+                        if (v.mapr > 0) {
+                            if (v.mapr > 10) {
+                                // summary stats
+                                vcovr.push_back(covr);              // look at varition
+                                vcovrvar.push_back(cv);             // look at varition
+                                vskew.push_back(skew);              // and skew
+                            }
+                            if (rnao) {                         // "rna mode"  = more detailed output of coverage and skewness of coverage
+    						    fprintf(rnao,"%s\t%d\t%ld\t%.2f\t%.4f\t%.4f\t%s\n", vname, v.reflen, v.mapr, covr, skew, cv, sig.c_str());
+                            }
                         }
-					}
-					++vit;
+                    } else if (max_chr < 100) {                 // normal dna mode, just print percent alignment to each
+						fprintf(o,"%%%s\t%.2f\t%s\n", vname, 100.0*((double)v.mapb/s.dat.lensum), sig.c_str());
+                    } else {
+						fprintf(o,"%%%s\t%.6f\t%s\n", vname, 100.0*((double)v.mapb/s.dat.lensum), sig.c_str());
+                    }
+				} else {
+                    if (max_chr < 100) {
+					    fprintf(o,"%%%s\t%.2f\n", vname, 100.0*((double)v.mapb/s.dat.lensum));
+                    } else {
+					    fprintf(o,"%%%s\t%.6f\n", vname, 100.0*((double)v.mapb/s.dat.lensum));
+                    }
 				}
-                if (rnamode) {
-		            sort(vcovr.begin(), vcovr.end());
-		            sort(vcovrvar.begin(), vcovrvar.end());
-		            sort(vskew.begin(), vskew.end());
-                    double medcovrvar = quantile(vcovrvar,.5);
-                    double medcovr = quantile(vcovr,.5);
-                    double medskew = quantile(vskew,.5);
-                    fprintf(o,"median skew\t%.2f\n", medskew);
-                    fprintf(o,"median coverage cv\t%.2f\n", medcovrvar);
-                    fprintf(o,"median coverage\t%.2f\n", medcovr);
-                }
-			}
-			if (s.covr.size() > 1) {
-				fprintf(o,"num ref seqs\t%d\n", (int) s.covr.size());
-				fprintf(o,"num ref aligned\t%d\n", (int) mseq);
-			}
-		} else {
-			if (s.covr.size() > 1) {
-				fprintf(o,"num ref seqs\t%d\n", (int) s.covr.size());
+				++vit;
 			}
+            if (rnamode) {
+	            sort(vcovr.begin(), vcovr.end());
+	            sort(vcovrvar.begin(), vcovrvar.end());
+	            sort(vskew.begin(), vskew.end());
+                double medcovrvar = quantile(vcovrvar,.5);
+                double medcovr = quantile(vcovr,.5);
+                double medskew = quantile(vskew,.5);
+                fprintf(o,"median skew\t%.2f\n", medskew);
+                fprintf(o,"median coverage cv\t%.2f\n", medcovrvar);
+                fprintf(o,"median coverage\t%.2f\n", medcovr);
+            }
+		}
+		if (s.covr.size() > 1) {
+			fprintf(o,"num ref seqs\t%d\n", (int) s.covr.size());
+			fprintf(o,"num ref aligned\t%d\n", (int) mseq);
+		}
+	} else {
+		if (s.covr.size() > 1) {
+			fprintf(o,"num ref seqs\t%d\n", (int) s.covr.size());
 		}
 	}
-	return errs ? 1 : 0;
 }
 
 #define S_ID 0
@@ -674,20 +1043,21 @@ int main(int argc, char **argv) {
 #define S_QUAL 10
 #define S_TAG 11
 
-void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos, int mapq, const string &materef, int nmate, const string &seq, const char *qual, int nm, int del, int ins) {
+bool sstats::dostats(const char *name, int rlen, int bits, int ref, int pos, int mapq, bool matediff, int nmate, int nm, int del, int ins) {
 
 	++dat.n;
 
-	if (bits & 0x04) return;       // bits say ... query was not mapped
+	if (bits & 0x04) return false; // bits say ... query was not mapped
 
 	if (pos<=0) {
 	    ++dat.mapzero;             // quantify weird errors
-        return;				       // not mapped well enough to count
+        return false;			       // not mapped well enough to count
     }
 
 	++dat.mapn;                    // mapped query
 
-    // TODO: build a histogram of read lengths using the integer bucket
+    // read length histogram
+	vlen.push(rlen);
 
     // read length min/max
 	if (rlen > dat.lenmax) dat.lenmax = rlen;
@@ -733,31 +1103,35 @@ void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos
 	dat.ins+=ins;                               // insert sum
 
     // if we know about the reference sequence
-	if (ref.length()) {
+	if (ref >= 0) {
 		scoverage *sc = &(covr[ref]);
 		if (sc) {                               // and we have ram for coverage
 			sc->mapb+=rlen;                     // total up mapped bases in that ref
             if (rnamode) {                      // more detailed
-                int i;
 			    sc->mapr+=1;
-                for (i=0;i<rlen;++i) {          // walk along read
-                    sc->spos.Push(pos+i);       // per-position stats
-                }
+                sc->spos.PushRange(pos, rlen);  // per-position stats, for the whole run of positions the read covers
 			    if (histnum > 0 && sc->reflen > 0) {                                // if we're making a histogram
-                    for (i=0;i<rlen;++i) {                                          // walk along read
-				        int x = histnum * ((double)(pos+i) / sc->reflen);           // find the bucket this base is in
-                        if (x < histnum) {                                          
-                            sc->dist[x]+=1;                                         // add 1 to that bucket
-                        } else {
+                    int p = pos, e = pos+rlen;
+                    while (p < e) {                                                 // walk along read, a bucket at a time
+                        int x = histbin(p, sc->reflen);                             // find the bucket this base is in
+                        if (x >= histnum) {
                             // out of bounds.... what to do?
-                            sc->dist[histnum] += 1;                                 // out of bounds bases (fall off the edge) = extra bucket
+                            sc->dist[histnum] += e-p;                               // out of bounds bases (fall off the edge) = extra bucket
+                            break;
                         }
+                        // first position in the next bucket
+                        int nb = (int) (((long long) (x+1) * sc->reflen + histnum - 1) / histnum);
+                        while (nb-1 > p && histbin(nb-1, sc->reflen) > x) --nb;     // same rounding as histbin
+                        while (histbin(nb, sc->reflen) <= x) ++nb;
+                        if (nb > e) nb = e;
+                        sc->dist[x] += nb-p;                                        // add the bases to that bucket
+                        p = nb;
                     }
                 }
             } else if (histnum > 0 && sc->reflen > 0) {                             // lightweight... don't deal with each base, ok becauss CHRs are big
-				int x = histnum * ((double)pos / sc->reflen);
+				int x = histbin(pos, sc->reflen);
 				if (debug > 1) { 
-					warn("chr: %s, hn: %d, pos: %d, rl: %d, x: %x\n", ref.c_str(), histnum, pos, sc->reflen, x);
+					warn("chr: %s, hn: %d, pos: %d, rl: %d, x: %x\n", rnames[ref].c_str(), histnum, pos, sc->reflen, x);
 				}
 				if (x < histnum) {
                     sc->dist[x]+=rlen;
@@ -772,12 +1146,12 @@ void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos
 	dat.tmapb+=rlen;
 	if (nmate>0) {
         // insert size histogram
-		visize.push_back(nmate);
+		visize.push(nmate);
 		dat.pe=1;
 	}
 
     // mate reference chromosome is not the same as my own?
-	if (materef.size() && (materef != "=" && materef != "*" && materef != ref)) {
+	if (matediff) {
         // this is a discordant read
 		dat.disc++;
 	} else {
@@ -788,93 +1162,94 @@ void sstats::dostats(string name, int rlen, int bits, const string &ref, int pos
 		}
 	}
 
+	return true;
+}
+
+void sstats::dobases(const char *seq, const char *qual, int len) {
     // walk along sequence, add qualities to overall min/max/mean/stdev 
-	int i, j;
-	for (i=0;i<seq.length();++i) {
+	int i;
+	for (i=0;i<len;++i) {
 		if (qual[i]>dat.qualmax) dat.qualmax=qual[i];
 		if (qual[i]<dat.qualmin) dat.qualmin=qual[i];
 		dat.qualsum+=qual[i];
 		dat.qualssq+=qual[i]*qual[i];
         // also count bases
 		++dat.basecnt[basemap[seq[i]]];
-        // total number of bases counted (this should be the same as tmapb???   get rid of it???)
-		++dat.nbase;
 	}
+    // total number of bases counted (this should be the same as tmapb???   get rid of it???)
+	dat.nbase+=len;
+}
 
-    // TODO: we should be able to use the "non primary" bit field
-    //       need to test to see if this works for all aligners
-    //       then have a mode that only report stats for primary alignments... for example, and no need for this 
-    //       expensive, giant hash table
-
-    // duplicate tracking turned on?
-	if (trackdup) {
-		size_t p;
-        // illumina mode... check for a space in the name, and ignore stuff after it
-        // @HWI-ST1131:111228:C0B0NACXX:2:1101:1230:2118 1:N:0
-
-        /// most aligners remove the space... but not all
-		if (((p = name.find_first_of(' '))!=string::npos) ) {
-			name.resize(p);
-        }
+// duplicate tracking turned on... count alignments per read id
+
+// TODO: we should be able to use the "non primary" bit field
+//       need to test to see if this works for all aligners
+//       then have a mode that only report stats for primary alignments... for example, and no need for this 
+//       expensive, giant hash table
+void sstats::dodup(const char *rname, int bits, const char *seq, const char *qual) {
+	size_t p;
+	string &name = dname;
+	name = rname;
+    // illumina mode... check for a space in the name, and ignore stuff after it
+    // @HWI-ST1131:111228:C0B0NACXX:2:1101:1230:2118 1:N:0
+
+    /// most aligners remove the space... but not all
+	if (((p = name.find_first_of(' '))!=string::npos) ) {
+		name.resize(p);
+    }
 
-        /// remove up to flowcell serial number... in case this is a mixture
-        if (((p = name.find_first_of(':'))!=string::npos) ) {
-            if (((p = name.find_first_of(':', p+1))!=string::npos) ) {
-                name=name.substr(p+1);
-                // D0H4MACXX:3:2307:8426:193536
-                if (((p = name.find_first_of(':'))!=string::npos) ) {
-                    if (((p = name.find_first_of(':', p+1))!=string::npos) ) {
-                        if (isdigit(name[p+1])) {
-                            struct id_t { uint16_t i1, i2; uint32_t i3; };
-                            if (((name.length()-p-1)-1) > (sizeof(struct id_t)+1)) {
-                                struct id_t id;
-                                if (sscanf(name.data()+p+1,"%hu:%hu:%u", &id.i1, &id.i2, &id.i3) == 3) {
-                                    * (struct id_t *) (void *) (name.data()+p+1) = id;
-                                    name.resize(p+1+sizeof(id_t));
-                                }
-                            }
-                        }
-                    }
-                } 
-            }
+    /// remove up to flowcell serial number... in case this is a mixture
+    if (((p = name.find_first_of(':'))!=string::npos) ) {
+        if (((p = name.find_first_of(':', p+1))!=string::npos) ) {
+            name.erase(0, p+1);
         }
+    }
 
-        // count dups for that id
-		int x=++dups[name];
+    // count dups for that id ... only a fingerprint of the id is kept
+	int x=dups.add(name.data(), name.length());
 
-        // keep track of max dups
-		if (x>dat.dupmax) 
-			dat.dupmax=x;
+    // keep track of max dups
+	if (x>dat.dupmax) 
+		dat.dupmax=x;
 
-        // fastq-output mode... 
-        if (sefq) {
-            // if the data isn't paired end or if we're not sure yet
-            if (!dat.pe || dat.mapn < 1000) {
-                // output a single end fq
-                fprintf(sefq,"@%s\n%s\n+\n%s\n",name.c_str(), seq.c_str(), qual);
-            }
+    // fastq-output mode... 
+    if (sefq) {
+        // if the data isn't paired end or if we're not sure yet
+        if (!dat.pe || dat.mapn < 1000) {
+            // output a single end fq
+            fprintf(sefq,"@%s\n%s\n+\n%s\n",name.c_str(), seq, qual);
         }
+    }
 
-        // if we're outputting paired-end fastq's and if there's not a lot of dups
-        if (pefq1 && x < 4 && (dat.pe || dat.mapn < 1000)) {
-            fqent fq;
-            google::sparse_hash_map<string,fqent>::iterator it=petab.find(name);
-            // find my mate?
-            if (it == petab.end()) {
-                // no, add me
-                fq.r=seq;
-                fq.q=qual;
-                fq.bits=bits&0x40;                  // mate flag
-                petab[name]=fq;
-            } else if (it->second.bits != bits) {
-                // yes? remove me
-                fq=it->second;
-                fprintf(pefq1,"@%s 1\n%s\n+\n%s\n",name.c_str(), fq.r.c_str(), fq.q.c_str());
-                fprintf(pefq2,"@%s 2\n%s\n+\n%s\n",name.c_str(), seq.c_str(), qual);
-                petab.erase(it); 
-            }
+    // if we're outputting paired-end fastq's and if there's not a lot of dups
+    if (pefq1 && x < 4 && (dat.pe || dat.mapn < 1000)) {
+        fqent fq;
+        google::sparse_hash_map<string,fqent>::iterator it=petab.find(name);
+        // find my mate?
+        if (it == petab.end()) {
+            // no, add me
+            fq.r=seq;
+            fq.q=qual;
+            fq.bits=bits&0x40;                  // mate flag
+            petab[name]=fq;
+        } else if (it->second.bits != bits) {
+            // yes? remove me
+            fq=it->second;
+            fprintf(pefq1,"@%s 1\n%s\n+\n%s\n",name.c_str(), fq.r.c_str(), fq.q.c_str());
+            fprintf(pefq2,"@%s 2\n%s\n+\n%s\n",name.c_str(), seq, qual);
+            petab.erase(it); 
         }
-	}
+    }
+}
+
+// atoi, without the locale and whitespace handling
+static inline int satoi(const char *p) {
+	int n=0, neg=0;
+	if (*p == '-') { neg=1; ++p; }
+	else if (*p == '+') ++p;
+	while (*p >= '0' && *p <= '9')
+		n = n*10 + (*p++ - '0');
+	return neg ? -n : n;
 }
 
 // parse a sam file... maybe let samtools do this, and then handle stats in "bam mode"... faster for sure
@@ -901,28 +1276,28 @@ bool sstats::parse_sam(FILE *f) {
 					}
 					t=strtok_r(NULL, "\t", &sp);
 				}
-				covr[sname].reflen=slen;
+				covr[refid(sname.c_str())].reflen=slen;
 			}
 			continue;
 		}
-		char *t=strtok_r(l.s, "\t", &sp);
-		char *d[100]; meminit(d);
-		int n =0;
-		while(t) {
-			d[n++]=t;
-			t=strtok_r(NULL, "\t", &sp);
-		}
-		int nm=0;
-		int i;
-		// get # mismatches
-		for (i=S_TAG;i<n;++i){
-			if (d[i] && !strncasecmp(d[i],"NM:i:",5)) {
-				nm=atoi(&d[i][5]);
+		// split out the fixed columns, one pass, tags are left alone
+		char *d[S_TAG+1];
+		int n = 0;
+		char *p = l.s;
+		if (l.n > 0 && p[l.n-1] == '\n') p[l.n-1] = '\0';
+		d[n++] = p;
+		while (*p && n <= S_TAG) {
+			if (*p == '\t') {
+				*p = '\0';
+				d[n++] = p+1;
 			}
+			++p;
 		}
+		int rlen = (n > S_READ+1) ? d[S_READ+1]-d[S_READ]-1 : 0;
 
-		if (!d[S_BITS] || !isdigit(d[S_BITS][0]) 
-		 || !d[S_POS]  || !isdigit(d[S_POS][0])
+		if (n <= S_QUAL
+		 || !isdigit(d[S_BITS][0]) 
+		 || !isdigit(d[S_POS][0])
 		   ) {
             if (warnings < 5) {
                 warn("Line %d, missing bits/position information\n", lineno);
@@ -932,30 +1307,145 @@ bool sstats::parse_sam(FILE *f) {
 			return false;
 		}
 
+		// get # mismatches
+		int nm=0;
+		if (n > S_TAG) {
+			for (p=d[S_TAG];*p;) {
+				if ((p[0]|0x20)=='n' && (p[1]|0x20)=='m' && p[2]==':' && (p[3]|0x20)=='i' && p[4]==':') {
+					nm=satoi(p+5);
+					break;
+				}
+				while (*p && *p != '\t') ++p;
+				if (*p) ++p;
+			}
+		}
+
 		int ins = 0, del = 0;	
-		char *p=d[S_CIG];
+		p=d[S_CIG];
 		// sum the cig
 		while (*p) {
-			int n=strtod(p, &sp);
-			if (sp==p) {
+			int n=0;
+			char *sp=p;
+			while (*p >= '0' && *p <= '9')
+				n = n*10 + (*p++ - '0');
+			if (sp==p || !*p) {
 				break;
 			}
-			if (*sp == 'I') 
-				ins+=n;
-			else if (*sp == 'D') 
-				del+=n;
-			p=sp+1;
+			switch (*p++) {
+				case 'I': ins+=n; break;
+				case 'D': del+=n; break;
+			}
 		}
 
+		int pos = satoi(d[S_POS]);
         // force unmapped to position negative one
-		if (d[S_CIG][0] == '*') d[S_POS] = (char *) "-1";
+		if (d[S_CIG][0] == '*') pos = -1;
 
         // as-if it were a bam...
-		dostats(d[S_ID],strlen(d[S_READ]),atoi(d[S_BITS]),d[S_NMO],atoi(d[S_POS]),atoi(d[S_MAPQ]),d[S_MATEREF],atoi(d[S_MATE]),d[S_READ],d[S_QUAL],nm, ins, del);
+		int bits = satoi(d[S_BITS]);
+		// only mapped reads get a ref id
+		int ref = ((bits & 0x04) || pos <= 0) ? -1 : refid(d[S_NMO]);
+		const char *mref = d[S_MATEREF];
+		bool matediff = *mref && strcmp(mref, "=") && strcmp(mref, "*") && strcmp(mref, d[S_NMO]);
+		if (dostats(d[S_ID],rlen,bits,ref,pos,satoi(d[S_MAPQ]),matediff,satoi(d[S_MATE]),nm, ins, del)) {
+			dobases(d[S_READ], d[S_QUAL], rlen);
+			if (trackdup) 
+				dodup(d[S_ID], bits, d[S_READ], d[S_QUAL]);
+		}
 	}
 	return true;
 }
 
+int sstats::refid(const char *name) {
+	if (lastref >= 0 && !strcmp(rnames[lastref].c_str(), name))
+		return lastref;
+	google::dense_hash_map<string,int>::iterator it = rids.find(name);
+	if (it != rids.end())
+		return lastref = it->second;
+	lastref = rnames.size();
+	rnames.push_back(name);
+	rids[rnames.back()] = lastref;
+	covr.resize(lastref+1);
+	return lastref;
+}
+
+// ref lengths from the bam header, ref ids are the same as the tids
+void sstats::doheader(const bam_header_t *h) {
+    if (h) {
+        int i;
+        assert(covr.empty());
+        covr.resize(h->n_targets);
+        rnames.resize(h->n_targets);
+        for (i = 0; i < h->n_targets; ++i) {
+            rnames[i] = h->target_name[i];
+            rids[rnames[i]] = i;
+            covr[i].reflen=h->target_len[i];
+        }
+    }
+}
+
+// one bam record
+void sstats::dobam(bam1_t *al, const bam_header_t *h) {
+    uint32_t *cig = bam1_cigar(al);
+    char *name = bam1_qname(al);
+    int len = al->core.l_qseq;
+    uint8_t *tag=bam_aux_get(al, "NM");     // NM tag
+	int nm = tag ? bam_aux2i(tag) : 0;
+	int ins=0, del=0;
+	int i;
+
+    // count inserts and deletions
+	for (i=0;i<al->core.n_cigar;++i) {
+        int op = cig[i] & BAM_CIGAR_MASK;
+		if (op == BAM_CINS) {
+			ins+=(cig[i] >> BAM_CIGAR_SHIFT);
+		} else if (op == BAM_CDEL) {
+			del+=(cig[i] >> BAM_CIGAR_SHIFT);
+		}
+	}
+
+    // crappy cigar?
+	int pos = al->core.pos+1;
+	if (al->core.n_cigar == 0) 
+		pos=0;                              // not really a match if there's no cigar string... this deals with bwa's issue
+
+    // now do stats
+	if (!dostats(name,len,al->core.flag,al->core.tid,pos,al->core.qual, al->core.mtid>=0 && al->core.mtid!=al->core.tid, al->core.isize, nm, ins, del))
+		return;
+
+    // bases straight from the packed sequence, 2 per byte
+    uint8_t *bamseq = bam1_seq(al);
+    uint8_t *qual = bam1_qual(al);          // raw phred, no +33
+	for (i=0;i+1<len;i+=2) {
+		const unsigned char *bp = basepair[bamseq[i>>1]];
+		++dat.basecnt[bp[0]];
+		++dat.basecnt[bp[1]];
+	}
+	if (len & 1)
+		++dat.basecnt[basepair[bamseq[len>>1]][0]];
+	for (i=0;i<len;++i) {
+		char q = qual[i]+33;
+		if (q>dat.qualmax) dat.qualmax=q;
+		if (q<dat.qualmin) dat.qualmin=q;
+		dat.qualsum+=q;
+		dat.qualssq+=q*q;
+	}
+	dat.nbase+=len;
+
+	if (trackdup) {
+		// only fastq output needs the read as text
+		if (sefq || pefq1) {
+			fqseq.resize(len);
+			fqqual.resize(len);
+			for (i=0;i<len;++i) {
+				fqseq[i] = bam_nt16_rev_table[bam1_seqi(bamseq, i)];
+				fqqual[i] = qual[i]+33;
+			}
+		}
+		dodup(name, al->core.flag, fqseq.c_str(), fqqual.c_str());
+	}
+}
+
 // let samtools parse the bam
 bool sstats::parse_bam(const char *in) {
     samfile_t *fp;
@@ -963,58 +1453,217 @@ bool sstats::parse_bam(const char *in) {
             warn("Error reading '%s': %s\n", in, strerror(errno));
             return false;
     }
-    if (fp->header) {
-        int i;
-        for (i = 0; i < fp->header->n_targets; ++i) {
-            covr[fp->header->target_name[i]].reflen=fp->header->target_len[i];
-        }
-    }
+    doheader(fp->header);
 	bam1_t *al=bam_init1();
     int ret=0;
     while ( (ret=samread(fp, al)) > 0 ) {
-        uint32_t *cig = bam1_cigar(al);
-        char *name = bam1_qname(al);
-        int len = al->core.l_qseq;
-        uint8_t *tag=bam_aux_get(al, "NM");     // NM tag
-		int nm = tag ? bam_aux2i(tag) : 0;
-		int ins=0, del=0;
-		int i;
+        dobam(al, fp->header);
+	}
+    bam_destroy1(al);
+    samclose(fp);
+    if (ret < -2) {
+            // no stats .. corrupt file
+            return false;
+    }
+    if (ret < -1) {
+        __sync_fetch_and_add(&errs,1);
+        // truncated file, output stats, but return error code
+        return true;
+    }
+	return true;
+}
 
-        // count inserts and deletions
-		for (i=0;i<al->core.n_cigar;++i) {
-            int op = cig[i] & BAM_CIGAR_MASK;
-			if (op == BAM_CINS) {
-				ins+=(cig[i] >> BAM_CIGAR_SHIFT);
-			} else if (op == BAM_CDEL) {
-				del+=(cig[i] >> BAM_CIGAR_SHIFT);
-			}
-		}
+// a slice of one reference, reads are counted by the slice their start position is in
+class bam_region {
+public:
+    int tid, beg, end;
+};
 
-        // crappy cigar?
-		if (al->core.n_cigar == 0) 
-			al->core.pos=-1;                    // not really a match if there's no cigar string... this deals with bwa's issue
+// per-thread state for parse_bam_index
+class bam_shard {
+public:
+    const char *in;
+    const bam_index_t *idx;
+    const vector<bam_region> *regs;
+    int *next;
+    pthread_mutex_t *lock;
+    sstats s;
+    int64_t last;           // virtual offset just past the last placed read we counted
+    int ret;
+};
 
-        char *qual = (char *) bam1_qual(al);    // qual string
-        uint8_t * bamseq = bam1_seq(al);        // sequence string
-        string seq; seq.resize(len);            // ok... really make it a string
-        for (i=0;i<len;++i) {
-            seq[i] = bam_nt16_rev_table[bam1_seqi(bamseq, i)];
-            qual[i] += 33;
+static void *parse_bam_shard(void *arg) {
+    bam_shard *sh = (bam_shard *) arg;
+    samfile_t *fp;
+    sh->ret = -1;
+    if (!(fp=samopen(sh->in, "rb", NULL))) {
+        sh->ret = -3;
+        return NULL;
+    }
+    sh->s.doheader(fp->header);
+    bam1_t *al=bam_init1();
+    while (sh->ret >= -1) {
+        int r;
+        pthread_mutex_lock(sh->lock);
+        r = (*sh->next)++;
+        pthread_mutex_unlock(sh->lock);
+        if (r >= sh->regs->size()) 
+            break;
+        const bam_region &rg = (*sh->regs)[r];
+        bam_iter_t iter = bam_iter_query(sh->idx, rg.tid, rg.beg, rg.end);
+        while ( (sh->ret=bam_iter_read(fp->x.bam, iter, al)) >= 0 ) {
+            if (al->core.pos < rg.beg)
+                continue;                   // belongs to the previous region
+            int64_t off = bam_tell(fp->x.bam);
+            if (off > sh->last) sh->last = off;
+            sh->s.dobam(al, fp->header);
         }
+        bam_iter_destroy(iter);
+    }
+    bam_destroy1(al);
+    samclose(fp);
+    return NULL;
+}
+
+// split the bam into index regions, and run them over nt threads
+int sstats::parse_bam_index(const char *in, int nt) {
+    bam_index_t *idx;
+    samfile_t *fp;
+    if (!(fp=samopen(in, "rb", NULL))) {
+            warn("Error reading '%s': %s\n", in, strerror(errno));
+            return 0;
+    }
+    // samtools looks for in.bai, then in minus .bam plus .bai ... don't let it complain
+    string bai = string(in) + ".bai";
+    if (access(bai.c_str(), R_OK) && (bai.length() < 8 || strcmp(in+bai.length()-8, ".bam")
+        || access(bai.replace(bai.length()-8, 8, ".bai").c_str(), R_OK))) {
+        samclose(fp);
+        return -1;
+    }
+    if (!fp->header || !fp->header->n_targets || !(idx = bam_index_load(in))) {
+        samclose(fp);
+        return -1;
+    }
+
+    // regions are no smaller than a linear index window
+    int i, j;
+    int64_t tot = 0;
+    for (i = 0; i < fp->header->n_targets; ++i)
+        tot += fp->header->target_len[i];
+    int64_t chunk = tot / (nt * 4);
+    if (chunk < (1 << 14)) chunk = 1 << 14;
+
+    vector<bam_region> regs;
+    for (i = 0; i < fp->header->n_targets; ++i) {
+        bam_region rg;
+        rg.tid = i;
+        for (rg.beg = 0; ; rg.beg = rg.end) {
+            rg.end = (rg.beg + chunk < fp->header->target_len[i]) ? rg.beg + chunk : (1 << 29);
+            regs.push_back(rg);
+            if (rg.end == (1 << 29)) break;
+        }
+    }
+
+    debugout("threads: %d, regions: %d\n", nt, (int) regs.size());
+
+    int next = 0;
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    vector<bam_shard *> shards(nt);
+    vector<pthread_t> tids(nt);
+    for (i = 0; i < nt; ++i) {
+        shards[i] = new bam_shard;
+        shards[i]->in = in;
+        shards[i]->idx = idx;
+        shards[i]->regs = &regs;
+        shards[i]->next = &next;
+        shards[i]->lock = &lock;
+        shards[i]->last = 0;
+        pthread_create(&tids[i], NULL, parse_bam_shard, shards[i]);
+    }
+
+    doheader(fp->header);
+    int ret = -1;
+    int64_t last = 0;
+    for (i = 0; i < nt; ++i) {
+        pthread_join(tids[i], NULL);
+        if (shards[i]->ret < ret) ret = shards[i]->ret;
+        if (shards[i]->last > last) last = shards[i]->last;
+        merge(shards[i]->s);
+        delete shards[i];
+    }
+    pthread_mutex_destroy(&lock);
+    bam_index_destroy(idx);
+
+    // unplaced reads live after the last placed one, and aren't in any region
+    if (ret >= -1) {
+        bam1_t *al=bam_init1();
+        if (last) bam_seek(fp->x.bam, last, SEEK_SET);
+        while ( (ret=samread(fp, al)) > 0 ) {
+            if (al->core.tid < 0)
+                dobam(al, fp->header);
+        }
+        bam_destroy1(al);
+    }
+    samclose(fp);
 
-        // now do stats
-		dostats(name,len,al->core.flag,al->core.tid>=0?fp->header->target_name[al->core.tid]:"",al->core.pos+1,al->core.qual, al->core.mtid>=0?fp->header->target_name[al->core.mtid]:"", al->core.isize, seq, qual, nm, ins, del);
-	}
     if (ret < -2) {
             // no stats .. corrupt file
-            return false;
+            return 0;
     }
     if (ret < -1) {
-        ++errs;
+        __sync_fetch_and_add(&errs,1);
         // truncated file, output stats, but return error code
-        return true;
     }
-	return true;
+    return 1;
+}
+
+void sstats::merge(const sstats &o) {
+    dat.n+=o.dat.n;
+    dat.mapn+=o.dat.mapn;
+    dat.secondary+=o.dat.secondary;
+    dat.mapzero+=o.dat.mapzero;
+    if (o.dat.lenmax > dat.lenmax) dat.lenmax = o.dat.lenmax;
+    if (o.dat.lenmin && (o.dat.lenmin < dat.lenmin || dat.lenmin==0)) dat.lenmin = o.dat.lenmin;
+    dat.lensum+=o.dat.lensum;
+    dat.lenssq+=o.dat.lenssq;
+    dat.mapsum+=o.dat.mapsum;
+    dat.mapssq+=o.dat.mapssq;
+    dat.nmnz+=o.dat.nmnz;
+    dat.nmsum+=o.dat.nmsum;
+    dat.nbase+=o.dat.nbase;
+    if (o.dat.qualmax > dat.qualmax) dat.qualmax = o.dat.qualmax;
+    if (o.dat.qualmin < dat.qualmin) dat.qualmin = o.dat.qualmin;
+    dat.qualsum+=o.dat.qualsum;
+    dat.qualssq+=o.dat.qualssq;
+    dat.nrev+=o.dat.nrev;
+    dat.nfor+=o.dat.nfor;
+    dat.tmapb+=o.dat.tmapb;
+    int i;
+    for (i=0;i<5;++i)
+        dat.basecnt[i]+=o.dat.basecnt[i];
+    dat.del+=o.dat.del;
+    dat.ins+=o.dat.ins;
+    dat.pe = dat.pe || o.dat.pe;
+    dat.disc+=o.dat.disc;
+    dat.disc_pos+=o.dat.disc_pos;
+    if (o.dat.dupmax > dat.dupmax) dat.dupmax = o.dat.dupmax;
+
+    vmapq.merge(o.vmapq);
+    visize.merge(o.visize);
+    vlen.merge(o.vlen);
+
+    int j;
+    for (j=0;j<o.covr.size();++j) {
+        const scoverage &oc = o.covr[j];
+        scoverage &sc = covr[refid(o.rnames[j].c_str())];
+        sc.mapb+=oc.mapb;
+        sc.mapr+=oc.mapr;
+        sc.spos.Merge(oc.spos);
+        if (oc.reflen) sc.reflen=oc.reflen;
+        for (i=0;i<sc.dist.size();++i)
+            sc.dist[i]+=oc.dist[i];
+    }
 }
 
 void usage(FILE *f) {
@@ -1027,6 +1676,11 @@ void usage(FILE *f) {
 "Options (default in parens):\n"
 "\n"
 "-D             Keep track of multiple alignments\n"
+"--dup-bits INT Bits per read id for -D alignment counts, the other 64-INT\n"
+"               are a fingerprint of the id, more = fewer collisions (16)\n"
+"--dup-mem INT  Fixed -D table, in MB per input file.  Otherwise it takes 11-23\n"
+"               bytes per read id, up to 34 while it grows.  Once 70%% full, the\n"
+"               alignments of new ids count as mapped once, and never ambiguous\n"
 "-O PREFIX      Output prefix enabling extended output (see below)\n"
 "-R FIL         Coverage/RNA output (coverage, 3' bias, etc, implies -A)\n"
 "-A             Report all chr sigs, even if there are more than 1000\n"
@@ -1035,6 +1689,7 @@ void usage(FILE *f) {
 "-x FIL         File extension for handling multiple files (stats)\n"
 "-M             Only overwrite if newer (requires -x, or multiple files)\n"
 "-B             Input is bam, don't bother looking at magic\n"
+"-t INT         Threads for indexed bam files, not with -D (1)\n"
 "-z             Don't fail when zero entries in sam\n"
 "\n"
 "OUTPUT:\n"
@@ -1105,10 +1760,10 @@ std::string string_format(const std::string &fmt, ...) {
 
 template <class vtype>
 double quantile(const vtype &vec, double p) {
-        int l = vec.size();
+        long long l = vec.size();
         if (!l) return 0;
         double t = ((double)l-1)*p;
-        int it = (int) t;
+        long long it = (long long) t;
         int v=vec[it];
         if (t > (double)it) {
                 return (v + (t-it) * (vec[it+1] - v));
@@ -1148,6 +1803,10 @@ void build_basemap() {
 		}
 		basemap[cb]=j;
 	}
+	for (cb=0;cb<256;++cb) {
+		basepair[cb][0]=basemap[bam_nt16_rev_table[cb>>4]];
+		basepair[cb][1]=basemap[bam_nt16_rev_table[cb&0xf]];
+	}
 }	
 
 
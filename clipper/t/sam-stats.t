@@ -0,0 +1,58 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Copy;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/sam-stats";
+
+# the version line changes with every release
+$nover="| perl -ne 'print unless /^version\\t/'";
+
+# multiple files write <file>.stats next to each input
+for my $f (qw(a b c)) {
+    copy("$INDIR/aln.bam", "$TMPDIR/$f.bam");
+    copy("$INDIR/aln.bam.bai", "$TMPDIR/$f.bam.bai");
+}
+
+# aln.bam is indexed, 3 chromosomes and some unplaced reads
+@check = (
+    {param=>"$INDIR/aln.bam $nover > %o:$TMPDIR/ser.stats"},
+    # same output as serial: split over index regions, or several files at once
+    {param=>"-t 4 $INDIR/aln.bam $nover > $TMPDIR/thr.stats", same=>["thr.stats"]},
+    {param=>"-t 2 $TMPDIR/a.bam $TMPDIR/b.bam $TMPDIR/c.bam", same=>["a.bam.stats", "b.bam.stats", "c.bam.stats"]},
+    {param=>"-t 8 $TMPDIR/a.bam $TMPDIR/b.bam $TMPDIR/c.bam", same=>["a.bam.stats", "b.bam.stats", "c.bam.stats"]},
+    # -D, and a fixed table with room for every id
+    {param=>"-D $INDIR/aln.bam $nover > %o:$TMPDIR/dup.stats"},
+    {param=>"-D --dup-mem 1 $INDIR/aln.bam $nover > $TMPDIR/dupmem.stats", same=>["dupmem.stats"], ser=>"dup.stats"},
+);
+
+sub slurp_stats {
+    my ($f) = @_;
+    open(my $in, $f) || return "$f: $!";
+    return join "", grep {!/^version\t/} <$in>;
+}
+
+my $id=0;
+for (@check) {
+    ++$id;
+    my %d = %{$_};
+    $cmd = "$prog $d{param}";
+    my ($exit, $ncmd, $files) = run($cmd);
+    if ($d{bad}) {
+        ok($exit != 0, "test$id worked ($ncmd)");
+    } else {
+        ok($exit == 0, "test$id worked ($ncmd)");
+    }
+
+    check_output($files);
+
+    my $ser = $d{ser} ? $d{ser} : "ser.stats";
+    for my $f (@{$d{same}}) {
+        ok(slurp_stats("$TMPDIR/$f") eq slurp_stats("$TMPDIR/$ser"), "Files equal: $f == $ser");
+        unlink("$TMPDIR/$f");
+    }
+}
+
+done_testing();
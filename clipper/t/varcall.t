@@ -0,0 +1,42 @@
+use Test::Builder;
+use Test::More;
+use File::Basename qw(dirname);
+use File::Compare;
+
+require (dirname(__FILE__) . "/test-prep.pl");
+
+$prog="$BINDIR/varcall";
+
+# aln.bam is indexed, 3 chromosomes and some unplaced reads
+$opts="-s -v -F 'var%eav,vcf,cse' -f $INDIR/ref.fa";
+
+@check = (
+    {param=>"$opts -o $TMPDIR/ser $INDIR/aln.bam 2> $TMPDIR/ser.err #o:$TMPDIR/ser.var #o:$TMPDIR/ser.eav #o:$TMPDIR/ser.vcf"},
+    # same output as serial: one shard per chromosome, saved and replayed summaries, or both
+    {param=>"-t 3 $opts -o $TMPDIR/thr $INDIR/aln.bam 2> $TMPDIR/thr.err", same=>"thr"},
+    {param=>"--one-pass $opts -o $TMPDIR/one $INDIR/aln.bam 2> $TMPDIR/one.err", same=>"one"},
+    {param=>"-t 3 --one-pass $opts -o $TMPDIR/tone $INDIR/aln.bam 2> $TMPDIR/tone.err", same=>"tone"},
+);
+
+my $id=0;
+for (@check) {
+    ++$id;
+    my %d = %{$_};
+    $cmd = "$prog $d{param}";
+    my ($exit, $ncmd, $files) = run($cmd);
+    if ($d{bad}) {
+        ok($exit != 0, "test$id worked ($ncmd)");
+    } else {
+        ok($exit == 0, "test$id worked ($ncmd)");
+    }
+
+    check_output($files);
+
+    if ($d{same}) {
+        for my $x (qw(var eav vcf cse noise stats vstats varsum)) {
+            ok(compare("$TMPDIR/$d{same}.$x", "$TMPDIR/ser.$x") == 0, "Files equal: $d{same}.$x == ser.$x");
+        }
+    }
+}
+
+done_testing();
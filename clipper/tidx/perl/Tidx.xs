@@ -14,6 +14,14 @@ extern "C" {
 
 #include "tidx.h"
 
+// a cursor made from perl holds a reference to its index's object, so the index lives as long as the cursor
+class tidx_pcursor : public tidx_cursor {
+    SV *parent;
+public:
+    tidx_pcursor(tidx *idx, SV *p) : tidx_cursor(idx) {parent = SvREFCNT_inc(p);}
+    ~tidx_pcursor() {dTHX; SvREFCNT_dec(parent);}
+};
+
 MODULE = Text::Tidx		PACKAGE = Text::Tidx		
 
 tidx *
@@ -30,3 +38,23 @@ tidx::lookup_cr(const char *chr, int beg, int end, const char *msep);
 
 void 
 tidx_build(const char *file, const char *sep, int chr, int beg, int end, int skip_i, char skip_c, bool sub_e);
+
+MODULE = Text::Tidx		PACKAGE = Text::Tidx::Cursor
+
+tidx_cursor *
+tidx_cursor::new(tidx * idx)
+    CODE:
+        RETVAL = new tidx_pcursor(idx, SvRV(ST(1)));
+    OUTPUT:
+        RETVAL
+
+void
+tidx_cursor::DESTROY()
+    CODE:
+        delete (tidx_pcursor *) THIS;
+
+const char * 
+tidx_cursor::lookup_c(const char *chr, int pos, const char *msep);
+
+const char * 
+tidx_cursor::lookup_cr(const char *chr, int beg, int end, const char *msep);
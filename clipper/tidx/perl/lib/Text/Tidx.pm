@@ -55,6 +55,11 @@ sub query {
     return split /\^/, $r;
 }
 
+# cursor for sorted lookups
+sub cursor {
+    return Text::Tidx::Cursor->new($_[0]);
+}
+
 sub build {
     my ($file, %op) = @_;
     croak "usage: build(file, options)\n" unless $file;
@@ -74,6 +79,23 @@ sub build {
     tidx_build($file, $op{sep}, $op{chr}, $op{beg}, $op{end}, $op{skip_i}, $op{skip_c}, $op{sub_e});
 }
 
+package Text::Tidx::Cursor;
+
+sub query {
+    my $r;
+    if (@_ == 3) {
+        $r = lookup_c(@_, "^");
+    }
+    if (@_ == 4) {
+        $r = lookup_cr(@_, "^");
+    }
+    return () if (!$r);
+    $r =~ s/^\^//;
+    return split /\^/, $r;
+}
+
+package Text::Tidx;
+
 1;
 __END__
 # Below is stub documentation for your module. You'd better edit it!
@@ -101,6 +123,23 @@ Query a loaded index, returning an array of text lines corresponding to the spec
 chr string and integer pos.   If an end is specified, then all overlapping regions
 are returned.
 
+Lines covering a position come back latest starting first, then in file order.  A
+range query returns those lists for each stretch of the range in turn, so a line
+covering more than one of them is repeated.  An old gzipped (version 1) index
+keeps the order it was built with, which may differ.
+
+=head2 cursor()
+
+Returns a cursor on a loaded index.  A cursor's query() is the same as the index's,
+but remembers where the last lookup landed, so positions queried in sorted order
+step forward instead of searching the whole chromosome each time.  The cursor
+keeps the index loaded for as long as it's in use.
+
+  $cur = $idx->cursor();
+  for (@sorted_positions) {
+      @res = $cur->query("chr1", $_);
+  }
+
 =head2 build(FILE [, option1=>value1, ...])
 
 Builds an index.  Default is to index on the first 3 columns.
@@ -5,7 +5,7 @@
 
 # change 'tests => 1' to 'tests => last_test_to_print';
 
-use Test::More tests => 4;
+use Test::More tests => 8;
 use Cwd;
 
 BEGIN { use_ok('Text::Tidx') };
@@ -30,6 +30,24 @@ is("@res", slurp("$subdir/res1.txt"), "range query 1");
 @res = $cytoTab->query("chr1", 9200000, 12700000);
 is("@res", slurp("$subdir/res2.txt"), "range query 2");
 
+my $cur=$cytoTab->cursor();
+@res = $cur->query("chr1", 2300001);
+is($res[0],'chr1	2300000	5400000	p36.32	gpos25', "cursor snp query");
+
+@res = $cur->query("chr1", 16100000, 20400001);
+is("@res", slurp("$subdir/res1.txt"), "cursor range query");
+
+# the cursor holds the index, with no other reference to it
+$cur=Text::Tidx->new("$subdir/annot.txt")->cursor();
+@res = $cur->query("chr1", 2300001);
+is($res[0],'chr1	2300000	5400000	p36.32	gpos25', "cursor outlives its index");
+
+undef $cytoTab;
+$cur=undef;
+$cur=Text::Tidx->new("$subdir/annot.txt")->cursor();
+@res = $cur->query("chr1", 16100000, 20400001);
+is("@res", slurp("$subdir/res1.txt"), "cursor range query, index out of scope");
+
 
 sub slurp {
     open IN, $_[0]; 
@@ -3,10 +3,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <set>
 
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <sparsehash/dense_hash_map>
@@ -22,6 +29,34 @@ using namespace google;
 
 double xtime();
 
+// version 3 layout, native byte order: head, then per chromosome the name, beg[n], end[n], idx[n+1], run[] and off[],
+// each 8-byte aligned, then the chromosome table at head.chrtab.   the arrays are used in place from the mapping.
+// a line's offset is stored once, fragments list runs of line ids (version 2 repeated the offsets in every fragment)
+
+#define TIDX_MAGIC "tidx"
+#define TIDX_VERSION 3
+
+struct tidx_head {
+    char magic[4];
+    int version;
+    int nchr;
+    int longsize;           // sizeof(long) of the writer
+    long chrtab;
+};
+
+struct tidx_ent {
+    long name;              // offsets from the start of the file
+    int name_len;
+    int pad;
+    long n;
+    long beg;
+    long end;
+    long idx;
+    long run;
+    long nid;
+    long off;
+};
+
 bool annot_comp (const annot &a, const annot &b) { return (a.beg < b.beg); }
 
 template <typename L, typename R> void append(L& lhs, R const& rhs) { lhs.insert(lhs.end(), rhs.begin(), rhs.end()); }
@@ -117,28 +152,158 @@ struct string_annot_serializer {
 };
 
 
+// write p, padded to 8 bytes, return where it starts
+static long fwrite_al(FILE *f, const void *p, size_t n) {
+    static const char zero[8] = {0};
+    long at = ftell(f);
+    if (n && fwrite(p, n, 1, f) != 1)
+        return -1;
+    if (n % 8 && fwrite(zero, 8 - n % 8, 1, f) != 1)
+        return -1;
+    return at;
+}
+
+// one chromosome, ready to write
+struct tidx_flat {
+    string name;
+    vector<int> beg;
+    vector<int> end;
+    vector<long> idx;           // n+1
+    vector<unsigned char> run;
+    vector<long> off;
+    vector<long> cur;           // (first id, count) runs of the fragment being listed
+};
+
+// 7 bits a byte, low first
+static void putv(vector<unsigned char> &b, unsigned long v) {
+    while (v >= 0x80) {
+        b.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    b.push_back(v);
+}
+
+// list line id in the current fragment, joining the run before when it's the next id
+static void flat_add(tidx_flat &fl, long id) {
+    size_t k = fl.cur.size();
+    if (k && fl.cur[k-2] + fl.cur[k-1] == id) {
+        ++fl.cur[k-1];
+    } else {
+        fl.cur.push_back(id);
+        fl.cur.push_back(1);
+    }
+}
+
+// code the current fragment's runs, as tidx_pos reads them
+static void flat_end(tidx_flat &fl) {
+    long prev = 0;
+    size_t k;
+    for (k = 0; k < fl.cur.size(); k += 2) {
+        long g = fl.cur[k] - prev;
+        unsigned long z = g < 0 ? ((unsigned long) -g << 1) - 1 : (unsigned long) g << 1;
+        putv(fl.run, z << 1 | (fl.cur[k+1] > 1));
+        if (fl.cur[k+1] > 1) 
+            putv(fl.run, fl.cur[k+1] - 2);
+        prev = fl.cur[k] + fl.cur[k+1];
+    }
+    fl.cur.clear();
+    fl.idx.push_back(fl.run.size());
+}
+
+// write chromosomes as a version 3 index
+static bool tidx_write(FILE *f, const vector<tidx_flat> &chrv) {
+    tidx_head h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TIDX_MAGIC, 4);
+    h.version = TIDX_VERSION;
+    h.longsize = sizeof(long);
+    if (fwrite_al(f, &h, sizeof(h)) < 0)
+        return false;
+
+    vector<tidx_ent> tab;
+    size_t i;
+    for (i = 0; i < chrv.size(); ++i) {
+        const tidx_flat &fl = chrv[i];
+        tidx_ent e;
+        memset(&e, 0, sizeof(e));
+        e.n = fl.beg.size();
+        e.name_len = fl.name.size();
+        e.name = fwrite_al(f, fl.name.data(), e.name_len);
+        e.beg = fwrite_al(f, fl.beg.data(), e.n*sizeof(int));
+        e.end = fwrite_al(f, fl.end.data(), e.n*sizeof(int));
+        e.idx = fwrite_al(f, fl.idx.data(), (e.n+1)*sizeof(long));
+        e.run = fwrite_al(f, fl.run.data(), fl.run.size());
+        e.nid = fl.off.size();
+        e.off = fwrite_al(f, fl.off.data(), e.nid*sizeof(long));
+        if (e.name < 0 || e.beg < 0 || e.end < 0 || e.idx < 0 || e.run < 0 || e.off < 0)
+            return false;
+        tab.push_back(e);
+    }
+
+    h.nchr = tab.size();
+    h.chrtab = fwrite_al(f, tab.data(), tab.size()*sizeof(tidx_ent));
+    if (h.chrtab < 0)
+        return false;
+    fseek(f, 0, SEEK_SET);
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+        return false;
+    return fflush(f) == 0;
+}
+
+// version 1 map, as written.  ids are given in the order lines are first listed
+static void tidx_flatten(dense_hash_map<string,vector<annot> > &map, vector<tidx_flat> &chrv) {
+    dense_hash_map<string,vector<annot> >::iterator it;
+    dense_hash_map<long,int> ids;
+    ids.set_empty_key(-1);
+    for (it = map.begin(); it != map.end(); ++it) {
+        vector<annot> &van = it->second;
+        chrv.resize(chrv.size()+1);
+        tidx_flat &fl = chrv.back();
+        fl.name = it->first;
+        fl.idx.push_back(0);
+        ids.clear();
+        size_t i, j;
+        for (i=0;i<van.size();++i) {
+            fl.beg.push_back(van[i].beg);
+            fl.end.push_back(van[i].end);
+            for (j=0;j<van[i].pos.size();++j) {
+                dense_hash_map<long,int>::iterator id = ids.find(van[i].pos[j]);
+                if (id == ids.end()) {
+                    id = ids.insert(make_pair(van[i].pos[j], (int) fl.off.size())).first;
+                    fl.off.push_back(van[i].pos[j]);
+                }
+                flat_add(fl, id->second);
+            }
+            flat_end(fl);
+        }
+    }
+}
+
 void chomp_line(struct line &l) {
     if (l.s[l.n-1] == '\n') l.s[--l.n]='\0';       // chomp
     if (l.s[l.n-1] == '\r') l.s[--l.n]='\0';       // chomp
 }
 
-vector <long int> empty_vector;
-const vector<long int> &tidx::lookup(const char *chr, int pos) {
-    dense_hash_map<string,vector<annot> >::iterator it=map.find(chr);
-    if (it == map.end()) return empty_vector;
-    vector<annot> &va = it->second;
-    if (debug) fprintf(stderr,"lookup: %s:%d -> %d\n", chr, pos, (int) va.size());
-    int b=0, t=va.size(), c=0;
+const tidx_chr *tidx::find_chr(const char *chr) const {
+    dense_hash_map<string,tidx_chr>::const_iterator it=chrs.find(chr);
+    return it == chrs.end() ? NULL : &it->second;
+}
+
+tidx_pos tidx::lookup_p(const char *chr, int pos) {
+    dense_hash_map<string,tidx_chr>::const_iterator it=chrs.find(chr);
+    if (it == chrs.end()) return tidx_pos();
+    const tidx_chr &va = it->second;
+    if (debug) fprintf(stderr,"lookup: %s:%d -> %d\n", chr, pos, (int) va.n);
+    long b=0, t=va.n, c=0;
     while (t>b) {
         c=(t+b)/2;
-//        printf("here1: c:%d, t:%d, b:%d, pos:%d, beg:%d, end:%d, res:%d\n", c, t, b, pos, va[c].beg, va[c].end, va[c].pos[0]);
-        if (pos == va[c].beg)
+        if (pos == va.beg[c])
             break;
-        else if (pos < va[c].beg)
+        else if (pos < va.beg[c])
             t=c-1;
-        else if (pos > va[c].beg) {
-            if (pos <= va[c].end) {
-                return va[c].pos;
+        else if (pos > va.beg[c]) {
+            if (pos <= va.end[c]) {
+                return va.hits(c, c+1);
             }
             b=c+1;
         }
@@ -146,131 +311,474 @@ const vector<long int> &tidx::lookup(const char *chr, int pos) {
     
     if (t == b)
         c = t;
-//    printf("here2: c:%d, t:%d, b:%d, pos:%d, beg:%d, end:%d, res:%d\n", c, t, b, pos, va[c].beg, va[c].end, va[c].pos[0]);
-    if (pos >= va[c].beg && pos <= va[c].end) {
-        return va[c].pos;
+    if (c < va.n && pos >= va.beg[c] && pos <= va.end[c]) {
+        return va.hits(c, c+1);
     }
-    return empty_vector;
+    return tidx_pos();
 }
 
-vector<long int> tidx::lookup_r(const char *chr, int beg, int end) {
-    dense_hash_map<string,vector<annot> >::iterator it=map.find(chr);
-    if (it == map.end()) return empty_vector;
-    vector<annot> &va = it->second;
-    if (debug) fprintf(stderr,"lookup_r: %s:%d.%d -> %d\n", chr, beg, end, (int) va.size());
-    int b=0, t=va.size(), c=0;
+tidx_pos tidx::lookup_pr(const char *chr, int beg, int end) {
+    dense_hash_map<string,tidx_chr>::const_iterator it=chrs.find(chr);
+    if (it == chrs.end()) return tidx_pos();
+    const tidx_chr &va = it->second;
+    if (debug) fprintf(stderr,"lookup_r: %s:%d.%d -> %d\n", chr, beg, end, (int) va.n);
+    long b=0, t=va.n, c=0;
     while (t>b) {
         c=(t+b)/2;
-        if (beg == va[c].beg)
+        if (beg == va.beg[c])
             break;
-        else if (beg < va[c].beg)
+        else if (beg < va.beg[c])
             t=c-1;
-        else if (beg > va[c].beg) {
-            if (beg <= va[c].end) 
+        else if (beg > va.beg[c]) {
+            if (beg <= va.end[c]) 
                 break;
             b=c+1;
         }
     }
     if (t == b)
         c = t;
-    vector<long int> res;
-    while (c<va.size() && end >= va[c].beg && beg <= va[c].end) {
-        append(res,va[c].pos);
+    // the search can stop a fragment off when beg is between fragments
+    while (c > 0 && c <= va.n && va.end[c-1] >= beg)
+        --c;
+    while (c < va.n && va.end[c] < beg)
+        ++c;
+    // fragments are coded one after another, so the lines for a run of them read as one list
+    long c0 = c;
+    while (c<va.n && end >= va.beg[c] && beg <= va.end[c]) {
         ++c;
     }
+    return c > c0 ? va.hits(c0, c) : tidx_pos();
+}
+
+// not thread safe, the result is reused
+const vector<long int> &tidx::lookup(const char *chr, int pos) {
+    tidx_pos v = lookup_p(chr, pos);
+    ret_v.resize(v.size());
+    long i;
+    for (i=0;i<v.size();++i)
+        ret_v[i]=v[i];
+    return ret_v;
+}
+
+vector<long int> tidx::lookup_r(const char *chr, int beg, int end) {
+    tidx_pos v = lookup_pr(chr, beg, end);
+    vector<long int> res(v.size());
+    long i;
+    for (i=0;i<v.size();++i)
+        res[i]=v[i];
     return res;
 }
 
-string tidx::lookup(const char *chr, int pos, const char *msep) { 
-//    printf("here2\n");
-    const vector<long int> &v = lookup(chr, pos);
-    string res;
-    if (!fh) {
-        fh=fopen(path.c_str(),"rb");
-        if (!fh) 
-            fail("%s:%s\n",path.c_str(),strerror(errno));
+#define TIDX_LINE_CACHE 256          // lines kept per cache
+#define TIDX_READ_BLOCK 65536        // bytes per pread, lines close together come in one read
+
+tidx_cache::tidx_cache() {
+    head=tail=-1;
+    slot.set_empty_key(-1);
+    slot.set_deleted_key(-2);
+    grow(TIDX_LINE_CACHE);
+}
+
+// new empty entries, least recent
+void tidx_cache::grow(size_t n) {
+    while (ents.size() < n) {
+        int i = ents.size();
+        ents.push_back(ent());
+        ents[i].off = -1;
+        ents[i].prev = tail;
+        ents[i].next = -1;
+        if (tail >= 0) 
+            ents[tail].next = i;
+        else
+            head = i;
+        tail = i;
     }
-    string line;
-    int i;
-	struct line l; meminit(l);
+}
+
+// most recent
+void tidx_cache::touch(int i) {
+    if (i == head) 
+        return;
+    ents[ents[i].prev].next = ents[i].next;
+    if (ents[i].next >= 0) 
+        ents[ents[i].next].prev = ents[i].prev;
+    else
+        tail = ents[i].prev;
+    ents[i].prev = -1;
+    ents[i].next = head;
+    ents[head].prev = i;
+    head = i;
+}
+
+// replaces the least recent line
+void tidx_cache::put(long off, const char *b, const char *e) {
+    int i = tail;
+    if (ents[i].off >= 0) 
+        slot.erase(ents[i].off);
+    // chomp, as read_line and chomp_line would
+    if (e > b && e[-1] == '\r') 
+        --e;
+    ents[i].off = off;
+    ents[i].s.assign(b, e-b);
+    slot[off] = i;
+    touch(i);
+}
+
+const vector<tidx_line> &tidx_cache::fetch(const tidx *t, const tidx_pos &v) {
+    ret.clear();
+    if (!v.size())
+        return ret;
+
+    // hits go to the front first, so the misses never push out a line in this fetch
+    if (ents.size() < (size_t) v.size()) 
+        grow(v.size());
+    got.resize(v.size());
+    miss.clear();
+    long i;
     for (i=0;i<v.size();++i) {
-        fseek(fh,v[i],0);
-    	read_line(fh, l);
-        chomp_line(l);
-        res += msep;
-        res += string(l.s, l.n);
+        dense_hash_map<long,int>::const_iterator it = slot.find(v[i]);
+        if (it != slot.end()) {
+            got[i] = it->second;
+            touch(got[i]);
+        } else {
+            got[i] = -1;
+            miss.push_back(v[i]);
+        }
     }
-    free_line(&l);
-    return res;
-}
 
-string tidx::lookup_r(const char *chr, int beg, int end, const char *msep) {
-//    printf("here2\n");
-    const vector<long int> &v = lookup_r(chr, beg, end);
-    string res;
-    if (!fh) {
-        fh=fopen(path.c_str(),"rb");
-        if (!fh)
-            fail("%s:%s\n",path.c_str(),strerror(errno));
+    if (miss.size()) {
+        if (t->src < 0) 
+            fail("%s:%s\n", t->path.c_str(), strerror(t->src_err));
+        sort(miss.begin(), miss.end());
+        miss.erase(unique(miss.begin(), miss.end()), miss.end());
+        if (buf.empty()) 
+            buf.resize(TIDX_READ_BLOCK);
+        size_t k = 0;
+        while (k < miss.size()) {
+            long off = miss[k];
+            ssize_t n = pread(t->src, &buf[0], buf.size(), off);
+            if (n < 0) 
+                fail("%s:%s\n", t->path.c_str(), strerror(errno));
+            bool eof = n < (ssize_t) buf.size();
+            size_t k0 = k;
+            // every missing line that ends in this block
+            while (k < miss.size() && miss[k] - off <= n) {
+                char *b = &buf[0] + (miss[k] - off);
+                char *e = (char *) memchr(b, '\n', n - (miss[k] - off));
+                if (!e) {
+                    if (!eof) 
+                        break;
+                    e = &buf[0] + n;
+                }
+                put(miss[k], b, e);
+                ++k;
+            }
+            // a line longer than the block
+            if (k == k0) 
+                buf.resize(buf.size() * 2);
+        }
+        for (i=0;i<v.size();++i) 
+            if (got[i] < 0) 
+                got[i] = slot[v[i]];
     }
-    string line;
-    int i;
-    struct line l; meminit(l);
+
+    ret.resize(v.size());
     for (i=0;i<v.size();++i) {
-        fseek(fh,v[i],0);
-        read_line(fh, l);
-        chomp_line(l);
+        ret[i].s = ents[got[i]].s.c_str();
+        ret[i].n = ents[got[i]].s.size();
+    }
+    return ret;
+}
+
+static string tidx_join(const vector<tidx_line> &lv, const char *msep) {
+    string res;
+    size_t i;
+    for (i=0;i<lv.size();++i) {
         res += msep;
-        res += string(l.s, l.n);
+        res.append(lv[i].s, lv[i].n);
     }
-    free_line(&l);
     return res;
 }
 
-string api_ret = "";
+string tidx::lines(const tidx_pos &v, const char *msep) {
+    return tidx_join(cache.fetch(this, v), msep);
+}
+
+string tidx::lookup(const char *chr, int pos, const char *msep) { 
+    return lines(lookup_p(chr, pos), msep);
+}
+
+string tidx::lookup_r(const char *chr, int beg, int end, const char *msep) {
+    return lines(lookup_pr(chr, beg, end), msep);
+}
+
 const char *tidx::lookup_c(const char *chr, int pos, const char *msep) {
-    api_ret = lookup(chr, pos, msep);
-    return api_ret.c_str();
+    ret = lookup(chr, pos, msep);
+    return ret.c_str();
 }
 
 const char *tidx::lookup_cr(const char *chr, int beg, int end, const char *msep) {
-    api_ret = lookup_r(chr, beg, end, msep);
-    return api_ret.c_str();
+    ret = lookup_r(chr, beg, end, msep);
+    return ret.c_str();
+}
+
+#define CURSOR_STEPS 16             // steps forward before searching instead
+
+// move to the first fragment ending at or after pos, false if chr isn't indexed
+bool tidx_cursor::seek(const char *name, int pos) {
+    if (!sought || chr != name) {
+        sought = true;
+        chr = name;
+        c = t->find_chr(name);
+        i = 0;
+    }
+    if (!c)
+        return false;
+    long lo = 0;
+    if (i == 0 || c->end[i-1] < pos) {
+        // forward, or still here
+        int k;
+        for (k=0; k < CURSOR_STEPS && i < c->n && c->end[i] < pos; ++k)
+            ++i;
+        if (i >= c->n || c->end[i] >= pos)
+            return true;
+        lo = i;
+    }
+    i = lower_bound(c->end + lo, c->end + c->n, pos) - c->end;
+    return true;
+}
+
+tidx_pos tidx_cursor::lookup_p(const char *name, int pos) {
+    if (!seek(name, pos) || i >= c->n || c->beg[i] > pos)
+        return tidx_pos();
+    return c->hits(i, i+1);
+}
+
+tidx_pos tidx_cursor::lookup_pr(const char *name, int beg, int end) {
+    if (!seek(name, beg))
+        return tidx_pos();
+    long j = i;
+    while (j < c->n && c->beg[j] <= end)
+        ++j;
+    return j > i ? c->hits(i, j) : tidx_pos();
+}
+
+string tidx_cursor::lookup(const char *name, int pos, const char *msep) {
+    return tidx_join(cache.fetch(t, lookup_p(name, pos)), msep);
+}
+
+string tidx_cursor::lookup_r(const char *name, int beg, int end, const char *msep) {
+    return tidx_join(cache.fetch(t, lookup_pr(name, beg, end)), msep);
+}
+
+const char *tidx_cursor::lookup_c(const char *name, int pos, const char *msep) {
+    ret = lookup(name, pos, msep);
+    return ret.c_str();
+}
+
+const char *tidx_cursor::lookup_cr(const char *name, int beg, int end, const char *msep) {
+    ret = lookup_r(name, beg, end, msep);
+    return ret.c_str();
 }
 
 bool tidx::read(const char *in) {
-    string uin = string_format("gunzip -c %s.tidx", in);
+    string tin = string_format("%s.tidx", in);
 
     if (debug) fprintf(stderr, "read %s\n", in);
-    FILE *fun=popen(uin.c_str(),"r");
-    if (!fun) {
+    int fd = open(tin.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char magic[4];
+    if (pread(fd, magic, 4, 0) != 4) {
+        close(fd);
+        return false;
+    }
+    bool ok;
+    if (!memcmp(magic, TIDX_MAGIC, 4)) {
+        ok = load(fd);
+        if (!ok) 
+            warn("%s: not a valid version %d index, rebuild it with -B\n", tin.c_str(), TIDX_VERSION);
+    } else {
+        // version 1, gzipped serialization ... convert to a temp version 3 file
+        string uin = string_format("gunzip -c %s", tin.c_str());
+        FILE *fun=popen(uin.c_str(),"r");
+        ok = fun && map.unserialize(string_annot_serializer(), fun);
+        if (fun) pclose(fun);
+        vector<tidx_flat> chrv;
+        if (ok) 
+            tidx_flatten(map, chrv);
+        map.clear();
+        FILE *tmp = ok ? tmpfile() : NULL;
+        ok = tmp && tidx_write(tmp, chrv) && load(fileno(tmp));
+        if (tmp) fclose(tmp);
+    }
+    close(fd);
+    if (!ok) {
         return false;
     }
-    map.unserialize(string_annot_serializer(), fun);
     path=in;
+    if (src >= 0) 
+        close(src);
+    src = open(in, O_RDONLY);
+    src_err = errno;
+    return true;
+}
+
+// map a version 3 index
+bool tidx::load(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(tidx_head))
+        return false;
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+        return false;
+    char *base = (char *) m;
+    size_t len = st.st_size;
+    const tidx_head *h = (const tidx_head *) base;
+    bool ok = !memcmp(h->magic, TIDX_MAGIC, 4) && h->version == TIDX_VERSION && h->longsize == sizeof(long) 
+        && h->nchr >= 0 && h->chrtab >= 0 && h->chrtab + h->nchr * sizeof(tidx_ent) <= len;
+    int i;
+    for (i=0; ok && i < h->nchr; ++i) {
+        const tidx_ent &e = ((const tidx_ent *) (base + h->chrtab))[i];
+        tidx_chr c;
+        c.n = e.n;
+        c.beg = (const int *) (base + e.beg);
+        c.end = (const int *) (base + e.end);
+        c.idx = (const long *) (base + e.idx);
+        ok = e.n >= 0 && e.name + e.name_len <= len 
+            && e.beg + e.n * sizeof(int) <= len && e.end + e.n * sizeof(int) <= len 
+            && e.idx + (e.n+1) * sizeof(long) <= len;
+        if (ok) {
+            c.run = (const unsigned char *) (base + e.run);
+            c.nid = e.nid;
+            c.off = (const long *) (base + e.off);
+            ok = e.run + c.idx[e.n] <= len && e.nid >= 0 && e.off + e.nid * sizeof(long) <= len;
+        }
+        if (ok) 
+            chrs[string(base + e.name, e.name_len)] = c;
+    }
+    if (!ok) {
+        munmap(m, len);
+        chrs.clear();
+        return false;
+    }
+    if (img) 
+        munmap(img, img_len);
+    img = base;
+    img_len = len;
     return true;
 }
 
 void tidx::init() {
     debug=false;
-    fh=NULL;
+    threads=0;
+    src=-1;
+    src_err=0;
+    img=NULL;
+    img_len=0;
     map.set_empty_key("-");
+    chrs.set_empty_key("-");
+}
+
+tidx::~tidx() {
+    if (img)
+        munmap(img, img_len);
+    if (src >= 0)
+        close(src);
 }
 
 void tidx::dump(FILE *fh) {
     fprintf(fh,"#file\t%s\n",path.c_str());
-    dense_hash_map<string,vector<annot> >::iterator it = map.begin();;
-    while (it != map.end()) {
-        vector<annot> &van = it->second;
-        int i;
-        for (i=0;i<van.size();++i) {
-            fprintf(fh, "%s\t%d\t%d\t%ld\t%ld\n", it->first.c_str(), van[i].beg, van[i].end, van[i].pos.size(), van[i].pos[0]);
+    dense_hash_map<string,tidx_chr>::iterator it = chrs.begin();;
+    while (it != chrs.end()) {
+        const tidx_chr &va = it->second;
+        long i;
+        for (i=0;i<va.n;++i) {
+            fprintf(fh, "%s\t%d\t%d\t%ld\t%ld\n", it->first.c_str(), va.beg[i], va.end[i], va.hits(i, i+1).size(), va.hits(i, i+1)[0]);
         }
         ++it;
     }    
 }
 
 // fun part
+
+// one line of the source file
+struct tidx_rec {
+    int beg;
+    int end;
+    long pos;
+};
+
+static bool rec_beg_comp(const tidx_rec &a, const tidx_rec &b) { return a.beg < b.beg || (a.beg == b.beg && a.pos < b.pos); }
+static bool rec_end_comp(const tidx_rec &a, const tidx_rec &b) { return a.end < b.end || (a.end == b.end && a.pos < b.pos); }
+
+// a fragment lists the latest starting region first, then file order.  the old build's order came from
+// how it split and merged fragments: often latest first, ties in no particular order, so it can differ
+struct rec_cover_comp {
+    bool operator()(const tidx_rec &a, const tidx_rec &b) const { return a.beg > b.beg || (a.beg == b.beg && a.pos < b.pos); }
+};
+
+// sweep the region starts and ends in order, emitting a fragment wherever the set of 
+// covering lines changes.  fragments are disjoint
+static void tidx_sweep(vector<tidx_rec> &recs, tidx_flat &fl) {
+    // number the lines in the order fragments list them, so covering lines are runs of ids
+    sort(recs.begin(), recs.end(), rec_cover_comp());
+    size_t n = recs.size(), si = 0, ei = 0;
+    fl.off.resize(n);
+    for (si = 0; si < n; ++si) {
+        fl.off[si] = recs[si].pos;
+        recs[si].pos = si;              // from here on, pos is the id
+    }
+    si = 0;
+
+    vector<tidx_rec> ends(recs);
+    sort(recs.begin(), recs.end(), rec_beg_comp);
+    sort(ends.begin(), ends.end(), rec_end_comp);
+
+    set<long> cover;
+    set<long>::iterator it;
+    fl.idx.push_back(0);
+    while (si < n || ei < n) {
+        // next boundary: a start, or the base after an end
+        long x = si < n ? recs[si].beg : LONG_MAX;
+        if (ei < n && ends[ei].end + 1L < x) 
+            x = ends[ei].end + 1L;
+        while (ei < n && ends[ei].end + 1L == x) 
+            cover.erase(ends[ei++].pos);
+        while (si < n && recs[si].beg == x) 
+            cover.insert(recs[si++].pos);
+        if (cover.empty()) 
+            continue;
+        // covered up to the boundary after this one, there is always an end left
+        long y = ends[ei].end + 1L;
+        if (si < n && recs[si].beg < y) 
+            y = recs[si].beg;
+        fl.beg.push_back(x);
+        fl.end.push_back(y - 1);
+        for (it = cover.begin(); it != cover.end(); ++it)
+            flat_add(fl, *it);
+        flat_end(fl);
+    }
+}
+
+struct tidx_build_job {
+    vector< vector<tidx_rec> > *recs;
+    vector<tidx_flat> *chrv;
+    long next;
+};
+
+// sweep chromosomes until there are none left
+static void *tidx_build_worker(void *arg) {
+    tidx_build_job *j = (tidx_build_job *) arg;
+    long i;
+    while ((i = __sync_fetch_and_add(&j->next, 1)) < (long) j->recs->size()) {
+        tidx_sweep((*j->recs)[i], (*j->chrv)[i]);
+        vector<tidx_rec>().swap((*j->recs)[i]);
+    }
+    return NULL;
+}
+
 void tidx::build(const char *in, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, bool sub_e) {
 	FILE *fin=fopen(in,"r");
 
@@ -280,139 +788,153 @@ void tidx::build(const char *in, const char *sep, int nchr, int nbeg, int nend,
     if (nend == -1)
         nend = nbeg;
 
-    string out = string_format("gzip -c > %s.tidx", in);
-    FILE *fout=popen(out.c_str(),"w");
+    // written to a temp name, so jobs mapping the old index aren't disturbed
+    string out = string_format("%s.tidx", in);
+    string tmp = string_format("%s.tidx.tmp", in);
+    FILE *fout=fopen(tmp.c_str(),"wb");
     if (!fout)
-        fail("%s:%s\n", out.c_str(),strerror(errno));
+        fail("%s:%s\n", tmp.c_str(),strerror(errno));
 
     double xst = xtime();
 
-	struct line l; meminit(l);
     int nlast = max(max(nbeg,nend),nchr);
     int nl = 0;
 
+    // fields are split as strtok does: any run of sep chars is one separator
+    bool issep[256];
+    memset(issep, 0, sizeof(issep));
+    const char *p;
+    for (p = sep; *p; ++p) 
+        issep[(unsigned char) *p] = true;
+    vector<char *> fs(nlast+1);
+    vector<int> fl(nlast+1);
+
+    dense_hash_map<string,int> chrdex;
+    chrdex.set_empty_key("-");
+    vector<tidx_flat> chrv;
+    vector< vector<tidx_rec> > recs;
+    vector<tidx_rec> *prec = NULL;
     string p_chr = "%";
     path=in;
-    vector<annot> *pvan;
-    long tpos = ftell(fin);
-    // read in the annotation file
+
+    // read in the annotation file, in blocks
     if (debug) fprintf(stderr, "reading %s (%d, %d, %d)\n", in, nchr, nbeg, nend);
-	while (read_line(fin, l)>0) {
+    vector<char> buf(1<<22);
+    size_t have = 0, at = 0;
+    long boff = 0;                      // file position of buf[0]
+    bool eof = false;
+    while (1) {
+        char *ls = buf.data() + at;
+        char *le = (char *) memchr(ls, '\n', have - at);
+        if (!le) {
+            if (!eof) {
+                // shift the partial line down, and read more
+                memmove(buf.data(), ls, have - at);
+                boff += at;
+                have -= at;
+                at = 0;
+                if (have == buf.size()) 
+                    buf.resize(buf.size()*2);
+                size_t r = fread(buf.data() + have, 1, buf.size() - have, fin);
+                if (r == 0) {
+                    if (ferror(fin))
+                        fail("%s:%s\n",in,strerror(errno));
+                    eof = true;
+                }
+                have += r;
+                continue;
+            }
+            if (at == have) 
+                break;
+            le = buf.data() + have;     // last line, no newline
+        }
+        long tpos = boff + at;
+        bool nlend = le < buf.data() + have;
+        at = le - buf.data() + nlend;
         ++nl;
-        if (skip_i > 0 || *l.s==skip_c) {
+        if (skip_i > 0 || *ls==skip_c) {
             --skip_i;
-        } else {
-            chomp_line(l);
-            vector<char *> v = split(l.s, sep);
-            if (nlast >= v.size()) {
-                fail("error, file %s, line %d: missing info\n", in, nl);
-            } 
-            annot a;
-            a.beg=atoi(v[nbeg]);
-            a.end=atoi(v[nend]);
-            if (sub_e) --a.end;
-            if (a.beg > a.end) {
-                fail("error, file %s, line %d: beg > end : %d > %d\n", in, nl, a.beg, a.end);
-            }
-            a.pos.push_back(tpos);
-            if (strcmp(v[nchr], p_chr.c_str())) {       // speed up
-                pvan = &map[v[nchr]];
-                p_chr=v[nchr];
-            }
-            pvan->push_back(a);
+            continue;
         }
-        tpos = ftell(fin);
-	}
-    dense_hash_map<string,vector<annot> >::iterator it;
-
-    free_line(&l);
- 
-    // for each chromosome
-    it = map.begin();
-    while (it != map.end()) {
-        vector<annot> &van = it->second;
-        // sort the annotation file by beginning of region
-        sort(van.begin(), van.end(), annot_comp);
-        int i;
-        if (debug) fprintf(stderr, "frag %s : %ld ->", it->first.c_str(), van.size());
-        for (i=0;i<van.size()-1;++i) {
-            if (van[i].beg >= van[i+1].beg && van[i].end == van[i+1].end) {
-                // exact match
-                if (debug) fprintf(stderr, " [dup %d]", van[i].beg);
-                // merge annotations
-                prepend(van[i+1].pos,van[i].pos);
-                // skip next... (empty pos won't be serialized)
-                assert(van[i].beg == van[i+1].beg);
-                van[i].pos.clear();
-            } else if (van[i].end >= van[i+1].beg) {
-                if (debug) fprintf(stderr, " [ovr %d-%d:%ld ]", van[i].beg, van[i].end, van[i].pos[0]);
-                // overlap next
-                int new_st;
-                int new_en;
-
-                // forced to initialize here so we can use a reference (for efficiency)
-                vector<long> new_ro = van[i].pos;
-                
-                if (van[i].end < van[i+1].end) {
-                    // contained within next, so new frag starting after i stop
-                    new_st = van[i].end + 1;
-                    new_en = van[i+1].end;
-                    new_ro = van[i+1].pos;                  // that only contains the other
-                    van[i+1].end=van[i].end;                // shorten next to my end
-                    append(van[i+1].pos,van[i].pos);        // and now the other contains me
-                } else {
-                    // passes next, so next contains all of me
-                    new_st = van[i+1].end+1;                // new frag is after the end of next
-                    new_en = van[i].end;
-                    append(van[i+1].pos,van[i].pos);
-                }
-
-                van[i].end=van[i+1].beg-1;                  // shorten my end to less than the next's start
-                
-                if (debug) fprintf(stderr, " [i:%d:%d:%ld]", van[i].beg, van[i].end, van[i].pos[0]);
-                if (debug) fprintf(stderr, " [i+1:%d:%d:%ld]", van[i+1].beg, van[i+1].end, van[i+1].pos[0]);
-
-                if (new_en >= new_st) {                     // is this a real one?
-                    if (debug) fprintf(stderr, " [n:%d:%d:%ld]", new_st, new_en, new_ro[0]);
-
-                    int j = i+2;                            // figure out where it goes (shouldn't be far)
-                    while (j < van.size() & new_st > van[j].beg) {
-                        ++j;
-                    }
-
-                    annot a;
-                    a.beg=new_st;
-                    a.end=new_en;
-                    a.pos=new_ro;
-                                                            // (slow... use linked list, turn to array later for storage/bin search?)
-                    van.insert(van.begin()+j, a);           // insert into the annot array
-                }
-            }
+        // chomp, as read_line and chomp_line would
+        if (nlend && le > ls && le[-1] == '\r') 
+            --le;
+        if (le > ls && le[-1] == '\r') 
+            --le;
+
+        int nf = 0;
+        char *c = ls;
+        while (nf <= nlast) {
+            while (c < le && issep[(unsigned char) *c]) ++c;
+            if (c >= le) 
+                break;
+            fs[nf] = c;
+            while (c < le && !issep[(unsigned char) *c]) ++c;
+            fl[nf] = c - fs[nf];
+            ++nf;
         }
-        long j = 0;
-        for (i=0;i<van.size();++i) {
-            // overlap next
-            if (van[i].pos.size() != 0 && van[i].beg <= van[i].end)
-                if (i != j) 
-                    van[j++]=van[i];
-                else
-                    ++j;
+        if (nf <= nlast) {
+            fail("error, file %s, line %d: missing info\n", in, nl);
+        } 
+        tidx_rec a;
+        a.beg=atoi(fs[nbeg]);
+        a.end=atoi(fs[nend]);
+        if (sub_e) --a.end;
+        if (a.beg > a.end) {
+            fail("error, file %s, line %d: beg > end : %d > %d\n", in, nl, a.beg, a.end);
         }
-        if (j != van.size()) {
-            if (debug) fprintf(stderr, "(rm %ld) ", van.size()-j);
-            van.resize(j);
+        a.pos = tpos;
+        if (p_chr.size() != fl[nchr] || memcmp(p_chr.data(), fs[nchr], fl[nchr])) {       // speed up
+            p_chr.assign(fs[nchr], fl[nchr]);
+            dense_hash_map<string,int>::iterator it = chrdex.find(p_chr);
+            if (it == chrdex.end()) {
+                chrdex[p_chr] = recs.size();
+                recs.resize(recs.size()+1);
+                chrv.resize(chrv.size()+1);
+                chrv.back().name = p_chr;
+                prec = &recs.back();
+            } else {
+                prec = &recs[it->second];
+            }
         }
-        if (debug) fprintf(stderr, " %ld\n", van.size());
-        ++it;
+        prec->push_back(a);
+	}
+    fclose(fin);
+
+    // fragment each chromosome
+    int nt = threads > 0 ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nt > (int) recs.size()) 
+        nt = recs.size();
+    if (nt < 1) 
+        nt = 1;
+    tidx_build_job job;
+    job.recs = &recs;
+    job.chrv = &chrv;
+    job.next = 0;
+    vector<pthread_t> tids(nt-1);
+    int i;
+    for (i=0;i<nt-1;++i) {
+        if (pthread_create(&tids[i], NULL, tidx_build_worker, &job))
+            fail("can't create thread: %s\n", strerror(errno));
+    }
+    tidx_build_worker(&job);
+    for (i=0;i<nt-1;++i) 
+        pthread_join(tids[i], NULL);
+
+    if (debug) {
+        for (i=0;i<chrv.size();++i) 
+            fprintf(stderr, "frag %s : %ld\n", chrv[i].name.c_str(), (long) chrv[i].beg.size());
     }
 
     double xen = xtime();
     double speed = xen-xst;
 
-    if (debug) fprintf(stderr, "compiled in %g secs\n", speed);
+    if (debug) fprintf(stderr, "compiled in %g secs, %d threads\n", speed, nt);
 
-    map.serialize(string_annot_serializer(), fout);
-    pclose(fout);
+    if (!tidx_write(fout, chrv) || fclose(fout)) 
+        fail("%s:%s\n", tmp.c_str(),strerror(errno));
+    if (rename(tmp.c_str(), out.c_str()))
+        fail("%s:%s\n", out.c_str(),strerror(errno));
 
     //
     xst = xtime();
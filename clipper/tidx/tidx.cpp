@@ -35,9 +35,10 @@ int main (int argc, char **argv) {
     char sub_e = 0;
     int skip_i = 0;
     bool dump = 0;
+    int threads = 0;
 
     char c;
-    while ( (c = getopt (argc, argv, "Dlhdt:r:c:b:T:e:p:i:s:a:nB")) != -1) {
+    while ( (c = getopt (argc, argv, "Dlhdt:r:c:b:T:e:p:i:s:a:nBj:")) != -1) {
         switch (c) {
             case 'd':
                 debug=true; break;
@@ -55,6 +56,8 @@ int main (int argc, char **argv) {
                 sep = optarg; break;
             case 'p':
                 point = optarg; break;
+            case 'j':
+                threads = atoi(optarg); break;
             case 's':
                 if (isdigit(*optarg))
                     skip_i = atoi(optarg);
@@ -109,6 +112,7 @@ int main (int argc, char **argv) {
             tidx x;
             if (debug) 
                 x.debug=true;
+            x.threads=threads;
             x.build(vin[f_i], sep, nchr, nbeg, nend, skip_i, skip_c, sub_e);
         }
     } else {
@@ -185,7 +189,7 @@ fputs(
 "   or: tidx [options] -B -i IFILE\n"
 "\n"
 "Fragments and merges overlapping regions in an file with start-stop values.\n"
-"Creating a simple, fast, compressed index\n"
+"Creating a simple, fast, memory-mapped index\n"
 "\n"
 "Also can load that index, and search AFILE for intersecting lines\n"
 "\n"
@@ -201,6 +205,7 @@ fputs(
 "\n"
 "-i IFILE       Text file to index (can specify more than one)\n"
 "-B             Build index, don't annotate\n"
+"-j INT         Build threads, one chromosome each (one per core)\n"
 "-a FILE        Read text file and annotate\n"
 "-p CHR:POS     Lookup a single point (slow!)\n"
 "-r STRING      Annotation response separator (^)\n"
@@ -9,21 +9,141 @@ public:
     std::vector<long> pos;
 };
 
+// file positions of the lines found by a lookup, read out of the index
+// a fragment's lines are runs of consecutive ids, each a varint: the gap from the last run's end (zigzag, 
+// converted version 1 lists can step back) << 1 | (count > 1), then count-2 if so.
+// fastest read in order, and one reader at a time: it keeps its place
+class tidx_pos {
+    const unsigned char *run;
+    const long *idx;        // byte offsets of the fragments, nf+1
+    long nf;
+    const long *off;        // file position of each id
+    long n;
+    mutable long at, f, id, left, prev, last;
+    mutable const unsigned char *q;
+    static unsigned long getv(const unsigned char *&q) {
+        unsigned long v = 0; int s = 0;
+        while (*q & 0x80) {v |= (unsigned long) (*q++ & 0x7f) << s; s += 7;}
+        return v | (unsigned long) *q++ << s;
+    }
+    void start() const {at=0; f=0; id=0; left=0; prev=0; last=0; q=run+(nf ? idx[0] : 0);}
+    long next() const {
+        while (!left) {
+            if (q == run + idx[f+1]) {++f; prev=0; continue;}
+            unsigned long v = getv(q), z = v >> 1;
+            id = prev + ((z & 1) ? -(long) ((z+1) >> 1) : (long) (z >> 1));
+            left = (v & 1) ? getv(q) + 2 : 1;
+            prev = id + left;
+        }
+        --left; ++at;
+        return id++;
+    }
+public:
+    tidx_pos() {run=NULL; idx=NULL; nf=0; off=NULL; n=0; start();}
+    tidx_pos(const unsigned char *r, const long *x, long b, const long *o) {
+        run=r; idx=x; nf=b; off=o; n=0; start();
+        // count them
+        const unsigned char *e = run + idx[nf];
+        while (q < e) {unsigned long v = getv(q); n += (v & 1) ? getv(q) + 2 : 1;}
+        start();
+    }
+    long size() const {return n;}
+    long operator[](long i) const {
+        if (i == at-1) return last;
+        if (i < at) start();
+        while (at < i) next();
+        return last = off[next()];
+    }
+};
+
+// one chromosome of a loaded index: sorted, non-overlapping fragments
+class tidx_chr {
+public:
+    long n;
+    const int *beg;
+    const int *end;
+    const long *idx;        // n+1 entries, fragment i's lines are coded in run[idx[i]] up to run[idx[i+1]]
+    const unsigned char *run;   // ids are numbered in listing order, so covering lines come in runs
+    long nid;
+    const long *off;        // nid entries, each line's file position, stored once
+    tidx_pos hits(long a, long b) const {return tidx_pos(run, idx+a, b-a, off);}
+};
+
+class tidx;
+class tidx_cursor;
+
+// one line of the indexed file, chomped and nul terminated.  points into a line cache, good until its next fetch
+class tidx_line {
+public:
+    const char *s;
+    int n;
+};
+
+// recently read lines, keyed by file offset, least recently used go first
+// misses are sorted and read with pread in blocks, so caches on different threads can share the file
+class tidx_cache {
+    struct ent {
+        long off;
+        int prev, next;
+        std::string s;
+    };
+    std::vector<ent> ents;
+    int head, tail;
+    google::dense_hash_map<long,int> slot;
+    std::vector<long> miss;
+    std::vector<int> got;
+    std::vector<tidx_line> ret;
+    std::vector<char> buf;
+    void grow(size_t n);
+    void touch(int i);
+    void put(long off, const char *b, const char *e);
+public:
+    tidx_cache();
+    const std::vector<tidx_line> &fetch(const tidx *t, const tidx_pos &v);
+};
+
 class tidx {
-    FILE *fh;
+    friend class tidx_cache;
+    int src;                // the indexed file, only read with pread
+    int src_err;
+    tidx_cache cache;       // for the lookups below that return strings
+    std::string ret;
     void init();
+
+    // index, mapped read-only (version 1 files are converted to a temp file first)
+    char *img;
+    size_t img_len;
+    google::dense_hash_map<std::string,tidx_chr> chrs;
+    std::vector<long> ret_v;
+    bool load(int fd);
+
+    tidx(const tidx &);                 // owns the mapping
+    tidx & operator=(const tidx &);
 public:
+    typedef tidx_cursor cursor;
+
     bool debug;
+    int threads;            // build: chromosomes fragmented at once, 0 for one per core
     tidx() {init();};
     tidx(const char *path)  {init(); read(path);};
+    ~tidx();
 
     std::string path;
-    google::dense_hash_map<std::string,std::vector<annot> > map;
+    google::dense_hash_map<std::string,std::vector<annot> > map;        // only used while building
 
     void dump(FILE *stream);
     bool read(const char *path);
     void build(const char *path, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, bool sub_e);
 
+// no copying, safe to share between threads
+    tidx_pos lookup_p(const char *chr, int pos);
+    tidx_pos lookup_pr(const char *chr, int beg, int end);
+    const tidx_chr *find_chr(const char *chr) const;
+
+// the lines at v, each preceded by msep.  these and the string lookups share one cache, use a cursor per thread
+    std::string lines(const tidx_pos &v, const char *msep);
+    const std::vector<tidx_line> &fetch(const tidx_pos &v) {return cache.fetch(this, v);}
+
     const std::vector <long int> & lookup(const char *chr, int pos);
     std::string lookup(const char *chr, int pos, const char *msep);
 
@@ -36,8 +156,34 @@ public:
     const char * lookup_cr(const char *chr, int beg, int end, const char *msep);
 };
 
+// lookups that remember where the last one landed, for sorted (or nearly sorted) positions
+// each one steps forward from there, and only jumps are searched.  one per thread, the index can be shared.
+class tidx_cursor {
+    tidx *t;
+    bool sought;
+    std::string chr;
+    const tidx_chr *c;
+    long i;                 // first fragment ending at or after the last position
+    std::string ret;
+    tidx_cache cache;
+    bool seek(const char *chr, int pos);
+public:
+    tidx_cursor(tidx *idx) {t=idx; sought=false; c=NULL; i=0;}
+
+    tidx_pos lookup_p(const char *chr, int pos);
+    tidx_pos lookup_pr(const char *chr, int beg, int end);
+
+// the lines themselves, good until the next lookup on this cursor
+    const std::vector<tidx_line> &lookup_v(const char *chr, int pos) {return cache.fetch(t, lookup_p(chr, pos));}
+    const std::vector<tidx_line> &lookup_rv(const char *chr, int beg, int end) {return cache.fetch(t, lookup_pr(chr, beg, end));}
+
+    std::string lookup(const char *chr, int pos, const char *msep);
+    std::string lookup_r(const char *chr, int beg, int end, const char *msep);
+    const char * lookup_c(const char *chr, int pos, const char *msep);
+    const char * lookup_cr(const char *chr, int beg, int end, const char *msep);
+};
+
 void chomp_line(struct line &l);
 
 // build, with no return value, for API use
 void tidx_build(const char *path, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, bool sub_e);
-
@@ -29,22 +29,34 @@ THE SOFTWARE.
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include <gsl/gsl_randist.h>
+#include <gsl/gsl_sf_gamma.h>
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include <string>
 #include <queue>
 #include <list>
+#include <set>
+#include <map>
 
 #include <sparsehash/sparse_hash_map> // or sparse_hash_set, dense_hash_map, ...
 #include <sparsehash/dense_hash_map> // or sparse_hash_set, dense_hash_map, ...
 #include "tidx/tidx.h"
+#include "samtools/bam.h"
+#include "samtools/faidx.h"
+#include <zlib.h>
+
+extern "C" int bam_prob_realn_core(bam1_t *b, const char *ref, int flag);
 
 #include "fastq-lib.h"
 
-#define SVNREV atoi(strchr("$Revision$", ':')+1)
+// 0 when the keyword isn't expanded (not an svn checkout)
+#define SVNREV (strchr("$Revision$", ':') ? atoi(strchr("$Revision$", ':')+1) : 0)
 const char * VERSION = "0.96";
 
 #define MIN_READ_LEN 20
@@ -68,7 +80,7 @@ FILE *stat_fout=NULL;
     #define debug(s,...)
 #endif
 #undef warn
-#define warn(s,...) (++errs, fprintf(stderr,s,##__VA_ARGS__))
+#define warn(s,...) (__sync_fetch_and_add(&errs,1), fprintf(stderr,s,##__VA_ARGS__))
 #define die(s,...) (fprintf(stderr,s,##__VA_ARGS__), exit(1))
 #define stat_out(s,...) fprintf(stat_fout,s,##__VA_ARGS__)
 #define stdev(cnt, sum, ssq) sqrt((((double)cnt)*ssq-pow((double)sum,2)) / ((double)cnt*((double)cnt-1)))
@@ -105,12 +117,18 @@ int rand_round(double x);
 
 // basic utils
 std::vector<char *> split(char* str, char delim);
-int split(char **buf, char* str, char delim);
+
+// printf's %d, %.Nf, %.Ng and %.Ne, appended without stdio (same text printf would give)
+void str_int(std::string &s, long long v, int width=0);
+void str_fix(std::string &s, double x, int prec);
+void str_gen(std::string &s, double x, int prec=6);
+void str_sci(std::string &s, double x, int prec);
+int split(char **buf, char* str, char delim, int max);
 std::string string_format(const std::string &fmt, ...);
-void to_upper(const std::string str);
 void rename_tmp(std::string f);
 
 int errs=0;
+int nthreads=1;
 extern int optind;
 int g_lineno=0;
 double vse_rate[T_CNT][T_CNT];
@@ -127,48 +145,57 @@ public:
     sparse_hash_map<string, Faient> faimap;
 
     string fa_n;
-    FILE *fa_f;
+    const char *fa_m;               // whole file, mapped read-only, shards share it without locking
+    size_t fa_len;
 
-    Faidx() {fa_f=NULL;};
-    void Load(const char *path);                    // open file, read fai
+    Faidx() {fa_m=NULL; fa_len=0;};
+    ~Faidx() {if (fa_m) munmap((void *)fa_m, fa_len);};
+    void Load(const char *path);                    // map file, read fai
 
     // read into buffer
     bool Fetch(char *buf, const string &chr, int pos_from, int pos_to) {
-        Fetch(buf, Chrdex(chr), pos_from, pos_to);
+        return Fetch(buf, Chrdex(chr), pos_from, pos_to);
     };
 
     // read into buffer, with cached Chrdex
     bool Fetch(char *buf, const Faient *ent, int pos_from, int pos_to);
     const Faient * Chrdex(const string &chr) {
-        return &(faimap[chr]);
+        sparse_hash_map<string, Faient>::iterator it = faimap.find(chr);
+        return it == faimap.end() ? NULL : &(it->second);
     }
 };
 
 class Noise {
 public:
-	Noise() {noise=0;depth=0;};
-	Noise(char r, char v, int d, double n, double q, double mq) {ref=r, var=v, depth=d; noise=n;qnoise=q;mnqual=mq;};
+	Noise() {noise=0;depth=0;ins=0;del=0;seq=0;};
+	Noise(char r, char v, int d, double n, double q, double mq, double in, double dn) {ref=r, var=v, depth=d; noise=n;qnoise=q;mnqual=mq;ins=in;del=dn;seq=0;};
     char ref;
     char var;
 	double noise;
 	double qnoise;
 	int depth;
 	double mnqual;
+    double ins;         // insert and deletion noise, at the same locus
+    double del;
+    long seq;           // input order
 };
 
-double quantile_depth(const vector<Noise> &vec, double p);
-
 bool noisebydepth (const Noise &a, const Noise &b) { return (a.depth>b.depth);}
+bool noisebyseq (const Noise &a, const Noise &b) { return (a.seq<b.seq);}
+// deeper first, then earlier, so ties at the cutoff keep the same locii a stable sort would
+bool noisebydepthseq (const Noise &a, const Noise &b) { return (a.depth>b.depth) || (a.depth==b.depth && a.seq<b.seq);}
 
+// one read at one locus, as in an mpileup column: [^M]call[+-N seq][$]
 class PileupEnt {
 public:
-	bool is_rev;
 	bool is_start;
-	bool f;
-	const char *b;
-	int q;
-	int m;
-	int p;
+	bool is_end;
+	char c;                 // call: . , ACGTN acgtn * > <
+	char idl;               // '+' or '-' if an indel follows
+	int q;                  // base qual
+	int m;                  // map qual, only set at read start
+	int idl_len;
+	const char *idl_seq;
 };
 
 class vcall {
@@ -178,16 +205,134 @@ public:
 	bool is_ref;
     int qual, fwd, rev, mq0, mn_qual, qual_ssq, mq_sum, mq_ssq, tail_rev, tail_fwd, fwd_q, rev_q;
     double diversity, agreement;
-	vector <string> seqs;
     int depth() const {return fwd+rev;}
     int mq_rms() const {return sqrt(mq_ssq/depth());}
     int qual_rms() const {return sqrt(qual_ssq/depth());}
 };
 
+bool hitolocall (const vcall &i,const vcall &j) {return ((i.depth())>(j.depth()));}
+
+// a locus' calls, indexed by b2i (A C G T * - + N), in place, so summaries copy without allocating
+class CallList {
+    vcall c[T_CNT];
+    int n;                  // calls in use
+public:
+    CallList() {n=0;}
+    CallList(const CallList &x) {*this=x;}
+    CallList & operator=(const CallList &x) {n=x.n; int i; for (i=0;i<n;++i) c[i]=x.c[i]; return *this;}
+    int size() const {return n;}
+    void clear() {n=0;}
+    void resize(int m) {int i; for (i=n;i<m;++i) c[i]=vcall(); n=m;}
+    vcall & operator[](int i) {return c[i];}
+    const vcall & operator[](int i) const {return c[i];}
+
+    // indexes of the calls, deepest first.  the same order sorting the calls themselves would give
+    void Order(int *ord) const;
+};
+
+class hitolocall_i {
+    const CallList *c;
+public:
+    hitolocall_i(const CallList *x) {c=x;}
+    bool operator()(int i, int j) const {return hitolocall((*c)[i], (*c)[j]);}
+};
+
+void CallList::Order(int *ord) const {
+    int i;
+    for (i=0;i<n;++i) 
+        ord[i]=i;
+    sort(ord, ord+n, hitolocall_i(this));
+}
+
+// the distinct indel sequences of a locus, and how many reads have each
+// each is kept once, in an arena reused with the window slot, and found with a small hash
+class IndelSeqs {
+    struct Ent {
+        char type;          // + or -
+        int off, len, cnt;
+        unsigned hash;
+    };
+    vector<Ent> Ents;
+    vector<int> Slots;      // open addressed, index into Ents + 1, 0 if empty
+    string Arena;
+    void Rehash(int n);
+public:
+    void clear() {Ents.clear(); Slots.clear(); Arena.clear();}
+    void Add(char type, const char *seq, int len, int cnt=1);
+    int size() const {return Ents.size();}
+    char Type(int i) const {return Ents[i].type;}
+    int Count(int i) const {return Ents[i].cnt;}
+    string Seq(int i) const {return Arena.substr(Ents[i].off, Ents[i].len);}
+    int Top(char type, string &seq) const;
+};
+
+void IndelSeqs::Rehash(int n) {
+    Slots.assign(n, 0);
+    int i;
+    for (i=0;i<Ents.size();++i) {
+        unsigned k = Ents[i].hash & (n-1);
+        while (Slots[k]) 
+            k = (k+1) & (n-1);
+        Slots[k] = i+1;
+    }
+}
+
+void IndelSeqs::Add(char type, const char *seq, int len, int cnt) {
+    unsigned h = 2166136261u ^ (unsigned char) type;    // fnv-1a
+    int i;
+    for (i=0;i<len;++i) 
+        h = (h ^ (unsigned char) seq[i]) * 16777619u;
+
+    if (Slots.size() < 2*(Ents.size()+1)) 
+        Rehash(max(16, (int) Slots.size()*2));
+
+    unsigned k = h & (Slots.size()-1);
+    while (Slots[k]) {
+        Ent &e = Ents[Slots[k]-1];
+        if (e.hash == h && e.type == type && e.len == len && !memcmp(Arena.data()+e.off, seq, len)) {
+            e.cnt += cnt;
+            return;
+        }
+        k = (k+1) & (Slots.size()-1);
+    }
+    Ent e;
+    e.type=type; e.off=Arena.size(); e.len=len; e.cnt=cnt; e.hash=h;
+    Arena.append(seq, len);
+    Ents.push_back(e);
+    Slots[k] = Ents.size();
+}
+
+// the commonest sequence of type, and its count.  ties go to the first in sort order
+int IndelSeqs::Top(char type, string &seq) const {
+    int i, m=-1;
+    for (i=0;i<Ents.size();++i) {
+        const Ent &e = Ents[i];
+        if (e.type != type) 
+            continue;
+        if (m >= 0) {
+            const Ent &b = Ents[m];
+            if (e.cnt < b.cnt) 
+                continue;
+            if (e.cnt == b.cnt) {
+                int r = memcmp(Arena.data()+e.off, Arena.data()+b.off, min(e.len, b.len));
+                if (r > 0 || (r == 0 && e.len >= b.len)) 
+                    continue;
+            }
+        }
+        m=i;
+    }
+    if (m < 0) {
+        seq.clear();
+        return 0;
+    }
+    seq.assign(Arena, Ents[m].off, Ents[m].len);
+    return Ents[m].cnt;
+}
+
 class vfinal {
 public:
     vfinal(vcall &c) {max_idl_cnt=0; padj=1; pcall = &c;};
-    vfinal & operator=(vfinal const&x) {max_idl_seq=x.max_idl_seq; max_idl_cnt=x.max_idl_cnt; padj=x.padj; pcall=x.pcall;}
+    vfinal & operator=(vfinal const&x) {max_idl_seq=x.max_idl_seq; max_idl_cnt=x.max_idl_cnt; padj=x.padj; pcall=x.pcall; return *this;}
     vcall *pcall;
     string max_idl_seq;
     int max_idl_cnt;
@@ -195,35 +340,69 @@ public:
     bool is_indel() {return max_idl_cnt > 0;};
 };
 
-bool hitolocall (const vcall &i,const vcall &j) {return ((i.depth())>(j.depth()));}
 bool sortreffirst (const vfinal &i,const vfinal &j) {return (i.pcall->is_ref&&!j.pcall->is_ref)||((i.pcall->is_ref==j.pcall->is_ref) && ((i.pcall->depth())>(j.pcall->depth())));}
 
 class Read {
 public:
     int MapQ;
     int Pos;
-    string Seq;
-    Read() {MapQ=Pos=0;};
+    int Len;                // bases and indel lengths seen so far
+    Read() {MapQ=Pos=Len=0;};
 };
 
+class q_calls {public: q_calls() {meminit(call);} int call[8];};
+
 class PileupReads {
 public:
     double MeanReadLen() {return ReadBin.size() ? TotReadLen/ReadBin.size() : MIN_READ_LEN;}
     int TotReadLen;
-    deque<Read> ReadBin;
-    list<Read> ReadList;
-    PileupReads() {TotReadLen=0;}
+    deque<int> ReadBin;                 // lengths of recently finished reads
+    vector<Read> Active;                // reads in the last column, in pileup order
+    vector<Read> Next;                  // the column being parsed, swapped with Active after
+    vector<int> DepthByPos;             // scratch, depth by position in read
+    vector<q_calls> DepthByPosByCall;
+    bool Resume;                        // after a jump, reads already under way show up without a start
+    PileupReads() {TotReadLen=0; Resume=false;}
+    void NewChr() {TotReadLen=0; ReadBin.clear();}
 };
 
-class PileupSummary {
+// chromosome names, interned so summaries carry a pointer instead of a copy
+class ChrNames {
+    set<string> Names;      // set: pointers into it stay valid
+    const char *Last;
 public:
+    ChrNames() {Last=NULL;}
+    const char *Intern(const char *chr) {
+        if (Last && !strcmp(Last, chr))
+            return Last;
+        return Last = Names.insert(chr).first->c_str();
+    }
+};
+
+typedef struct  {
     string Chr;
+    int Beg;
+    int End;
+} ChrRange;
+
+// amplicons over a locus, for the pcr filter.  looked up once per column, the samples of a joint pileup share them
+class AmpList {
+public:
+    vector<ChrRange> Amps;
+    int Regions;
+    void Lookup(tidx::cursor *adex, const char *chr, int pos, char atype);
+};
+
+class PileupSummary {
+public:
+    const char *Chr;        // interned, compare by pointer
     int Pos;
     char Base;
     int Depth;
     int TotQual;
     int NumReads;
-    vector<vcall> Calls;
+    CallList Calls;
+    IndelSeqs Seqs;         // of the + and - calls
     bool InTarget;
     int Regions;
 
@@ -236,8 +415,8 @@ public:
     int RepeatCount;
     char RepeatBase;
 
-	void Parse(char *line, PileupReads &reads, tidx *annot=NULL, char annot_type='\0');
-    PileupSummary() { Base = '\0'; Pos=-1; };
+	void Parse(const vector<PileupEnt> &ents, PileupReads &reads, const AmpList *amps=NULL);
+    PileupSummary() { Chr = ""; Base = '\0'; Pos=-1; };
 };
 
 class PileupManager;
@@ -245,10 +424,12 @@ class PileupManager;
 class PileupSubscriber {
 public:
     PileupManager *Manager;
+    int Sample;             // which sample of a joint pileup is visited, -1 for all of them
     virtual void Visit(PileupSummary &dat) = 0;
     virtual void Finish() {};
-    PileupSubscriber(PileupManager &man);
-    PileupSubscriber() {Manager = NULL;}
+    PileupSubscriber(PileupManager &man, int sample=0);
+    PileupSubscriber() {Manager = NULL; Sample = 0;}
+    virtual ~PileupSubscriber() {}
     void SetManager(PileupManager &man);
 };
 
@@ -256,9 +437,20 @@ class PileupManager  {
 friend class PileupSubscriber;
 
 private:
-    void Visit(PileupSummary &dat);
-    void VisitX(PileupSummary &dat, int windex);
-    PileupSummary Pileup;
+    void Visit(PileupSummary *col, int stride);
+    void VisitX(PileupSummary *col, int windex);
+    void Save(const PileupSummary &dat);
+    void ParseCol(const char *chr, int pos, char base, const vector<PileupEnt> *ents);
+    vector<PileupSummary> Pileup;   // the column being parsed, one summary per sample
+    vector<vector<PileupEnt> > Ents;          // text pileup reads, per sample
+    vector<char *> Fields;          // text pileup columns
+    PileupSummary JunkSummary;      // window placeholder
+    ChrNames Chrs;
+    const char *ReadChr;            // chromosome the read lengths are from
+    AmpList Amps;
+    const char *FaiChr;             // cached faidx entry, for FillReference
+    const Faidx::Faient *FaiEnt;
+    bool RefFilled;                 // Reference is already the visited locus's
 
 protected:
     vector<PileupSubscriber *> Kids;
@@ -270,61 +462,213 @@ public:
     int WinMax;             // flanking window size
     int WinDex;             // current index into the window (ususally midpoint)
 
-    deque<PileupSummary> Win;
+    // joint calling: every column has a summary for each sample, in the same window slot
+    // the work that only depends on the locus (repeat context, annotation, reference) is done once
+    int Samples;
+    void SetSamples(int n);
+
+    // ring of WinMax columns, reused in place so visiting a locus doesn't allocate
+    vector<PileupSummary> Win;
+    int WinBeg;             // ring index of the oldest column
+    int WinLen;             // columns in the ring
+    PileupSummary &WinAt(int i, int s=0) {return Win[((WinBeg+i)%WinMax)*Samples+s];}
 
     int UseAnnot;
     tidx AnnotDex;          // start/stop index file
+    tidx *Annot;            // AnnotDex, or another manager's
+    tidx::cursor AnnotCur;  // in-target lookups, at the window midpoint
+    tidx::cursor AmpCur;    // amplicon lookups, at the leading edge
     char AnnotType;         // b (bed) or g (gtf - preferred)
+    bool Regional;          // calling: only the annotated regions (and flanks) of indexed input are read
+
+    vector<PileupReads> Reads;      // per sample
 
-    PileupReads Reads;
+    gzFile Spill;           // one pass: parsed summaries are saved here, before the window, for Replay
+    const char *SpillChr;
  
-    PileupManager() {InputType ='\0'; WinMax=0; WinDex=0; UseAnnot=0; AnnotType='\0';}
+    PileupManager() : AnnotCur(&AnnotDex), AmpCur(&AnnotDex) {InputType ='\0'; WinMax=0; WinDex=0; WinBeg=0; WinLen=0; UseAnnot=0; Annot=&AnnotDex; AnnotType='\0'; Regional=false; Spill=NULL; SpillChr=NULL; ReadChr=NULL; FaiChr=NULL; FaiEnt=NULL; RefFilled=false; SetSamples(1);}
 
     void Finish();
+    void Replay(gzFile in);
 
     void Parse(char *dat);
+    void Parse(const char *chr, int pos, char base, const vector<PileupEnt> &ents);
+    void Parse(const char *chr, int pos, char base, const vector<vector<PileupEnt> > &ents);
+
+    void Jump();
+    void TargetRegions(const char *chr, vector<ChrRange> &r);
 
     void LoadAnnot(const char *annot_file);
+    void ShareAnnot(const PileupManager &from) {
+        UseAnnot=from.UseAnnot; Annot=from.Annot; AnnotType=from.AnnotType; Regional=from.Regional;
+        AnnotCur=tidx::cursor(Annot); AmpCur=tidx::cursor(Annot);
+    }
     void FillReference(int refSize);
 };
 
+#define NOISE_TOP 100000            // deepest locii the error rates are estimated from
+#define DEPTH_HIST_MAX 65536        // depths counted in an array below this, in a map above
+
+// memory doesn't grow with the number of locii: sampled depths are only counted,
+// and the noise is kept for the NOISE_TOP deepest locii, in a heap with the shallowest on top
 class VarStatVisitor : public PileupSubscriber {
     public:
-    VarStatVisitor() : PileupSubscriber() {tot_locii=0; tot_depth=0; num_reads=0; stats.reserve(1000000); ins_stats.reserve(1000000); del_stats.reserve(1000000);};
-    VarStatVisitor(PileupManager &man) : PileupSubscriber(man) {tot_locii=0; tot_depth=0; num_reads=0;};
+    // the samples of a joint pileup are pooled
+    VarStatVisitor() : PileupSubscriber() {Sample=-1; Init();};
+    VarStatVisitor(PileupManager &man) : PileupSubscriber(man, -1) {Init();};
 
     void Visit(PileupSummary &dat);
     void Finish() {};
+    void Merge(const VarStatVisitor &x);
 
 	double tot_depth;
 	int tot_locii;
 	int num_reads;
-	vector<Noise> stats;
-	vector<Noise> ins_stats;
-	vector<Noise> del_stats;
+    long num_noise;                 // locii at sampling depth
+	vector<Noise> top;
+
+    double DepthQuantile(double p) const;       // as if all sampled locii were sorted deepest first
+    long DepthCount(int min) const;             // sampled locii at least this deep
+
+    private:
+    vector<long> depth_cnt;
+    map<int,long> depth_big;
+    void Init() {tot_locii=0; tot_depth=0; num_reads=0; num_noise=0; depth_cnt.resize(DEPTH_HIST_MAX);};
+    void AddDepth(int d, long n) {if (d < DEPTH_HIST_MAX) depth_cnt[d]+=n; else depth_big[d]+=n; num_noise+=n;};
+    void AddNoise(const Noise &n);
+    int DepthAt(long r) const;
+};
+
+
+#define POISSON_TAB_MAX 131072      // ln(k!) is tabled below this, gsl is called above it
+#define POISSON_MEMO 1024           // recent (k, mu) pairs remembered
+
+// poisson pdf, computed as gsl_ran_poisson_pdf does, but ln(k!) is tabled and
+// repeat (depth, count) pairs, common when the error rate is the global one, are looked up
+class PoissonCache {
+    vector<double> LnFact;
+    struct {
+        unsigned int k;
+        double mu;
+        double p;
+    } Memo[POISSON_MEMO];
+public:
+    PoissonCache() {
+        int i;
+        for (i=0;i<POISSON_MEMO;++i) {
+            Memo[i].k=0; Memo[i].mu=-1;
+        }
+    }
+    double Pdf(unsigned int k, double mu) {
+        if (mu == 0)
+            return k == 0 ? 1.0 : 0.0;
+        if (k >= POISSON_TAB_MAX)
+            return gsl_ran_poisson_pdf(k, mu);
+        uint64_t mb;
+        memcpy(&mb, &mu, sizeof(mb));
+        unsigned int h = (k * 2654435761u ^ (unsigned int) (mb ^ (mb >> 29))) % POISSON_MEMO;
+        if (Memo[h].k == k && Memo[h].mu == mu)
+            return Memo[h].p;
+        if (k >= LnFact.size()) {
+            unsigned int i = LnFact.size();
+            LnFact.resize(min(max(k+1, i*2), (unsigned int) POISSON_TAB_MAX));
+            for (;i<LnFact.size();++i)
+                LnFact[i]=gsl_sf_lnfact(i);
+        }
+        Memo[h].k=k;
+        Memo[h].mu=mu;
+        return Memo[h].p = exp(log(mu) * k - LnFact[k] - mu);
+    }
 };
 
+// per-locus outputs
+#define OUT_VAR 0
+#define OUT_TGT_VAR 1
+#define OUT_EAV 2
+#define OUT_VCF 3
+#define OUT_CSE 4
+#define OUT_TGT_CSE 5
+#define OUT_NOISE 6
+#define N_LOCUS_OUT 7
+FILE **locus_out(int i);
 
 class VarCallVisitor : public PileupSubscriber {
     public:
 
-    VarCallVisitor(PileupManager &man) : PileupSubscriber(man) {
+    // writes to the thread's per-locus outputs, as they are when it's made
+    VarCallVisitor(PileupManager &man, int sample=0) : PileupSubscriber(man, sample) {
         SkippedAnnot=0;
         SkippedDepth=0;
         Hets=0;
         Homs=0;
         Locii=0;
+        int i;
+        for (i=0;i<N_LOCUS_OUT;++i)
+            Out[i]=*locus_out(i);
     };
 
     void Visit(PileupSummary &dat);
+    void Finish() {Flush(true);};
 
 	int SkippedDepth;
 	int SkippedAnnot;
 	int Locii;
 	int Hets;
 	int Homs;
+
+    PoissonCache Poisson;
+
+    FILE *Out[N_LOCUS_OUT];
+
+    // rows for each per-locus output, written out in large pieces
+    string VarOut, TgtVarOut, EavOut, VcfOut, CseOut, TgtCseOut;
+    void Flush(bool all);
+};
+
+// one chromosome of a -t run
+class VarShard {
+public:
+    int tid;
+    int cols;                       // pileup columns
+    int spill_fd;                   // --one-pass, saved summaries
+    FILE *out[N_LOCUS_OUT];         // this shard's piece of each per-locus output
+    VarStatVisitor *vstat;
+    int Locii, Hets, Homs, SkippedDepth, SkippedAnnot;
+
+    VarShard(int t) {tid=t; cols=0; spill_fd=-1; meminit(out); vstat=NULL; Locii=Hets=Homs=SkippedDepth=SkippedAnnot=0;}
+};
+
+// shards, shared by the worker threads
+class VarShardPool {
+public:
+    vector<VarShard> *shards;
+    int next;
+    pthread_mutex_t lock;
+    int in_n;
+    char **in;
+    const char *ref;
+    FILE *out[N_LOCUS_OUT];         // main thread's outputs, to see which are on
+    bool calling;                   // else stats
+    bool spill;                     // stats: save summaries for calling
+    bool vstats;                    // calling: gather stats too
+    const PileupManager *annot;     // calling: share its annotation
+
+    VarShardPool(vector<VarShard> &s, int n, char **i, const char *r) {
+        shards=&s; next=0; in_n=n; in=i; ref=r;
+        calling=spill=vstats=false; annot=NULL;
+        meminit(out);
+        pthread_mutex_init(&lock, NULL);
+    }
+    ~VarShardPool() {pthread_mutex_destroy(&lock);}
 };
 
+void plan_shards(vector<VarShard> &shards, int in_n, char **in, const char *ref);
+void run_shards(VarShardPool &sp);
+void merge_shards(vector<VarShard> &shards, VarStatVisitor *vstat, VarCallVisitor *vcall);
+void setup_caller(PileupManager &pman, const char *target_annot);
+int tmp_fd();
+void spill_close(PileupManager &pman);
+
 bool hasdata(const string &file) {
 	struct stat st;
 	if (stat(file.c_str(), &st)) {
@@ -362,9 +706,12 @@ bool output_ref=0;              // set to 1 if you want to output reference-only
 bool no_indels=0;
 
 void parse_bams(PileupManager &v, int in_n, char **in, const char *ref);
+int pileup_bams(PileupManager &v, int in_n, char **in, const char *ref, int tid=-1);
 void check_ref_fai(const char * ref);
 
-FILE *noise_f=NULL, *var_f = NULL, *varsum_f = NULL, *tgt_var_f = NULL, *tgt_cse_f = NULL, *vcf_f = NULL, *eav_f=NULL, *cse_f=NULL;
+FILE *varsum_f = NULL;
+// per-locus outputs, -t shards each write their own piece
+__thread FILE *noise_f=NULL, *var_f = NULL, *tgt_var_f = NULL, *tgt_cse_f = NULL, *vcf_f = NULL, *eav_f=NULL, *cse_f=NULL;
 
 double alpha=.05;
 int phred=33;
@@ -392,9 +739,13 @@ int str_in(const char *needle, const char **haystack) {
 }
 
 void output_stats(VarStatVisitor &vstat);
+void open_locus_out(const char *prefix, const char **format_list, bool annot);
+void locus_headers(bool annot);
+void close_locus_out(FILE **out, const char *prefix);
 
 Faidx faidx;
 bool pcr_annot = false;
+bool target_only = false;       // call in-target locii only, like --pcr-annot does
 
 int main(int argc, char **argv) {
 	char c;
@@ -406,10 +757,12 @@ int main(int argc, char **argv) {
 	double upctqdepth=0;
 	int do_stats=0;
 	int do_varcall=0;
+	int one_pass=0;
 
     char *out_prefix = NULL;
     char *target_annot = NULL;
     const char *read_stats = NULL;
+    vector<string> samples;         // --samples, joint calling
 
 
 // list of default output formats used when -o is specified
@@ -421,6 +774,9 @@ int main(int argc, char **argv) {
     #define OPT_PCR_ANNOT '\1'
     #define OPT_DEBUG_LEVEL '\2'
     #define OPT_NO_INDELS '\3'
+    #define OPT_ONE_PASS '\4'
+    #define OPT_SAMPLES '\5'
+    #define OPT_TARGET_ONLY '\6'
     #define OPT_FILTER_ANNOT 'A'
 
 // long options
@@ -429,6 +785,9 @@ int main(int argc, char **argv) {
        {"filter-annot", 1, 0, OPT_FILTER_ANNOT},
        {"repeat-filter", 1, 0, 'R'},
        {"no-indels", 0, 0, OPT_NO_INDELS},
+       {"one-pass", 0, 0, OPT_ONE_PASS},
+       {"samples", 1, 0, OPT_SAMPLES},
+       {"target-only", 0, 0, OPT_TARGET_ONLY},
        {"agreement", 1, 0, 'G'},
        {"diversity", 1, 0, 'd'},
        {"version", 0, 0, 'V'},
@@ -436,11 +795,19 @@ int main(int argc, char **argv) {
        {0, 0, 0, 0}
     };
 
-	while ( (c = getopt_long(argc, argv, "?sv0VBhe:m:x:f:p:a:g:q:Q:i:o:D:R:b:L:S:F:A:G:d:",long_options,NULL)) != -1) {
+	while ( (c = getopt_long(argc, argv, "?sv0VBhe:m:x:f:p:a:g:q:Q:i:o:D:R:b:L:S:F:A:G:d:t:",long_options,NULL)) != -1) {
 		switch (c) {
 			case OPT_PCR_ANNOT: target_annot=optarg; pcr_annot=true; break;
 			case OPT_FILTER_ANNOT: target_annot=optarg; pcr_annot=false; break;
 			case OPT_NO_INDELS: no_indels=true; break;
+			case OPT_ONE_PASS: one_pass=1; break;
+			case OPT_TARGET_ONLY: target_only=true; break;
+			case OPT_SAMPLES: {
+                char *tok, *saved;
+                for (tok = strtok_r(optarg, ",", &saved); tok; tok = strtok_r(NULL, ",", &saved)) 
+                    samples.push_back(tok);
+                break;
+            }
 			case 'h': usage(stdout); return 0;
 			case 'm': umindepth=ok_atoi(optarg); break;
 			case 'q': min_qual=ok_atoi(optarg); break;
@@ -472,6 +839,7 @@ int main(int argc, char **argv) {
 			case 'e': alpha=atof(optarg); break;
 			case 'g': global_error_rate=atof(optarg); break;
 			case 'L': total_locii=ok_atoi(optarg); break;
+			case 't': nthreads=ok_atoi(optarg); break;
 			case 'f': ref=optarg; break;
 			case 's': do_stats=1; break;
 			case 'S': read_stats=optarg; break;
@@ -505,34 +873,25 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-    if (out_prefix && do_varcall) {
-        var_f = openordie(string_format("%s.var.tmp", out_prefix).c_str(), "w");
+    if (samples.size() && do_varcall && !out_prefix) {
+        die("--samples needs an output prefix (-o), each sample has its own outputs\n");
+    }
 
-        fprintf(var_f,"%s\t%s\t%s\t%s\t%s\t%s\t%s%s\n","chr", "pos", "ref", "depth", "skip", "pct", (target_annot&&!pcr_annot) ? "target\t" : pcr_annot ? "regions\t" : "", "...");
+    if (target_only && !target_annot) {
+        die("--target-only needs an annotation (-A)\n");
+    }
 
+    if (out_prefix && do_varcall) {
         varsum_f = openordie(string_format("%s.varsum.tmp", out_prefix).c_str(), "w");
 
-        if (target_annot && !pcr_annot) {
-            // targted only output
-            tgt_var_f = openordie(string_format("%s.tgt.var.tmp", out_prefix).c_str(), "w");
-            fprintf(tgt_var_f,"%s\t%s\t%s\t%s\t%s\t%s\t%s\n","chr", "pos", "ref", "depth", "skip", "pct", "...");
-        }
- 
-        if (str_in("vcf", format_list)>=0) {
-            vcf_f = openordie(string_format("%s.vcf.tmp", out_prefix).c_str(), "w");
-        }
-        if (str_in("eav", format_list)>=0) {
-            eav_f = openordie(string_format("%s.eav.tmp", out_prefix).c_str(), "w");
-        }
-
         if (str_in("cse", format_list)>=0) {
             check_ref_fai(ref);
-            cse_f = openordie(string_format("%s.cse.tmp", out_prefix).c_str(), "w");
             faidx.Load(ref);
-            // targted only output
-            if (target_annot && ! pcr_annot) 
-                tgt_cse_f = openordie(string_format("%s.tgt.cse.tmp", out_prefix).c_str(), "w");
         }
+
+        // joint calling opens each sample's when it starts
+        if (!samples.size())
+            open_locus_out(out_prefix, format_list, target_annot != NULL);
     } else {
         var_f = stdout;
         varsum_f = stderr;
@@ -558,22 +917,53 @@ int main(int argc, char **argv) {
 
     meminit(vse_rate);
 
-	if (do_stats) {
+    // one pass -s -v: the stats pass saves its parsed summaries, and calling replays them
+    int spill_fd=-1;
+    char spill_type='\0';
+
+    // -t: split indexed bams up by chromosome
+    vector<VarShard> shards;
+    if (nthreads > 1 && !samples.size()) {
+        plan_shards(shards, in_n, in, ref);
+    }
+
+    if (do_stats) {
         if (out_prefix) {
             stat_fout = openordie(string_format("%s.stats", out_prefix).c_str(), "w");
             noise_f = openordie(string_format("%s.noise", out_prefix).c_str(), "w");
-		    fprintf(noise_f,"%s\t%s\t%s\t%s\t%s\t%s\n", "depth", "ref", "var", "noise", "qnoise", "qmean");
+            fprintf(noise_f,"%s\t%s\t%s\t%s\t%s\t%s\n", "depth", "ref", "var", "noise", "qnoise", "qmean");
         }
         if (!stat_fout)  {
             if (do_varcall)
-    		    stat_fout=stderr;			// stats to stderr
+                stat_fout=stderr;			// stats to stderr
             else
-    		    stat_fout=stdout;			// stats to stdout
+                stat_fout=stdout;			// stats to stdout
         }
         // do stats by myself
         PileupManager pman;
-		VarStatVisitor vstat(pman);
-		parse_bams(pman, in_n, in, ref);
+        if (samples.size()) 
+            pman.SetSamples(samples.size());
+        VarStatVisitor vstat(pman);
+        if (shards.size()) {
+            VarShardPool sp(shards, in_n, in, ref);
+            sp.spill = one_pass && do_varcall;
+            run_shards(sp);
+            merge_shards(shards, &vstat, NULL);
+            spill_type = 'B';
+        } else {
+            if (one_pass && do_varcall) {
+                spill_fd = tmp_fd();
+                pman.Spill = gzdopen(dup(spill_fd), "wb1");
+                // calling parses with the amplicon filter, so the saved summaries need it too
+                if (pcr_annot) 
+                    pman.LoadAnnot(target_annot);
+            }
+            parse_bams(pman, in_n, in, ref);
+            if (pman.Spill) {
+                spill_close(pman);
+                spill_type = pman.InputType;
+            }
+        }
         output_stats(vstat);
         if (out_prefix) {
             fclose(stat_fout);
@@ -683,10 +1073,6 @@ int main(int argc, char **argv) {
     if (total_locii<0) total_locii=DEFAULT_LOCII;
     if (total_locii==0) total_locii=1;          // no adjustment
 
-    if (eav_f) {
-        fprintf(eav_f,"chr\tpos\tref\tdepth\tnum_states\ttop_consensus\ttop_freq\tvar_base\tvar_depth\tvar_qual\tvar_strands\tforward_strands\treverse_strands\t%cval\tdiversity\tagreement\t%s\n", (total_locii>1?'e':'p'), (target_annot&&!pcr_annot) ? "in_target\t" : pcr_annot ? "regions\t" : "");
-    }
-
 	if (do_varcall) {
 		if (umindepth) min_depth=umindepth;
 		if (upctqdepth > 0) pct_qdepth=(double)upctqdepth/100;
@@ -715,73 +1101,135 @@ int main(int argc, char **argv) {
 		fprintf(varsum_f,"locii used for adjustment\t%d\n", total_locii);
 
         PileupManager pman;
-
-		VarCallVisitor vcall(pman);
+        if (samples.size()) 
+            pman.SetSamples(samples.size());
+
+        // joint: a caller for each sample, writing to its own outputs
+        vector<VarCallVisitor *> vcalls;
+        int s;
+        for (s=0;s<pman.Samples;++s) {
+            if (samples.size()) 
+                open_locus_out(string_format("%s.%s", out_prefix, samples[s].c_str()).c_str(), format_list, target_annot != NULL);
+            locus_headers(target_annot != NULL);
+            vcalls.push_back(new VarCallVisitor(pman, s));
+        }
+		VarCallVisitor &vcall = *vcalls[0];
 		VarStatVisitor vstat;
 
 		if (stat_fout) {
             vstat.SetManager(pman);
         }
        
-        if (target_annot) {
-            pman.LoadAnnot(target_annot);
-       }
-
-        if (cse_f) {
-            pman.WinMax=21;
-        } else if (repeat_filter > 0) {
+        setup_caller(pman, target_annot);
+        if (!cse_f && repeat_filter > 0) {
 		    fprintf(varsum_f,"homopolymer filter\t%d\n", repeat_filter);
-            pman.WinMax=repeat_filter+repeat_filter+3;
-        } else {
-            pman.WinMax=5;
         }
 
-        if (vcf_f) {
-            // print VCF header
-            fprintf(vcf_f, "%s\n", "##fileformat=VCFv4.1");
-        }
-        if (cse_f) {
-            fprintf(cse_f, "Chr\tPos\tRef\tA\tC\tG\tT\ta\tc\tg\tt\tAq\tCq\tGq\tTq\taq\tcq\tgq\ttq\tRefAllele\tAd\tCd\tGd\tTd\tAg\tCg\tGg\tTg%s\n", pcr_annot ? "\tRegions" : "");
+        if (shards.size()) {
+            VarShardPool sp(shards, in_n, in, ref);
+            sp.calling = true;
+            sp.vstats = stat_fout != NULL;
+            sp.annot = &pman;
+            run_shards(sp);
+            merge_shards(shards, stat_fout ? &vstat : NULL, &vcall);
+            pman.InputType = 'B';
+        } else if (spill_fd >= 0) {
+            lseek(spill_fd, 0, SEEK_SET);
+            gzFile spill = gzdopen(spill_fd, "rb");
+            pman.InputType = spill_type;
+            pman.Replay(spill);
+            gzclose(spill);
+        } else {
+		    parse_bams(pman, in_n, in, ref);
         }
 
-		parse_bams(pman, in_n, in, ref);
-
         if (pman.InputType == 'B') {
         	fprintf(varsum_f,"baq correct\t%s\n", (no_baq?"no":"yes"));
         }
-        fprintf(varsum_f,"locii\t%d\n", vcall.Locii);
-        fprintf(varsum_f,"hom calls\t%d\n", vcall.Homs);
-        fprintf(varsum_f,"het calls\t%d\n", vcall.Hets);
-        fprintf(varsum_f,"locii below depth\t%d\n", vcall.SkippedDepth);
-        fprintf(varsum_f,"locii outside annot\t%d\n", vcall.SkippedAnnot);
+        for (s=0;s<vcalls.size();++s) {
+            if (samples.size()) 
+                fprintf(varsum_f,"sample\t%s\n", samples[s].c_str());
+            fprintf(varsum_f,"locii\t%d\n", vcalls[s]->Locii);
+            fprintf(varsum_f,"hom calls\t%d\n", vcalls[s]->Homs);
+            fprintf(varsum_f,"het calls\t%d\n", vcalls[s]->Hets);
+            fprintf(varsum_f,"locii below depth\t%d\n", vcalls[s]->SkippedDepth);
+            fprintf(varsum_f,"locii outside annot\t%d\n", vcalls[s]->SkippedAnnot);
+        }
 
         if (out_prefix) {
             // close it all
-            fclose(var_f);
             fclose(varsum_f);
-            if (vcf_f) fclose(vcf_f);
-            if (eav_f) fclose(eav_f);
             if (noise_f) fclose(noise_f);
-            if (cse_f) fclose(cse_f);
-            if (tgt_var_f) fclose(tgt_var_f);
-            if (tgt_cse_f) fclose(tgt_cse_f);
-
-            rename_tmp(string_format("%s.var.tmp", out_prefix));
             rename_tmp(string_format("%s.varsum.tmp", out_prefix));
 
-            if (vcf_f) rename_tmp(string_format("%s.vcf.tmp", out_prefix));
-            if (eav_f) rename_tmp(string_format("%s.eav.tmp", out_prefix));
-            if (cse_f) rename_tmp(string_format("%s.cse.tmp", out_prefix));
-
-            if (tgt_var_f) rename_tmp(string_format("%s.tgt.var.tmp", out_prefix));
-            if (tgt_cse_f) rename_tmp(string_format("%s.tgt.cse.tmp", out_prefix));
+            for (s=0;s<vcalls.size();++s) {
+                if (samples.size()) 
+                    close_locus_out(vcalls[s]->Out, string_format("%s.%s", out_prefix, samples[s].c_str()).c_str());
+                else
+                    close_locus_out(vcalls[s]->Out, out_prefix);
+            }
 
             if (stat_fout) 
                 output_stats(vstat);
         }
+        for (s=0;s<vcalls.size();++s) 
+            delete vcalls[s];
 	}
 }
 
+// a caller's per-locus outputs, PREFIX.var and so on, as this thread's
+// header rows that depend on the stats are written by locus_headers
+void open_locus_out(const char *prefix, const char **format_list, bool annot) {
+    var_f = openordie(string_format("%s.var.tmp", prefix).c_str(), "w");
+
+    fprintf(var_f,"%s\t%s\t%s\t%s\t%s\t%s\t%s%s\n","chr", "pos", "ref", "depth", "skip", "pct", (annot&&!pcr_annot) ? "target\t" : pcr_annot ? "regions\t" : "", "...");
+
+    if (annot && !pcr_annot) {
+        // targted only output
+        tgt_var_f = openordie(string_format("%s.tgt.var.tmp", prefix).c_str(), "w");
+        fprintf(tgt_var_f,"%s\t%s\t%s\t%s\t%s\t%s\t%s\n","chr", "pos", "ref", "depth", "skip", "pct", "...");
+    }
+
+    if (str_in("vcf", format_list)>=0) {
+        vcf_f = openordie(string_format("%s.vcf.tmp", prefix).c_str(), "w");
+    }
+    if (str_in("eav", format_list)>=0) {
+        eav_f = openordie(string_format("%s.eav.tmp", prefix).c_str(), "w");
+    }
+
+    if (str_in("cse", format_list)>=0) {
+        cse_f = openordie(string_format("%s.cse.tmp", prefix).c_str(), "w");
+        // targted only output
+        if (annot && ! pcr_annot) 
+            tgt_cse_f = openordie(string_format("%s.tgt.cse.tmp", prefix).c_str(), "w");
+    }
+}
+
+void locus_headers(bool annot) {
+    if (eav_f) {
+        fprintf(eav_f,"chr\tpos\tref\tdepth\tnum_states\ttop_consensus\ttop_freq\tvar_base\tvar_depth\tvar_qual\tvar_strands\tforward_strands\treverse_strands\t%cval\tdiversity\tagreement\t%s\n", (total_locii>1?'e':'p'), (annot&&!pcr_annot) ? "in_target\t" : pcr_annot ? "regions\t" : "");
+    }
+    if (vcf_f) {
+        // print VCF header
+        fprintf(vcf_f, "%s\n", "##fileformat=VCFv4.1");
+    }
+    if (cse_f) {
+        fprintf(cse_f, "Chr\tPos\tRef\tA\tC\tG\tT\ta\tc\tg\tt\tAq\tCq\tGq\tTq\taq\tcq\tgq\ttq\tRefAllele\tAd\tCd\tGd\tTd\tAg\tCg\tGg\tTg%s\n", pcr_annot ? "\tRegions" : "");
+    }
+}
+
+// close a caller's outputs, and move them into place
+void close_locus_out(FILE **out, const char *prefix) {
+    static const char *ext[N_LOCUS_OUT] = {"var", "tgt.var", "eav", "vcf", "cse", "tgt.cse", "noise"};
+    int i;
+    for (i=0;i<OUT_NOISE;++i) {
+        if (!out[i]) 
+            continue;
+        fclose(out[i]);
+        rename_tmp(string_format("%s.%s.tmp", prefix, ext[i]));
+    }
+}
+
 void rename_tmp(std::string f) {
     std::string notmp = f;
     size_t pos = notmp.find(".tmp");
@@ -818,27 +1266,725 @@ double qnorm(double q) {
      return x;
 }
 
-double pnorm(double x)
-{
-    // constants
-    double a1 =  0.254829592;
-    double a2 = -0.284496736;
-    double a3 =  1.421413741;
-    double a4 = -1.453152027;
-    double a5 =  1.061405429;
-    double p  =  0.3275911;
-
-    // Save the sign of x
-    int sign = 1;
-    if (x < 0)
-        sign = -1;
-    x = fabs(x)/sqrt(2.0);
+double pnorm(double x)
+{
+    // constants
+    double a1 =  0.254829592;
+    double a2 = -0.284496736;
+    double a3 =  1.421413741;
+    double a4 = -1.453152027;
+    double a5 =  1.061405429;
+    double p  =  0.3275911;
+
+    // Save the sign of x
+    int sign = 1;
+    if (x < 0)
+        sign = -1;
+    x = fabs(x)/sqrt(2.0);
+
+    // A&S formula 7.1.26
+    double t = 1.0/(1.0 + p*x);
+    double y = 1.0 - (((((a5*t + a4)*t) + a3)*t + a2)*t + a1)*t*exp(-x*x);
+
+    return 0.5*(1.0 + sign*y);
+}
+
+// reference sequence, one chromosome at a time
+class RefCache {
+public:
+    faidx_t *fai;
+    int tid;
+    char *seq;
+    int len;
+
+    RefCache(faidx_t *f) {fai=f; tid=-1; seq=NULL; len=0;}
+    ~RefCache() {if (seq) free(seq);}
+
+    const char *Get(const bam_header_t *h, int t) {
+        if (t != tid) {
+            if (seq) free(seq);
+            seq = faidx_fetch_seq(fai, h->target_name[t], 0, 0x7fffffff, &len);
+            if (!seq) len=0;
+            tid = t;
+        }
+        return seq;
+    }
+};
+
+class BamInput {
+public:
+    bamFile fp;
+    bam_header_t *h;
+    bam_index_t *idx;
+    bam_iter_t iter;        // only one chromosome, if set
+    RefCache *ref;
+};
+
+// same reads "samtools mpileup" would use
+static int pileup_read(void *data, bam1_t *b) {
+    BamInput *in = (BamInput *) data;
+    int ret;
+    for (;;) {
+        ret = in->iter ? bam_iter_read(in->fp, in->iter, b) : bam_read1(in->fp, b);
+        if (ret < 0)
+            break;
+        if (b->core.tid < 0 || (b->core.flag & BAM_FUNMAP))
+            continue;
+        // orphans: paired, but not properly
+        if ((b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FPROPER_PAIR))
+            continue;
+        if (!no_baq) {
+            const char *seq = in->ref->Get(in->h, b->core.tid);
+            if (seq)
+                bam_prob_realn_core(b, seq, 1);
+        }
+        break;
+    }
+    return ret;
+}
+
+// mpileup-style entry for one read in a column
+static inline void pileup_ent(PileupEnt &e, const bam_pileup1_t *p, const char *rs, int rlen, char rb, int pos, char *&idl_p) {
+    const bam1_t *b = p->b;
+    bool rev = bam1_strand(b);
+
+    e.is_start = p->is_head;
+    e.is_end = p->is_tail;
+    e.m = min((int) b->core.qual, 93);
+    e.q = min((int) bam1_qual(b)[p->qpos], 93);
+    if (!p->is_del) {
+        int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(b), p->qpos)];
+        if (rs && (c == '=' || bam_nt16_table[c] == bam_nt16_table[(int)rb]))
+            c = rev ? ',' : '.';
+        else
+            c = rev ? tolower(c) : toupper(c);
+        e.c = c;
+    } else {
+        e.c = p->is_refskip ? (rev ? '<' : '>') : '*';
+    }
+
+    e.idl = '\0';
+    if (p->indel) {
+        e.idl = p->indel > 0 ? '+' : '-';
+        e.idl_len = abs(p->indel);
+        e.idl_seq = idl_p;
+        int k;
+        for (k=1;k<=e.idl_len;++k) {
+            int c;
+            if (p->indel > 0)
+                c = bam_nt16_rev_table[bam1_seqi(bam1_seq(b), p->qpos + k)];
+            else
+                c = (rs && pos+k < rlen) ? rs[pos+k] : 'N';
+            *idl_p++ = rev ? tolower(c) : toupper(c);
+        }
+    }
+}
+
+// a stretch of the bams to pileup, 0-based, end exclusive.  tid -1 is the whole file
+class BamSpan {
+public:
+    int tid, beg, end;
+    BamSpan(int t, int b, int e) {tid=t; beg=b; end=e;}
+};
+
+bool bam_indexed(const char *path) {
+    string bai = string(path) + ".bai";
+    string bai2 = string(path, strlen(path)-4) + ".bai";
+    return hasdata(bai) || hasdata(bai2);
+}
+
+// build pileup columns from the bams directly, same as "samtools mpileup -Q 0 -d 100000 -f ref"
+// multiple bams are pooled into one column, merged by read start, so reads stay in order of arrival
+// unless the manager is joint, then each bam is a sample, and every column has all of them
+// if tid is set, only that chromosome is read, using the index
+// if the manager is regional, only the annotated regions are, jumping between them
+// returns the number of columns
+int pileup_bams(PileupManager &v, int in_n, char **in, const char *ref, int tid) {
+    faidx_t *fai = fai_load(ref);
+    if (!fai) 
+        die("Can't load reference %s\n", ref);
+
+    RefCache readref(fai), colref(fai);
+    vector<BamInput> bams(in_n);
+    vector<void *> data(in_n);
+    int i, j;
+
+    // only the targets are called, so with an index, only they (and their flanks) are read
+    bool regional = v.Regional;
+    for (i=0;i<in_n && regional;++i) {
+        if (!bam_indexed(in[i])) {
+            warn("warning\t%s has no index, reading all of it\n", in[i]);
+            regional = false;
+        }
+    }
+    for (i=0;i<in_n;++i) {
+        bams[i].fp = bam_open(in[i], "r");
+        if (!bams[i].fp)
+            die("Can't open %s: %s\n", in[i], strerror(errno));
+        bams[i].h = bam_header_read(bams[i].fp);
+        if (!bams[i].h)
+            die("Can't read header from %s\n", in[i]);
+        bams[i].idx = NULL;
+        bams[i].iter = NULL;
+        if (tid >= 0 || regional) {
+            if (!(bams[i].idx = bam_index_load(in[i])))
+                die("Can't load index for %s\n", in[i]);
+        }
+        bams[i].ref = &readref;
+        data[i] = &bams[i];
+    }
+    const bam_header_t *h = bams[0].h;
+
+    // what to read: the whole file, one chromosome, or the annotated regions of either
+    vector<BamSpan> spans;
+    if (regional) {
+        vector<ChrRange> regs;
+        int t;
+        for (t = tid >= 0 ? tid : 0; t < (tid >= 0 ? tid+1 : h->n_targets); ++t) {
+            v.TargetRegions(h->target_name[t], regs);
+            for (i=0;i<regs.size();++i) 
+                spans.push_back(BamSpan(t, regs[i].Beg-1, regs[i].End));
+        }
+        if (tid < 0)
+            warn("input\t%d regions\n", (int) spans.size());
+    } else {
+        spans.push_back(BamSpan(tid, 0, 1<<29));
+    }
+
+    vector<int> n_plp(in_n), cur(in_n);
+    vector<const bam_pileup1_t *> plp(in_n);
+    vector<PileupEnt> ents;
+    vector<vector<PileupEnt> > sents(v.Samples > 1 ? in_n : 0);
+    string idl;
+    int pos, ctid, cols=0, k;
+    for (k=0;k<spans.size();++k) {
+        const BamSpan &sp = spans[k];
+        if (sp.tid >= 0) {
+            for (i=0;i<in_n;++i) 
+                bams[i].iter = bam_iter_query(bams[i].idx, sp.tid, sp.beg, sp.end);
+        }
+        if (regional) 
+            v.Jump();
+
+        bam_mplp_t mplp = bam_mplp_init(in_n, pileup_read, data.data());
+        bam_mplp_set_maxcnt(mplp, 100000);
+
+        while (bam_mplp_auto(mplp, &ctid, &pos, n_plp.data(), plp.data()) > 0) {
+            // reads overlapping a region reach outside it, those columns are another region's, or no one's
+            // (past the end they're let run out, the pileup can't be dropped while it holds reads)
+            if (pos < sp.beg || pos >= sp.end) 
+                continue;
+
+            const char *rs = colref.Get(h, ctid);
+            int rlen = colref.len;
+            char rb = (rs && pos < rlen) ? rs[pos] : 'N';
+
+            // indel sequences all go in one buffer, so entries can point into it
+            int n=0, idl_n=0;
+            for (i=0;i<in_n;++i) {
+                for (j=0;j<n_plp[i];++j) {
+                    idl_n += abs(plp[i][j].indel);
+                }
+                n += n_plp[i];
+            }
+            idl.resize(idl_n);
+            char *idl_p = (char *) idl.data();
+
+            if (v.Samples > 1) {
+                // joint: a list of reads per bam
+                for (i=0;i<in_n;++i) {
+                    sents[i].resize(n_plp[i]);
+                    for (j=0;j<n_plp[i];++j)
+                        pileup_ent(sents[i][j], plp[i]+j, rs, rlen, rb, pos, idl_p);
+                }
+                ++cols;
+                v.Parse(h->target_name[ctid], pos+1, rb, sents);
+                continue;
+            }
+
+            ents.resize(n);
+            if (in_n == 1) {
+                for (j=0;j<n;++j)
+                    pileup_ent(ents[j], plp[0]+j, rs, rlen, rb, pos, idl_p);
+            } else {
+                for (i=0;i<in_n;++i)
+                    cur[i]=0;
+                for (j=0;j<n;++j) {
+                    int m=-1;
+                    for (i=0;i<in_n;++i) {
+                        if (cur[i] < n_plp[i] && (m < 0 || plp[i][cur[i]].b->core.pos < plp[m][cur[m]].b->core.pos))
+                            m=i;
+                    }
+                    pileup_ent(ents[j], plp[m]+cur[m]++, rs, rlen, rb, pos, idl_p);
+                }
+            }
+
+            ++cols;
+            v.Parse(h->target_name[ctid], pos+1, rb, ents);
+        }
+
+        bam_mplp_destroy(mplp);
+        for (i=0;i<in_n;++i) {
+            if (bams[i].iter) bam_iter_destroy(bams[i].iter);
+            bams[i].iter = NULL;
+        }
+    }
+    v.Finish();
+
+    for (i=0;i<in_n;++i) {
+        if (bams[i].idx) bam_index_destroy(bams[i].idx);
+        bam_header_destroy(bams[i].h);
+        bam_close(bams[i].fp);
+    }
+    fai_destroy(fai);
+    return cols;
+}
+
+// unlinked temp file, in TMPDIR
+int tmp_fd() {
+    const char *tmpdir = getenv("TMPDIR");
+    string tmp = string_format("%s/varcall.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    int fd = mkstemp((char *) tmp.data());
+    if (fd < 0) 
+        die("Can't create temp file %s: %s\n", tmp.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+    return fd;
+}
+
+void spill_close(PileupManager &pman) {
+    if (gzclose(pman.Spill) != Z_OK) 
+        die("Can't write spill file: %s\n", strerror(errno));
+    pman.Spill = NULL;
+}
+
+// annotation and window size for calling
+void setup_caller(PileupManager &pman, const char *target_annot) {
+    if (target_annot) {
+        pman.LoadAnnot(target_annot);
+        // nothing outside the targets is called, so indexed input is only read there
+        pman.Regional = pcr_annot || target_only;
+    }
+
+    if (cse_f) {
+        pman.WinMax=21;
+    } else if (repeat_filter > 0) {
+        pman.WinMax=repeat_filter+repeat_filter+3;
+    } else {
+        pman.WinMax=5;
+    }
+}
+
+#define OUT_FLUSH 0x40000           // bytes of rows held for each per-locus output
+
+void out_flush(string &buf, FILE *f) {
+    if (fwrite(buf.data(), 1, buf.size(), f) != buf.size())
+        die("Can't write output: %s\n", strerror(errno));
+    buf.clear();
+}
+
+// per-locus outputs, which shards write to temp files
+FILE **locus_out(int i) {
+    switch (i) {
+        case OUT_VAR: return &var_f;
+        case OUT_TGT_VAR: return &tgt_var_f;
+        case OUT_EAV: return &eav_f;
+        case OUT_VCF: return &vcf_f;
+        case OUT_CSE: return &cse_f;
+        case OUT_TGT_CSE: return &tgt_cse_f;
+        default: return &noise_f;
+    }
+}
+
+// one pileup per chromosome, in reference order
+// (a serial run starts each chromosome with no read lengths too, so the output is the same)
+void plan_shards(vector<VarShard> &shards, int in_n, char **in, const char *ref) {
+    int i;
+    for (i=0;i<in_n;++i) {
+        if (strcmp(fext(in[i]), ".bam")) 
+            return;
+        if (!bam_indexed(in[i])) {
+            warn("warning\t%s has no index, not splitting by chromosome\n", in[i]);
+            return;
+        }
+    }
+
+    bamFile fp = bam_open(in[0], "r");
+    if (!fp)
+        die("Can't open %s: %s\n", in[0], strerror(errno));
+    bam_header_t *h = bam_header_read(fp);
+    if (!h)
+        die("Can't read header from %s\n", in[0]);
+    for (i=0;i<h->n_targets;++i) 
+        shards.push_back(VarShard(i));
+    bam_header_destroy(h);
+    bam_close(fp);
+
+    warn("input\t%d bam\n", in_n);
+    check_ref_fai(ref);
+}
+
+static void *shard_worker(void *arg) {
+    VarShardPool *sp = (VarShardPool *) arg;
+    int i;
+    for (;;) {
+        pthread_mutex_lock(&sp->lock);
+        int n = sp->next++;
+        pthread_mutex_unlock(&sp->lock);
+        if (n >= (int) sp->shards->size())
+            break;
+
+        VarShard &sh = (*sp->shards)[n];
+        for (i=0;i<N_LOCUS_OUT;++i) {
+            sh.out[i] = sp->out[i] ? fdopen(tmp_fd(), "w+") : NULL;
+            *locus_out(i) = sh.out[i];
+        }
+
+        PileupManager pman;
+        if (sp->calling) {
+            VarCallVisitor vcall(pman);
+            if (sp->vstats) 
+                sh.vstat = new VarStatVisitor(pman);
+            setup_caller(pman, NULL);
+            if (sp->annot) 
+                pman.ShareAnnot(*sp->annot);
+            if (sh.spill_fd >= 0) {
+                lseek(sh.spill_fd, 0, SEEK_SET);
+                gzFile spill = gzdopen(sh.spill_fd, "rb");
+                pman.Replay(spill);
+                gzclose(spill);
+                sh.spill_fd = -1;
+            } else {
+                sh.cols = pileup_bams(pman, sp->in_n, sp->in, sp->ref, sh.tid);
+            }
+            sh.Locii = vcall.Locii;
+            sh.Hets = vcall.Hets;
+            sh.Homs = vcall.Homs;
+            sh.SkippedDepth = vcall.SkippedDepth;
+            sh.SkippedAnnot = vcall.SkippedAnnot;
+        } else {
+            sh.vstat = new VarStatVisitor(pman);
+            if (sp->spill) {
+                sh.spill_fd = tmp_fd();
+                pman.Spill = gzdopen(dup(sh.spill_fd), "wb1");
+            }
+            sh.cols = pileup_bams(pman, sp->in_n, sp->in, sp->ref, sh.tid);
+            if (pman.Spill) 
+                spill_close(pman);
+        }
+        if (sh.vstat) 
+            sh.vstat->Manager = NULL;
+    }
+    return NULL;
+}
+
+void run_shards(VarShardPool &sp) {
+    int i;
+    for (i=0;i<N_LOCUS_OUT;++i) 
+        sp.out[i] = *locus_out(i);
+
+    int nt = min(nthreads, (int) sp.shards->size());
+    vector<pthread_t> tids(nt);
+    for (i=0;i<nt;++i)
+        pthread_create(&tids[i], NULL, shard_worker, &sp);
+    for (i=0;i<nt;++i)
+        pthread_join(tids[i], NULL);
+
+    if (!sp.calling) {
+        int cols=0;
+        for (i=0;i<sp.shards->size();++i) 
+            cols += (*sp.shards)[i].cols;
+        if (cols == 0) {
+            warn("No data in pileup, quitting\n");
+            exit(1);
+        }
+    }
+}
+
+// append shard outputs and counts, in reference order
+void merge_shards(vector<VarShard> &shards, VarStatVisitor *vstat, VarCallVisitor *vcall) {
+    char buf[65536];
+    int i, j;
+    for (i=0;i<shards.size();++i) {
+        VarShard &sh = shards[i];
+        for (j=0;j<N_LOCUS_OUT;++j) {
+            if (!sh.out[j]) 
+                continue;
+            rewind(sh.out[j]);
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), sh.out[j])) > 0) {
+                if (fwrite(buf, 1, n, *locus_out(j)) != n)
+                    die("Can't write output: %s\n", strerror(errno));
+            }
+            fclose(sh.out[j]);
+            sh.out[j] = NULL;
+        }
+        if (sh.vstat) {
+            if (vstat)
+                vstat->Merge(*sh.vstat);
+            delete sh.vstat;
+            sh.vstat = NULL;
+        }
+        if (vcall) {
+            vcall->Locii += sh.Locii;
+            vcall->Hets += sh.Hets;
+            vcall->Homs += sh.Homs;
+            vcall->SkippedDepth += sh.SkippedDepth;
+            vcall->SkippedAnnot += sh.SkippedAnnot;
+        }
+    }
+}
+
+#define GZ_BLOCK 0x100000             // text input is inflated (or just read) this much at a time
+
+// lines of a text file, gzipped or not, inflated in-process and split in large blocks
+class GzLines {
+    gzFile gz;
+    vector<char> buf;
+    size_t beg, end;
+    bool eof;
+public:
+    GzLines(gzFile f) : gz(f), buf(GZ_BLOCK+1), beg(0), end(0), eof(false) {}
+    char *Next();
+};
+
+// the next line, chomped and nul terminated, good until the next call.  NULL at the end
+char *GzLines::Next() {
+    for (;;) {
+        char *b = buf.data()+beg;
+        char *nl = (char *) memchr(b, '\n', end-beg);
+        if (nl || (eof && end > beg)) {
+            if (!nl) nl = buf.data()+end;
+            beg = nl-buf.data()+1;
+            if (nl > b && nl[-1] == '\r') --nl;
+            *nl = '\0';
+            return b;
+        }
+        if (eof) 
+            return NULL;
+        // keep the partial line, and make room for more
+        memmove(buf.data(), b, end-beg);
+        end-=beg;
+        beg=0;
+        if (buf.size()-1-end < GZ_BLOCK/2) 
+            buf.resize(buf.size()*2);
+        int n = gzread(gz, buf.data()+end, buf.size()-1-end);
+        if (n < 0) {
+            int err;
+            die("Can't read pileup: %s\n", gzerror(gz, &err));
+        }
+        if (n == 0) 
+            eof=true;
+        end+=n;
+    }
+}
+
+// tabix index of a bgzipped file.  the bins are the same as a bam index's
+class TbiIndex {
+    typedef pair<uint64_t,uint64_t> Chunk;      // virtual offsets, begin and end
+    struct Ref {
+        map<unsigned, vector<Chunk> > Bins;
+        vector<uint64_t> LinOff;                 // first offset of each 16kb window
+    };
+    vector<Ref> Refs;
+public:
+    vector<string> Names;
+    bool Load(const char *path);
+    void Chunks(int tid, int beg, int end, vector<Chunk> &r);
+};
+
+static bool bgzf_read_all(BGZF *fp, void *p, int n) {
+    return bgzf_read(fp, p, n) == n;
+}
+
+// false if there's no index, or it isn't one for a position sorted file with chr and pos in the first 2 columns
+bool TbiIndex::Load(const char *path) {
+    BGZF *fp = bgzf_open(path, "r");
+    if (!fp) 
+        return false;
+
+    char magic[4];
+    int32_t hd[8];
+    if (!bgzf_read_all(fp, magic, 4) || memcmp(magic, "TBI\1", 4) || !bgzf_read_all(fp, hd, sizeof(hd))) {
+        warn("warning\t%s isn't a tabix index, reading the whole file\n", path);
+        bgzf_close(fp);
+        return false;
+    }
+    // n_ref, format, col_seq, col_beg, col_end, meta, skip, l_nm
+    if ((hd[1] & 0x10000) || hd[2] != 1 || hd[3] != 2) {
+        warn("warning\t%s isn't indexed by chr and pos (tabix -s 1 -b 2 -e 2), reading the whole file\n", path);
+        bgzf_close(fp);
+        return false;
+    }
+
+    vector<char> nm(hd[7]);
+    if (!bgzf_read_all(fp, nm.data(), hd[7]))
+        die("Can't read %s, truncated\n", path);
+    const char *p;
+    for (p=nm.data();p<nm.data()+nm.size();p+=strlen(p)+1) 
+        Names.push_back(p);
+
+    Refs.resize(hd[0]);
+    int i, j, k;
+    for (i=0;i<hd[0];++i) {
+        int32_t n_bin, n_chunk, n_intv;
+        uint32_t bin;
+        if (!bgzf_read_all(fp, &n_bin, 4))
+            die("Can't read %s, truncated\n", path);
+        for (j=0;j<n_bin;++j) {
+            if (!bgzf_read_all(fp, &bin, 4) || !bgzf_read_all(fp, &n_chunk, 4))
+                die("Can't read %s, truncated\n", path);
+            vector<Chunk> &c = Refs[i].Bins[bin];
+            c.resize(n_chunk);
+            for (k=0;k<n_chunk;++k) {
+                if (!bgzf_read_all(fp, &c[k].first, 8) || !bgzf_read_all(fp, &c[k].second, 8))
+                    die("Can't read %s, truncated\n", path);
+            }
+        }
+        if (!bgzf_read_all(fp, &n_intv, 4))
+            die("Can't read %s, truncated\n", path);
+        Refs[i].LinOff.resize(n_intv);
+        if (n_intv && !bgzf_read_all(fp, Refs[i].LinOff.data(), 8*n_intv))
+            die("Can't read %s, truncated\n", path);
+    }
+    bgzf_close(fp);
+    return true;
+}
+
+// the chunks that may hold lines in [beg, end) (0-based), sorted and merged
+void TbiIndex::Chunks(int tid, int beg, int end, vector<Chunk> &r) {
+    r.clear();
+    if (tid < 0 || tid >= Refs.size() || beg >= end) 
+        return;
+    const Ref &ref = Refs[tid];
+
+    uint64_t min_off = 0;
+    if (ref.LinOff.size())
+        min_off = ref.LinOff[min((size_t)(beg>>14), ref.LinOff.size()-1)];
+
+    // bins overlapping the region, as reg2bins in bam_index.c
+    if (end > 1<<29) end = 1<<29;
+    --end;
+    vector<unsigned> bins;
+    bins.push_back(0);
+    static const int first[] = {1, 9, 73, 585, 4681};
+    static const int shift[] = {26, 23, 20, 17, 14};
+    int i, k;
+    for (i=0;i<5;++i) {
+        for (k = first[i] + (beg>>shift[i]); k <= first[i] + (end>>shift[i]); ++k) 
+            bins.push_back(k);
+    }
+
+    for (i=0;i<bins.size();++i) {
+        map<unsigned, vector<Chunk> >::const_iterator it = ref.Bins.find(bins[i]);
+        if (it == ref.Bins.end()) 
+            continue;
+        for (k=0;k<it->second.size();++k) {
+            if (it->second[k].second > min_off) 
+                r.push_back(it->second[k]);
+        }
+    }
+    sort(r.begin(), r.end());
+
+    int n=0;
+    for (i=0;i<r.size();++i) {
+        if (n && r[i].first <= r[n-1].second) 
+            r[n-1].second = max(r[n-1].second, r[i].second);
+        else
+            r[n++] = r[i];
+    }
+    r.resize(n);
+}
+
+#define TARGET_FLANK 1000       // read around each target, so reads covering it start inside, and its neighbors are known
+
+// the annotated regions of chr, flanked, merged where they touch.  1-based and inclusive
+void PileupManager::TargetRegions(const char *chr, vector<ChrRange> &r) {
+    r.clear();
+    const tidx_chr *c = Annot->find_chr(chr);
+    if (!c) 
+        return;
+
+    // bed fragments are looked up at pos-1
+    int off = AnnotType == 'b' ? 1 : 0;
+    int flank = TARGET_FLANK + WinMax;
+    long i;
+    for (i=0;i<c->n;++i) {
+        int beg = max(1, c->beg[i]+off-flank);
+        int end = c->end[i]+off+flank;
+        if (r.size() && beg <= r.back().End+1) {
+            r.back().End = max(r.back().End, end);
+        } else {
+            ChrRange x;
+            x.Chr = chr;
+            x.Beg = beg;
+            x.End = end;
+            r.push_back(x);
+        }
+    }
+}
+
+// the next column parsed doesn't follow the last one: reads in progress are dropped, 
+// and the ones already under way there aren't warned about
+void PileupManager::Jump() {
+    int s;
+    for (s=0;s<Samples;++s) {
+        Reads[s].Active.clear();
+        Reads[s].Resume=true;
+    }
+}
 
-    // A&S formula 7.1.26
-    double t = 1.0/(1.0 + p*x);
-    double y = 1.0 - (((((a5*t + a4)*t) + a3)*t + a2)*t + a1)*t*exp(-x*x);
+// just the annotated regions of a bgzipped pileup, using its tabix index
+// returns the number of lines, or -1 if there's no index, and the file has to be read whole
+int pileup_regions(PileupManager &v, const char *path) {
+    TbiIndex tbi;
+    if (!tbi.Load(string_format("%s.tbi", path).c_str())) 
+        return -1;
+
+    BGZF *fp = bgzf_open(path, "r");
+    if (!fp) 
+        die("Can't open %s: %s\n", path, strerror(errno));
+
+    kstring_t ks;
+    meminit(ks);
+    vector<ChrRange> regs;
+    vector<pair<uint64_t,uint64_t> > chunks;
+    int tid, i, j, lines=0, nregs=0;
+    for (tid=0;tid<tbi.Names.size();++tid) {
+        const char *chr = tbi.Names[tid].c_str();
+        int chr_n = tbi.Names[tid].size();
+        v.TargetRegions(chr, regs);
+        nregs+=regs.size();
+        for (i=0;i<regs.size();++i) {
+            v.Jump();
+            tbi.Chunks(tid, regs[i].Beg-1, regs[i].End, chunks);
+            bool done=false;
+            for (j=0;j<chunks.size() && !done;++j) {
+                if (bgzf_seek(fp, chunks[j].first, SEEK_SET) < 0)
+                    die("Can't seek in %s\n", path);
+                while (bgzf_tell(fp) < chunks[j].second && bgzf_getline(fp, '\n', &ks) >= 0) {
+                    // chunks can hold lines from other chromosomes, and either side of the region
+                    if (strncmp(ks.s, chr, chr_n) || ks.s[chr_n] != '\t') 
+                        continue;
+                    int pos = atoi(ks.s+chr_n+1);
+                    if (pos < regs[i].Beg) 
+                        continue;
+                    if (pos > regs[i].End) {
+                        done=true;
+                        break;
+                    }
+                    ++lines;
+                    ++g_lineno;
+                    v.Parse(ks.s);
+                }
+            }
+        }
+    }
+    v.Finish();
 
-    return 0.5*(1.0 + sign*y);
+    warn("input\t%d regions\n", nregs);
+    free(ks.s);
+    bgzf_close(fp);
+    return lines;
 }
 
 void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
@@ -859,7 +2005,7 @@ void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 			die("Can't mix bams and other input files\n");
 		} else {
 			if (in_n > 1) {
-				die("Can't handle multiple pileups... TODO\n");
+				die("Can't handle multiple pileups, use one multi-sample pileup with --samples\n");
 			} else {
 				warn("input\t%d pileup\n", in_n);
                 v.InputType='P';
@@ -868,62 +2014,37 @@ void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 	} else {
 		warn("input\t%d bam\n", bam_n);
         v.InputType='B';
+        if (v.Samples > 1 && bam_n != v.Samples) 
+            die("%d samples named, but there are %d bams\n", v.Samples, bam_n);
 	}
 
-	int is_popen = 0;
-	FILE *fin;
-
+	g_lineno=0;
 	if (bam_n) {
         check_ref_fai(ref);
-
-		const char *nobaq = no_baq ? "-B" : "";
-
-		string mpil_cmd = string_format("samtools mpileup -Q 0 -d 100000 %s -f '%s'", nobaq, ref);
-
-		int i;
-		for (i=0;i<in_n;++i) {
-			mpil_cmd += " '";
-			mpil_cmd += in[i];
-			mpil_cmd += "' ";
-		}
-
-		warn("command\t%s\n", mpil_cmd.c_str());
-
-		fin = popen(mpil_cmd.c_str(), "r");
-		if (!fin) 
-			exit(1);
-
-		is_popen = 1;
-	} else {
-        if (!strcmp(in[0], "-")) {
-            fin=stdin;
-        } else {
-            if (!strcmp(fext(in[0]), ".gz")) {
-                string gunz = string_format("gunzip -c '%s'", in[0]);
-                fin = popen(gunz.c_str(), "r");
-                is_popen = 1;
-            } else {
-                fin = fopen(in[0], "r");
-            }
-            if (!fin) {
-                warn("%s: %s", in[0], strerror(errno));
-                exit(1);
-            }
+        g_lineno = pileup_bams(v, in_n, in, ref);
+	} else if (v.Regional && strcmp(in[0], "-") && !strcmp(fext(in[0]), ".gz") && pileup_regions(v, in[0]) >= 0) {
+        // nothing in the targets is fine, there's just nothing to call
+        return;
+    } else {
+        // gzipped or not, inflated here.  bgzf is just gzip in blocks
+        gzFile gz = !strcmp(in[0], "-") ? gzdopen(dup(0), "rb") : gzopen(in[0], "rb");
+        if (!gz) {
+            warn("%s: %s", in[0], strerror(errno));
+            exit(1);
         }
-	}
+        gzbuffer(gz, GZ_BLOCK);
 
-    line l; meminit(l);
-    g_lineno=0;
-    if (fin) {
-        while(read_line(fin, l)>0) {
+        GzLines lines(gz);
+        char *l;
+        while((l=lines.Next())) {
             ++g_lineno;
         //	chr      2       G       6       ^9,^+.^*,^2,^&.^&,      &.'&*-  9+*2&&  166,552,643,201,299,321
-            v.Parse(l.s);
+            v.Parse(l);
         }
         v.Finish();
 
-        if (is_popen) pclose(fin); else fclose(fin);
-    }
+        gzclose(gz);
+	}
 
 	if (g_lineno == 0) {
 		warn("No data in pileup, quitting\n");
@@ -934,32 +2055,88 @@ void parse_bams(PileupManager &v, int in_n, char **in, const char *ref) {
 
 bool hitoloint (int i,int j) { return (i>j);}
 
-class q_calls {public: q_calls() {meminit(call);} int call[8];};
-vector<int> depthbypos;
-vector<q_calls> depthbyposbycall;
-typedef struct  {
-    string Chr;
-    int Beg;
-    int End;
-} ChrRange;
 
+// decode one sample's depth, reads and quals columns into entries, so text and bam input share the rest
+static void parse_reads(char **dat, vector<PileupEnt> &ents) {
+	const char * p_qual=dat[2];
+	int Depth = atoi(dat[0]);
+
+	ents.resize(Depth);
 
-char *_dat[256];
-inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char atype) {
+	// samples with no reads have '*' for reads and quals
+	const char *cur_p = Depth ? dat[1] : "";
+	int i;
+	for (i=0;i<Depth;++i) {
+		PileupEnt &e = ents[i];
+		e.is_start = 0;
+		if (*cur_p == '^') {
+			e.is_start = 1;
+			e.m = cur_p[1]-phred;
+			cur_p += 2;
+		}
+		e.q = p_qual[i]-phred;
+		e.c = *cur_p;
+		if (e.c == '-' || e.c == '+') {
+            warn("invalid pileup, at '%s', indel not attached to read?\n", cur_p);
+		} else if (*cur_p) {
+			++cur_p;
+		}
+		e.idl = '\0';
+        if (*cur_p == '+' || *cur_p == '-') {
+            e.idl = *cur_p;
+            char *end_p;
+            e.idl_len = strtol(++cur_p, &end_p, 10);
+            e.idl_seq = end_p;
+            cur_p=end_p+e.idl_len;
+        }
+		e.is_end = (*cur_p == '$');
+		if (e.is_end)
+			++cur_p;
+	}
 
-	int dsize=split(_dat, line, '\t');
+	if (*cur_p == '-' || *cur_p == '+') {
+		char *end_p;
+		int len = strtol(++cur_p, &end_p, 10);
+		cur_p=end_p+len;
+	}
 
-	if (dsize < 6) {
-		warn("Can't read pileup : %d fields, need 6 columns, line %d\n", (int) dsize, g_lineno);
+	if (*cur_p) {
+		warn("Failed to parse pileup %s\n", dat[1]);
 		exit(1);
 	}
+}
 
-	const char * p_qual=_dat[5];
+void AmpList::Lookup(tidx::cursor *adex, const char *chr, int pos, char atype) {
+    // lines come from the cursor's cache, overlapping loci share them
+    const vector<tidx_line> &lv = adex->lookup_v(chr, pos + (atype=='b' ? -1 : 0));
+    Regions=lv.size();
+    Amps.clear();
+    int i;
+    for(i=0;i<lv.size();++i) {
+        // chr, beg, end ... the rest is ignored
+        const char *f1=strchr(lv[i].s, '\t');
+        const char *f2=f1 ? strchr(f1+1, '\t') : NULL;
+        // create new range object
+        if (f2 && f2[1]) {
+            ChrRange amp;
+            amp.Chr.assign(lv[i].s, f1-lv[i].s);
+            amp.Beg=atoi(f1+1);
+            amp.End=atoi(f2+1);
+            if (atype=='b') {
+                ++amp.Beg;
+            } 
+            if ((amp.End < amp.Beg) || !amp.Beg) {
+                die("Annotation file must be in bed or gtf format, or at least a 1-based inclusive set of ranges\n"); 
+            }
+//            warn("AMP: %s:%d-%d\n",amp.Chr.data(),amp.Beg,amp.End);
+            Amps.push_back(amp);
+        }
+    }
+}
 
-	Chr=_dat[0];
-	Pos=atoi(_dat[1]);
-	Base=*(_dat[2]);
-	Depth = atoi(_dat[3]);
+// Chr, Pos, Base and Depth are set, ents has Depth entries
+// amps: the pcr filter's amplicons, if it's on
+void PileupSummary::Parse(const vector<PileupEnt> &ents, PileupReads &rds, const AmpList *amps) {
 	SkipDupReads = 0;
 	SkipN = 0;
 	SkipAmp = 0;
@@ -973,47 +2150,26 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 
 	int i;
 
-	const char *cur_p = _dat[4];
-
-    list<Read>::iterator read_i = rds.ReadList.begin();
+    // active reads are copied forward into Next as the column is walked, so
+    // starts and ends are appends and skips rather than list inserts/erases
+    vector<Read> &active = rds.Active;
+    vector<Read> &next = rds.Next;
+    int ra=0;                           // next unvisited read in active
+    Read *read_i;
+    next.clear();
+    vector<int> &depthbypos = rds.DepthByPos;
+    vector<q_calls> &depthbyposbycall = rds.DepthByPosByCall;
     
     memset(depthbypos.data(),0,depthbypos.size()*sizeof(depthbypos[0]));
     memset(depthbyposbycall.data(),0,depthbyposbycall.size()*sizeof(depthbyposbycall[0]));
 
     int eor=0;
 
-    // list of amplicon range objects
-    vector<ChrRange> amps;
-
-    if (pcr_annot && adex) {
-        string s = adex->lookup(Chr.data(), Pos + (atype=='b' ? -1 : 0), "^");
-        if (s.length()) {
-            vector<char *> a=split((char *)s.data(), '^');
-            Regions=a.size()-1;
-            // skip leading entry...
-            for(i=1;i<a.size();++i) {
-                vector<char *> f=split(a[i], '\t');
-                // create new range object
-                if (f.size() >= 3) {
-                    ChrRange amp;
-                    amp.Chr=f[0];
-                    amp.Beg=atoi(f[1]);
-                    amp.End=atoi(f[2]);
-                    if (atype=='b') {
-                        ++amp.Beg;
-                    } 
-                    if ((amp.End < amp.Beg) || !amp.Beg) {
-                        die("Annotation file must be in bed or gtf format, or at least a 1-based inclusive set of ranges\n"); 
-                    }
-//                    warn("AMP: %s:%d-%d\n",amp.Chr.data(),amp.Beg,amp.End);
-                    amps.push_back(amp);
-                }
-            }
-        }
-    }
+    if (amps)
+        Regions=amps->Regions;
 
     if (debug_xpos) {
-        if (Pos == debug_xpos && !strcmp(debug_xchr,Chr.data())) {
+        if (Pos == debug_xpos && !strcmp(debug_xchr,Chr)) {
             fprintf(stderr,"depth: %d, meanreadlen: %f\n", Depth, rds.MeanReadLen());
         }
     }
@@ -1022,34 +2178,35 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
     int maxdepthbypos = meanreadlen <= 0 ? 10 : max(10, round(10.0 * artifact_filter * (Depth/(double)meanreadlen)));
 
     Calls.clear();
+    Seqs.clear();
 
     int j;
     int pia_len=0;
-	for (i=0;i<Depth;++i,++read_i) {
-		bool sor=0;
+	for (i=0;i<Depth;++i) {
+		const PileupEnt &e = ents[i];
+		bool sor=e.is_start;
 
-		if (*cur_p == '^') {
-			sor=1;
-			++cur_p;
+		if (sor) {
             Read x;
-            x.MapQ = *cur_p-phred;
+            x.MapQ = e.m;
             x.Pos = Pos;
-            ++cur_p;
-            if (read_i != rds.ReadList.end()) {
-                ++read_i;
-            }
-            read_i=rds.ReadList.insert(read_i,x);
+            // new reads go after the current one, which is carried along untouched
+            if (ra < active.size()) 
+                next.push_back(active[ra++]);
+            next.push_back(x);
             meanreadlen = rds.MeanReadLen();
-		}
-
-        if (read_i == rds.ReadList.end()) {
-            warn("warning\tread start without '^', partial pileup: '%s'\n", cur_p);
+		} else if (ra < active.size()) {
+            next.push_back(active[ra++]);
+        } else {
+            if (!rds.Resume)
+                warn("warning\tread start without '^', partial pileup: %s:%d\n", Chr, Pos);
             Read x;
             x.MapQ = 0;
             x.Pos = -1;
-            read_i=rds.ReadList.insert(read_i,x);
+            next.push_back(x);
             meanreadlen = rds.MeanReadLen();
         }
+        read_i = &next.back();
 
 
         // position of read relative to my position
@@ -1069,9 +2226,9 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 		if (sor) 
 			++NumReads;
 
-		char q = p_qual[i]-phred;				// qual char
+		char q = e.q;					// qual char
 		char mq = read_i->MapQ;
-		char o = *cur_p;				// orig call
+		char o = e.c;					// orig call
 		char c = toupper(o);			// uppercase/ref 
 		bool is_ref = 0;
 
@@ -1087,17 +2244,17 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 		}
 
 		bool skip = 0;
-        bool ampok = !pcr_annot || !adex;
+        bool ampok = !amps;
 
         if (!ampok) {
-            for (j=0;j<amps.size();++j) {
+            for (j=0;j<amps->Amps.size();++j) {
                 int apos = read_i->Pos + meanreadlen + 1;
                 int bpos = read_i->Pos + meanreadlen;
                 int cpos = read_i->Pos + meanreadlen - 1;
-                if (apos == amps[j].End || bpos == amps[j].End || cpos == amps[j].End) {
+                if (apos == amps->Amps[j].End || bpos == amps->Amps[j].End || cpos == amps->Amps[j].End) {
                     ampok=1;
                 }
-                if (read_i->Pos == amps[j].Beg) {
+                if (read_i->Pos == amps->Amps[j].Beg) {
                     ampok=1;
                     break;
                 }
@@ -1107,7 +2264,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 
         if (debug_xpos) {
             if (debug_level >= 3) {
-                if (Pos == debug_xpos && !strcmp(debug_xchr,Chr.data())) {
+                if (Pos == debug_xpos && !strcmp(debug_xchr,Chr)) {
                     fprintf(stderr, "DEBUG: PIA: %d, DBP: %d, rrou: %d, nonRR: %f, maxdbp: %d, filt: %d, f1: %d, f2: %d\n", pia,
                         depthbypos[pia], max(1,rand_round(0.5 + artifact_filter * (Depth/rds.MeanReadLen()))), artifact_filter * (Depth/rds.MeanReadLen()),
                         maxdepthbypos, (10*(depthbypos[pia]-1))+(i%10), ((10*(depthbypos[pia]-1))+(i%10)) > maxdepthbypos, depthbypos[pia] > max(1,rand_round(0.5+artifact_filter * (Depth/rds.MeanReadLen()))) );
@@ -1180,21 +2337,12 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
             }
 		}
 
-		if (c == '-' || c == '+') {
-            warn("invalid pileup, at '%s', indel not attached to read?\n", cur_p);
-		} else {
-		    if (c != '*' && c != 'N') 
-                read_i->Seq += c;
-			++cur_p;
-		}
+	    if (c != '-' && c != '+' && c != '*' && c != 'N') 
+            ++read_i->Len;
 
-        if (*cur_p == '+' || *cur_p == '-') {
-            c = *cur_p;
-            char *end_p;
-            int len = strtol(++cur_p, &end_p, 10);
-            string ins_seq(end_p, len);
-            to_upper(ins_seq);
-            read_i->Seq += ins_seq;
+        if (e.idl) {
+            c = e.idl;
+            read_i->Len += e.idl_len;
             if (!skip) {
                 int j = b2i(c);
                 if (j >= Calls.size()) {
@@ -1216,45 +2364,37 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
                 Calls[j].qual_ssq+=q*q;
                 Calls[j].mq_ssq+=mq*mq;
                 Calls[j].mq_sum+=mq;
-                Calls[j].seqs.push_back(ins_seq);
+                Seqs.Add(c, e.idl_seq, e.idl_len);
             }
-            cur_p=end_p+len;
         }
 
-        if (*cur_p == '$') {
-            if (read_i->MapQ > -1) {
-                rds.TotReadLen+=read_i->Seq.size();
-                rds.ReadBin.push_back(*read_i);
-                if (rds.ReadBin.size() > min(1000,Depth*2)) {
-                    rds.TotReadLen-=rds.ReadBin.front().Seq.size();
+        if (e.is_end) {
+            // reads under way before a jump, or a partial pileup, have no start: their length is short
+            if (read_i->MapQ > -1 && read_i->Pos >= 0) {
+                rds.TotReadLen+=read_i->Len;
+                rds.ReadBin.push_back(read_i->Len);
+                // only the last 2*depth (at most 1000) reads, however many were kept before
+                while (rds.ReadBin.size() > min(1000,Depth*2)) {
+                    rds.TotReadLen-=rds.ReadBin.front();
                     rds.ReadBin.pop_front();
                 }
             }
-//            printf("%d\t%s\n", read_i->MapQ, read_i->Seq.c_str());
-            read_i=rds.ReadList.erase(read_i);
+//            printf("%d\t%d\n", read_i->MapQ, read_i->Len);
+            next.pop_back();
             meanreadlen = rds.MeanReadLen();
-            --read_i;
-            ++cur_p;
             ++eor;
         }
 	}
 
-    if ((Depth-eor) != rds.ReadList.size()) {
-        warn("warning\tdepth is %d, but read list is: %d\n", Depth, (int) rds.ReadList.size());
-    }
-
-	if (*cur_p == '-' || *cur_p == '+') {
-		char *end_p;
-		int len = strtol(++cur_p, &end_p, 10);
-		// keep this
-		string idl(end_p, len);
-		cur_p=end_p+len;
-	}
+    // reads not in this column stay, in order
+    while (ra < active.size())
+        next.push_back(active[ra++]);
+    active.swap(next);
+    rds.Resume=false;
 
-	if (*cur_p) {
-		warn("Failed to parse pileup %s\n", _dat[4]);
-		exit(1);
-	}
+    if ((Depth-eor) != active.size()) {
+        warn("warning\tdepth is %d, but read list is: %d\n", Depth, (int) active.size());
+    }
 
 	Depth=0;
 	for (i=0;i<5 && i < Calls.size();++i) {		// total depth (exclude inserts for tot depth, otherwise they are double-counted)
@@ -1262,7 +2402,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 	}
 
     if (debug_xpos) {
-        if (Pos == debug_xpos && !strcmp(debug_xchr,Chr.data())) {
+        if (Pos == debug_xpos && !strcmp(debug_xchr,Chr)) {
             fprintf(stderr,"xpos-max-per-pos\t%f\n", maxdepthbypos/10.0);
             fprintf(stderr,"xpos-mean-readlen\t%f\n", rds.MeanReadLen());
             fprintf(stderr,"xpos-depth-list\t");
@@ -1325,7 +2465,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
                 p1=((depthbyposbycall[j].call[i]+all_pct*2)/((double)depthbypos[j]+2));
                 pdiff=fabs(p1-p2);
 /*
-                if (Pos == debug_xpos && !strcmp(debug_xchr,Chr.data())) {
+                if (Pos == debug_xpos && !strcmp(debug_xchr,Chr)) {
                     warn("base:%c, depth:%d, dbc:%d, p1: %g, pdiff: %g, maxc: %g, all_pct: %g\n", Calls[i].base, depthbypos[j], depthbyposbycall[j].call[i], p1, pdiff,  max(depthbypos[j]*pdiff*pdiff*pdiff-all_pct,0), all_pct);
                 }
 */
@@ -1339,7 +2479,7 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
             Calls[i].agreement = max(0,1-wt4_od);
 
             if (debug_xpos) {
-                if (Pos == debug_xpos && !strcmp(debug_xchr,Chr.data())) {
+                if (Pos == debug_xpos && !strcmp(debug_xchr,Chr)) {
                     if (debug_level > 2) warn("base:%c, cube_v:%g, deno:%g\n", Calls[i].base, cube_v, ((double)(Depth+2*pia_len)));
                     fprintf(stderr,"xpos-agree-%c\t%g\n",Calls[i].base, Calls[i].agreement);
                     fprintf(stderr,"xpos-diver-%c\t%g\n",Calls[i].base, Calls[i].diversity);
@@ -1364,82 +2504,221 @@ inline void PileupSummary::Parse(char *line, PileupReads &rds, tidx *adex, char
 	}
 }
 
-PileupSummary JunkSummary;
+// fixed part of a spilled summary
+typedef struct {
+    int Pos, Depth, TotQual, NumReads, Regions;
+    int SkipN, SkipAmp, SkipDupReads, SkipMinMapq, SkipMinQual;
+    int ChrLen;             // -1: same chr as the last one
+    int NumCalls;
+    int NumSeqs;            // distinct indel seqs, after the calls
+    char Base;
+} SpillHead;
+
+typedef struct {
+    int qual, fwd, rev, mq0, mn_qual, qual_ssq, mq_sum, mq_ssq, tail_rev, tail_fwd, fwd_q, rev_q;
+    double diversity, agreement;
+    char base;
+    bool is_ref;
+} SpillCall;
+
+typedef struct {
+    int cnt, len;
+    char type;
+} SpillSeq;
+
+static void gzwrite_or_die(gzFile f, const void *buf, unsigned len) {
+    if (len && gzwrite(f, buf, len) != (int) len)
+        die("Can't write spill file: %s\n", strerror(errno));
+}
+
+static bool gzread_or_die(gzFile f, void *buf, unsigned len) {
+    int n = gzread(f, buf, len);
+    if (n == 0 && len) 
+        return false;
+    if (n != (int) len)
+        die("Can't read spill file, truncated\n");
+    return true;
+}
+
+// one pass: save a parsed summary for Replay
+void PileupManager::Save(const PileupSummary &p) {
+    SpillHead h;
+    meminit(h);
+    h.Pos=p.Pos; h.Depth=p.Depth; h.TotQual=p.TotQual; h.NumReads=p.NumReads; h.Regions=p.Regions;
+    h.SkipN=p.SkipN; h.SkipAmp=p.SkipAmp; h.SkipDupReads=p.SkipDupReads; h.SkipMinMapq=p.SkipMinMapq; h.SkipMinQual=p.SkipMinQual;
+    h.ChrLen = (p.Chr == SpillChr) ? -1 : strlen(p.Chr);
+    h.NumCalls=p.Calls.size();
+    h.NumSeqs=p.Seqs.size();
+    h.Base=p.Base;
+    gzwrite_or_die(Spill, &h, sizeof(h));
+    if (h.ChrLen >= 0) {
+        gzwrite_or_die(Spill, p.Chr, h.ChrLen);
+        SpillChr = p.Chr;
+    }
+    int i;
+    for (i=0;i<h.NumCalls;++i) {
+        const vcall &c = p.Calls[i];
+        SpillCall sc;
+        meminit(sc);
+        sc.qual=c.qual; sc.fwd=c.fwd; sc.rev=c.rev; sc.mq0=c.mq0; sc.mn_qual=c.mn_qual; sc.qual_ssq=c.qual_ssq;
+        sc.mq_sum=c.mq_sum; sc.mq_ssq=c.mq_ssq; sc.tail_rev=c.tail_rev; sc.tail_fwd=c.tail_fwd; sc.fwd_q=c.fwd_q; sc.rev_q=c.rev_q;
+        sc.diversity=c.diversity; sc.agreement=c.agreement;
+        sc.base=c.base; sc.is_ref=c.is_ref;
+        gzwrite_or_die(Spill, &sc, sizeof(sc));
+    }
+    for (i=0;i<h.NumSeqs;++i) {
+        SpillSeq ss;
+        meminit(ss);
+        string seq = p.Seqs.Seq(i);
+        ss.cnt=p.Seqs.Count(i); ss.len=seq.size(); ss.type=p.Seqs.Type(i);
+        gzwrite_or_die(Spill, &ss, sizeof(ss));
+        gzwrite_or_die(Spill, seq.data(), ss.len);
+    }
+}
+
+void PileupManager::SetSamples(int n) {
+    Samples=n;
+    Pileup.resize(n);
+    Reads.resize(n);
+    Ents.resize(n);
+    Fields.resize(3*n+8);
+    Win.clear();
+    WinBeg=WinLen=0;
+}
 
+// chr, pos, ref, then depth, reads and quals for each sample
 inline void PileupManager::Parse(char *dat) {
-    Pileup.Parse(dat, Reads, UseAnnot ? &AnnotDex : NULL, AnnotType);
-    Visit(Pileup);
+    int n=split(Fields.data(), dat, '\t', Fields.size());
+
+    if (n < 3+3*Samples) {
+        warn("Can't read pileup : %d fields, need %d columns, line %d\n", n, 3+3*Samples, g_lineno);
+        exit(1);
+    }
+
+    int s;
+    for (s=0;s<Samples;++s) 
+        parse_reads(&Fields[3+3*s], Ents[s]);
+    ParseCol(Fields[0], atoi(Fields[1]), *Fields[2], Ents.data());
 }
 
-void PileupManager::Visit(PileupSummary &p) {
+inline void PileupManager::Parse(const char *chr, int pos, char base, const vector<PileupEnt> &ents) {
+    assert(Samples == 1);
+    ParseCol(chr, pos, base, &ents);
+}
+
+// joint: one list of reads per sample
+inline void PileupManager::Parse(const char *chr, int pos, char base, const vector<vector<PileupEnt> > &ents) {
+    assert(ents.size() == Samples);
+    ParseCol(chr, pos, base, ents.data());
+}
+
+// ents[s] are sample s's reads.  the amplicons are looked up once for all of them
+void PileupManager::ParseCol(const char *chr, int pos, char base, const vector<PileupEnt> *ents) {
+    chr=Chrs.Intern(chr);
+
+    int s;
+    // read lengths aren't carried into the next chromosome, so a serial run is the same as one shard (-t) per chromosome
+    if (chr != ReadChr) {
+        for (s=0;s<Samples;++s) 
+            Reads[s].NewChr();
+        ReadChr=chr;
+    }
+
+    const AmpList *amps = NULL;
+    if (UseAnnot && pcr_annot) {
+        Amps.Lookup(&AmpCur, chr, pos, AnnotType);
+        amps = &Amps;
+    }
+
+    for (s=0;s<Samples;++s) {
+        PileupSummary &p = Pileup[s];
+        p.Chr=chr;
+        p.Pos=pos;
+        p.Base=base;
+        p.Depth=ents[s].size();
+        p.Parse(ents[s], Reads[s], amps);
+        if (Spill) Save(p);
+    }
+    Visit(Pileup.data(), 1);
+}
+
+// col[s*stride] is sample s's summary, a placeholder has a stride of 0
+void PileupManager::Visit(PileupSummary *col, int stride) {
+    PileupSummary &p = *col;
 
     if (WinMax < 3) {
         // no real window ... just go straight
-        VisitX(p, -1);
+        VisitX(col, -1);
         return;
     }
 
     if (p.Base != '-' && p.Base != '@') {
-        if (Win.size() && (Win.back().Pos != (p.Pos - 1) )) {
-            if (Win.back().Pos < p.Pos && ((p.Pos - Win.back().Pos) <= (WinMax/2))) {
-                while (Win.back().Pos < (p.Pos - 1)) {
+        if (WinLen && (WinAt(WinLen-1).Pos != (p.Pos - 1) )) {
+            if (WinAt(WinLen-1).Pos < p.Pos && ((p.Pos - WinAt(WinLen-1).Pos) <= (WinMax/2))) {
+                while (WinAt(WinLen-1).Pos < (p.Pos - 1)) {
                     // visit/pop, add a placeholder
                     JunkSummary.Base = '-';
-                    JunkSummary.Pos = Win.back().Pos + 1;
-                    Visit(JunkSummary);
+                    JunkSummary.Pos = WinAt(WinLen-1).Pos + 1;
+                    Visit(&JunkSummary, 0);
                 }
             } else {
-                while (Win.size() && Win[WinMax/2].Base != '@') {
+                while (WinLen && WinAt(WinMax/2).Base != '@') {
                     // visit/pop, but don't add anything, until it's empty
                     JunkSummary.Base = '@';
                     JunkSummary.Pos = 0;
-                    Visit(JunkSummary);
+                    Visit(&JunkSummary, 0);
                 }
             }
         }
     }
 
+    int i, s;
+
     // initialize the window with nothing, if it's not full
-    while (Win.size() < WinMax) {
+    if (WinLen != WinMax) {
+        Win.resize(WinMax*Samples);
+        WinBeg=WinLen=0;
+    }
+    for (;WinLen < WinMax;++WinLen) {
         JunkSummary.Base = '@';
         JunkSummary.Pos = 0;
-        Win.push_back(JunkSummary);
+        for (s=0;s<Samples;++s) 
+            WinAt(WinLen, s) = JunkSummary;
     }
 
-    Win.push_back(p);
+    // drop the oldest, reusing its slots (and their buffers) for the column
+    WinBeg = (WinBeg+1) % WinMax;
+    for (s=0;s<Samples;++s) 
+        WinAt(WinLen-1, s) = col[s*stride];
 
     //debug("Visit: %d\n", p.Pos);
 
-    if (Win.size() > WinMax)        // queue too big?  pop
-        Win.pop_front();
-    
-    int i;
     int lrc=0,rrc=0;                // left repeat count, right repeat count
     char lrb, rrb;                  // left repeat base...
     int vx;
 
-    if (Win.size() < WinMax) {    // small window?  look at leading edge only
+    if (WinLen < WinMax) {    // small window?  look at leading edge only
         return;
     } else {
         vx = WinMax/2;              // larger window? look at midpoint
     }
 
-    if (Win[vx].Base == '-' || Win[vx].Base == '@') 
+    if (WinAt(vx).Base == '-' || WinAt(vx).Base == '@') 
         return;
 
     if (vx > 1) {                   // look left
-        lrb = Win[vx-1].Base;
+        lrb = WinAt(vx-1).Base;
         for (i=vx-2; i >= 0; --i) { // increment repeat count
-            if (Win[i].Base == lrb) 
+            if (WinAt(i).Base == lrb) 
                 ++lrc;
             else 
                 break;
         }
     }
-    if (vx < (Win.size()-2)) {
-        rrb = Win[vx+1].Base;
-        for (i=vx+2; i < Win.size(); ++i) {
-            if (Win[i].Base == rrb)
+    if (vx < (WinLen-2)) {
+        rrb = WinAt(vx+1).Base;
+        for (i=vx+2; i < WinLen; ++i) {
+            if (WinAt(i).Base == rrb)
                 ++rrc;
             else
                 break;
@@ -1452,64 +2731,120 @@ void PileupManager::Visit(PileupSummary &p) {
 
     // maximum repeat count and associated base
     if (lrb == rrb ) {
-        Win[vx].RepeatCount = lrc+rrc;
-        Win[vx].RepeatBase = lrb;
+        WinAt(vx).RepeatCount = lrc+rrc;
+        WinAt(vx).RepeatBase = lrb;
     } else if (lrc > rrc) {
-        Win[vx].RepeatCount = lrc;
-        Win[vx].RepeatBase = lrb;
+        WinAt(vx).RepeatCount = lrc;
+        WinAt(vx).RepeatBase = lrb;
     } else {
-        Win[vx].RepeatCount = rrc;
-        Win[vx].RepeatBase = rrb;
+        WinAt(vx).RepeatCount = rrc;
+        WinAt(vx).RepeatBase = rrb;
+    }
+    for (s=1;s<Samples;++s) {
+        WinAt(vx, s).RepeatCount = WinAt(vx).RepeatCount;
+        WinAt(vx, s).RepeatBase = WinAt(vx).RepeatBase;
     }
 
 	if (debug_xpos) {
-        if (Win[vx].Pos == debug_xpos && !strcmp(debug_xchr,Win[vx].Chr.data())) {
+        if (WinAt(vx).Pos == debug_xpos && !strcmp(debug_xchr,WinAt(vx).Chr)) {
             fprintf(stderr,"xpos-window\t");
-            for (i=0;i<Win.size();++i) {
-                fprintf(stderr,"%c", Win[i].Base);
+            for (i=0;i<WinLen;++i) {
+                fprintf(stderr,"%c", WinAt(i).Base);
             }
             fprintf(stderr,"\n");
         }
     }
 
     double drms = 0; 
-    if (vx < Win.size()-1) {
-        int i;
+    for (s=0;vx < WinLen-1 && s<Samples;++s) {
 		int dminus = b2i('-');
 		int dstar = b2i('*');
+        PileupSummary &cur = WinAt(vx, s);
+        PileupSummary &nxt = WinAt(vx+1, s);
 
-        if (Win[vx].Calls.size() > dminus && Win[vx].Calls[dminus].depth() > 0) {
-            if (Win[vx+1].Calls.size() > dstar && Win[vx+1].Calls[dstar].depth() > 0) {
+        if (cur.Calls.size() > dminus && cur.Calls[dminus].depth() > 0) {
+            if (nxt.Calls.size() > dstar && nxt.Calls[dstar].depth() > 0) {
                 // baq adjustment works at the 'star' not at the 'indel', so adjust qual using the next locus
-               double adj=Win[vx+1].Calls[dstar].qual_rms()/(double)Win[vx].Calls[dminus].qual_rms();
+               double adj=nxt.Calls[dstar].qual_rms()/(double)cur.Calls[dminus].qual_rms();
                if (debug_xpos) {
-                    if (Win[vx].Pos == debug_xpos && !strcmp(debug_xchr,Win[vx].Chr.data())) {
-                        fprintf(stderr,"xpos-adj-qual\t%d to %d (%f)\n", Win[vx].Calls[dminus].qual_rms(),Win[vx+1].Calls[dstar].qual_rms(), adj);
+                    if (cur.Pos == debug_xpos && !strcmp(debug_xchr,cur.Chr)) {
+                        fprintf(stderr,"xpos-adj-qual\t%d to %d (%f)\n", cur.Calls[dminus].qual_rms(),nxt.Calls[dstar].qual_rms(), adj);
                     }
                }
-               Win[vx].Calls[dminus].qual *= adj; 
-               Win[vx].Calls[dminus].qual_ssq *= adj;
+               cur.Calls[dminus].qual *= adj; 
+               cur.Calls[dminus].qual_ssq *= adj;
             } else {    
                 vcall none;
                 if (debug_xpos) {
-                    if (Win[vx].Pos == debug_xpos && !strcmp(debug_xchr,Win[vx].Chr.data())) {
-                        fprintf(stderr,"xpos-skip-del-qual\t%d\n", Win[vx].Calls[dminus].depth());
+                    if (cur.Pos == debug_xpos && !strcmp(debug_xchr,cur.Chr)) {
+                        fprintf(stderr,"xpos-skip-del-qual\t%d\n", cur.Calls[dminus].depth());
                     }
                 }
-                Win[vx].Calls[dminus] = none;
+                cur.Calls[dminus] = none;
             }
         }
     }
 
-    VisitX(Win[vx], vx);
+    VisitX(&WinAt(vx), vx);
+}
+
+// visit summaries spilled by another manager, as if they were just parsed
+void PileupManager::Replay(gzFile in) {
+    SpillHead h;
+    string chr, seq;
+    const char *last=NULL;
+    int s=0;
+    while (gzread_or_die(in, &h, sizeof(h))) {
+        PileupSummary &p = Pileup[s];
+        p.Pos=h.Pos; p.Depth=h.Depth; p.TotQual=h.TotQual; p.NumReads=h.NumReads; p.Regions=h.Regions;
+        p.SkipN=h.SkipN; p.SkipAmp=h.SkipAmp; p.SkipDupReads=h.SkipDupReads; p.SkipMinMapq=h.SkipMinMapq; p.SkipMinQual=h.SkipMinQual;
+        p.Base=h.Base;
+        p.RepeatCount=0;
+        p.RepeatBase='\0';
+        p.InTarget=0;
+        if (h.ChrLen >= 0) {
+            chr.resize(h.ChrLen);
+            gzread_or_die(in, (char *) chr.data(), h.ChrLen);
+            last=Chrs.Intern(chr.c_str());
+        }
+        p.Chr=last;
+        p.Calls.clear();
+        p.Calls.resize(h.NumCalls);
+        int i;
+        for (i=0;i<h.NumCalls;++i) {
+            vcall &c = p.Calls[i];
+            SpillCall sc;
+            gzread_or_die(in, &sc, sizeof(sc));
+            c.qual=sc.qual; c.fwd=sc.fwd; c.rev=sc.rev; c.mq0=sc.mq0; c.mn_qual=sc.mn_qual; c.qual_ssq=sc.qual_ssq;
+            c.mq_sum=sc.mq_sum; c.mq_ssq=sc.mq_ssq; c.tail_rev=sc.tail_rev; c.tail_fwd=sc.tail_fwd; c.fwd_q=sc.fwd_q; c.rev_q=sc.rev_q;
+            c.diversity=sc.diversity; c.agreement=sc.agreement;
+            c.base=sc.base; c.is_ref=sc.is_ref;
+        }
+        p.Seqs.clear();
+        for (i=0;i<h.NumSeqs;++i) {
+            SpillSeq ss;
+            gzread_or_die(in, &ss, sizeof(ss));
+            seq.resize(ss.len);
+            gzread_or_die(in, (char *) seq.data(), ss.len);
+            p.Seqs.Add(ss.type, seq.data(), ss.len, ss.cnt);
+        }
+        if (++s == Samples) {
+            Visit(Pileup.data(), 1);
+            s=0;
+        }
+    }
+    if (s) 
+        die("Can't read spill file, truncated\n");
+    Finish();
 }
 
 void PileupManager::Finish() {
     // finish out the rest of the pileup, with the existing window
     int vx = WinMax/2+1;
-    while (vx < Win.size()) {
-        ///debug("Finish: %d\n", Win[vx].Pos);
-        VisitX(Win[vx++], vx);
+    while (vx < WinLen) {
+        ///debug("Finish: %d\n", WinAt(vx).Pos);
+        VisitX(&WinAt(vx), vx);
+        ++vx;
     }
     int i;
     for (i=0;i<Kids.size();++i) {
@@ -1517,27 +2852,36 @@ void PileupManager::Finish() {
     }
 }
 
-void PileupManager::VisitX(PileupSummary &p, int windex) {
+// col[s] is sample s's summary of the locus
+void PileupManager::VisitX(PileupSummary *col, int windex) {
 
     WinDex=windex;
+    RefFilled=false;
 
+    int i, s;
     if (UseAnnot) {
         // index lookup only.... not string lookup
-        const std::vector <long int> * v = &(AnnotDex.lookup(p.Chr.data(), p.Pos + (AnnotType=='b' ? -1 : 0)));
-        if (v && v->size()) {
-            p.InTarget=1;
+        if (AnnotCur.lookup_p(col->Chr, col->Pos + (AnnotType=='b' ? -1 : 0)).size()) {
+            for (s=0;s<Samples;++s) 
+                col[s].InTarget=1;
         }
     }
 
     if (no_indels) {
-        if (p.Calls.size() > 4) {
-            p.Calls.resize(4);
+        for (s=0;s<Samples;++s) {
+            if (col[s].Calls.size() > 4) {
+                col[s].Calls.resize(4);
+            }
         }
     }
 
-    int i;
     for (i=0;i<Kids.size();++i) {
-        Kids[i]->Visit(p);
+        if (Kids[i]->Sample >= 0) {
+            Kids[i]->Visit(col[Kids[i]->Sample]);
+        } else {
+            for (s=0;s<Samples;++s) 
+                Kids[i]->Visit(col[s]);
+        }
     }
 }
 
@@ -1547,11 +2891,11 @@ void VarCallVisitor::Visit(PileupSummary &p) {
 	if (debug_xpos) {
 		if (p.Pos != debug_xpos)
 			return;
-		if (strcmp(debug_xchr,p.Chr.data())) 
+		if (strcmp(debug_xchr,p.Chr)) 
 			return;
 	}
 
-    if (pcr_annot) {
+    if (pcr_annot || target_only) {
         if (!p.InTarget) {
             if (debug_xpos) {
                 fprintf(stderr,"xpos-skip-annot\t1\n");
@@ -1569,6 +2913,7 @@ void VarCallVisitor::Visit(PileupSummary &p) {
 		    fprintf(stderr,"xpos-skip-amp\t%d\n",p.SkipAmp);
 		    fprintf(stderr,"xpos-skip-mapq\t%d\n",p.SkipMinMapq);
 		    fprintf(stderr,"xpos-skip-qual\t%d\n",p.SkipMinQual);
+            Flush(true);
 			exit(0);
         }
 		++SkippedDepth;
@@ -1582,13 +2927,14 @@ void VarCallVisitor::Visit(PileupSummary &p) {
 	if (p.Calls.size() > 6) 
 		p.Calls.resize(7);	// toss N's before sort
 
-    static char regions[64] = "";
+    string regions;
     if (pcr_annot) {
-        sprintf(regions, "\t%d", p.Regions); 
+        regions += '\t';
+        str_int(regions, p.Regions);
     } 
 
     // OUTPUT CSE BEFORE REORDRED BASES!
-    if (cse_f) {
+    if (Out[OUT_CSE]) {
         if (p.Calls.size() < 4) 
             p.Calls.resize(4);	// cse needs 4 calls
 
@@ -1597,33 +2943,32 @@ void VarCallVisitor::Visit(PileupSummary &p) {
         // cse format... no need to sort or call anything
         if (p.Calls[T_A].depth()||p.Calls[T_C].depth()|| p.Calls[T_G].depth()|| p.Calls[T_T].depth()) {
             // silly 15 decimals to match R's default output ... better off with the C default
-            static char cse_buf[8192]; 
             #define MEANQ(base,dir) (p.Calls[base].dir?(p.Calls[base].dir##_q/(double)p.Calls[base].dir):0)
-           sprintf(cse_buf,"%s\t%d\t%c\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%s\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g%s\n",p.Chr.c_str(), p.Pos, toupper(p.Base)
-                    , p.Calls[T_A].fwd, p.Calls[T_C].fwd, p.Calls[T_G].fwd, p.Calls[T_T].fwd
-                    , p.Calls[T_A].rev, p.Calls[T_C].rev, p.Calls[T_G].rev, p.Calls[T_T].rev
-                    , MEANQ(T_A,fwd), MEANQ(T_C,fwd), MEANQ(T_G,fwd), MEANQ(T_T,fwd)
-                    , MEANQ(T_A,rev), MEANQ(T_C,rev), MEANQ(T_G,rev), MEANQ(T_T,rev)
-                    , Manager->Reference.data()
-                    , p.Calls[T_A].diversity
-                    , p.Calls[T_C].diversity
-                    , p.Calls[T_G].diversity
-                    , p.Calls[T_T].diversity
-                    , p.Calls[T_A].agreement
-                    , p.Calls[T_C].agreement
-                    , p.Calls[T_G].agreement
-                    , p.Calls[T_T].agreement
-                    , regions
-            );
-            fputs(cse_buf, cse_f);
+            string &o = CseOut;
+            size_t row = o.size();
+            o += p.Chr; o += '\t';
+            str_int(o, p.Pos); o += '\t';
+            o += (char) toupper(p.Base);
+            int b;
+            for (b=T_A;b<=T_T;++b) {o += '\t'; str_int(o, p.Calls[b].fwd);}
+            for (b=T_A;b<=T_T;++b) {o += '\t'; str_int(o, p.Calls[b].rev);}
+            for (b=T_A;b<=T_T;++b) {o += '\t'; str_gen(o, MEANQ(b,fwd));}
+            for (b=T_A;b<=T_T;++b) {o += '\t'; str_gen(o, MEANQ(b,rev));}
+            o += '\t'; o += Manager->Reference.c_str();
+            for (b=T_A;b<=T_T;++b) {o += '\t'; str_gen(o, p.Calls[b].diversity);}
+            for (b=T_A;b<=T_T;++b) {o += '\t'; str_gen(o, p.Calls[b].agreement);}
+            o += regions;
+            o += '\n';
             // cse requires separate output for on-target (instead of another column)
-            if (tgt_cse_f && p.InTarget) {
-                fputs(cse_buf, tgt_cse_f);
+            if (Out[OUT_TGT_CSE] && p.InTarget) {
+                TgtCseOut.append(o, row, string::npos);
             }
+            Flush(false);
         }
     }
 
-	sort(p.Calls.begin(), p.Calls.end(), hitolocall);
+    int ord[T_CNT];
+    p.Calls.Order(ord);
 
 	int need_out = -1;
 	int skipped_balance=0;
@@ -1636,98 +2981,82 @@ void VarCallVisitor::Visit(PileupSummary &p) {
 	int skipped_agreement=0;
 
     vector<vfinal> final_calls;
-    for (i=0;i<p.Calls.size();++i) {		// all calls
-        //        printf("CALL TOP: depth:%d base: %c, pd: %d, calls: %d\n", (int) p.Calls[i].depth(), p.Calls[i].base, p.Depth, (int) p.Calls.size());
+    for (i=0;i<p.Calls.size();++i) {		// all calls, deepest first
+        vcall &c = p.Calls[ord[i]];
+        //        printf("CALL TOP: depth:%d base: %c, pd: %d, calls: %d\n", (int) c.depth(), c.base, p.Depth, (int) p.Calls.size());
 
-        double pct = (double) p.Calls[i].depth()/p.Depth;
-        double qpct = (double) p.Calls[i].qual/p.TotQual;
+        double pct = (double) c.depth()/p.Depth;
+        double qpct = (double) c.qual/p.TotQual;
 
-        if (!p.Calls[i].base)
+        if (!c.base)
             continue;
 
-        if (!p.Calls[i].depth())
+        if (!c.depth())
             continue;
 
-        double bpct = (double) min(p.Calls[i].fwd,p.Calls[i].rev)/p.Calls[i].depth();
+        double bpct = (double) min(c.fwd,c.rev)/c.depth();
 
         // REBALANCE READS.... CUTTING OFF HIGH COLUMNS
-        if (pct >= pct_depth && qpct >= pct_qdepth && (p.Calls[i].depth() >= min_adepth)) {
+        if (pct >= pct_depth && qpct >= pct_qdepth && (c.depth() >= min_adepth)) {
             if (bpct < pct_balance) {
                 int fwd_adj=0, rev_adj=0;
                 // f=b*(f+r); r=f/b-f; adj=r-(f/b-f)
-                if (p.Calls[i].fwd < p.Calls[i].rev) {
-                    rev_adj = (int) p.Calls[i].rev - ( p.Calls[i].fwd/pct_balance  - p.Calls[i].fwd );
+                if (c.fwd < c.rev) {
+                    rev_adj = (int) c.rev - ( c.fwd/pct_balance  - c.fwd );
                 } else {
-                    fwd_adj = (int) p.Calls[i].fwd - ( p.Calls[i].rev/pct_balance  - p.Calls[i].rev );
+                    fwd_adj = (int) c.fwd - ( c.rev/pct_balance  - c.rev );
                 }
                 if (fwd_adj + rev_adj > 1 && bpct > 0) {
                     // adjust call down
-                    p.Calls[i].qual -= (rev_adj+fwd_adj)*(p.Calls[i].qual/p.Calls[i].depth()); 
-                    p.Calls[i].mq_sum -= (rev_adj+fwd_adj)*(p.Calls[i].mq_sum/p.Calls[i].depth());
-                    p.Calls[i].qual_ssq -= (rev_adj+fwd_adj)*(p.Calls[i].qual_ssq/p.Calls[i].depth());
-                    p.Calls[i].mq_ssq -= (rev_adj+fwd_adj)*(p.Calls[i].mq_ssq/p.Calls[i].depth());
-                    p.Calls[i].rev -= rev_adj;
-                    p.Calls[i].fwd -= fwd_adj;
+                    c.qual -= (rev_adj+fwd_adj)*(c.qual/c.depth()); 
+                    c.mq_sum -= (rev_adj+fwd_adj)*(c.mq_sum/c.depth());
+                    c.qual_ssq -= (rev_adj+fwd_adj)*(c.qual_ssq/c.depth());
+                    c.mq_ssq -= (rev_adj+fwd_adj)*(c.mq_ssq/c.depth());
+                    c.rev -= rev_adj;
+                    c.fwd -= fwd_adj;
                     skipped_balance+=rev_adj+fwd_adj;
 
                     // fixed bpct
-                    bpct = (double) min(p.Calls[i].fwd,p.Calls[i].rev)/p.Calls[i].depth();
+                    bpct = (double) min(c.fwd,c.rev)/c.depth();
                 } else {
                     // it's junk anyway
                 }
 
                 // fix depths after adjustment!
-                pct = (double) p.Calls[i].depth()/p.Depth;
-                qpct = (double) p.Calls[i].qual/p.TotQual;
+                pct = (double) c.depth()/p.Depth;
+                qpct = (double) c.qual/p.TotQual;
             }
         }
 
-        if (pct >= pct_depth && qpct >= pct_qdepth && (p.Calls[i].depth() >= min_adepth)) {
+        if (pct >= pct_depth && qpct >= pct_qdepth && (c.depth() >= min_adepth)) {
             // balance is meaningless at low depths
-            if ((bpct >= pct_balance) || (p.Calls[i].depth()<4)) {
+            if ((bpct >= pct_balance) || (c.depth()<4)) {
                 // reads come from diverse positions
-                if (p.Calls[i].diversity >= min_diversity) {
-                    if (p.Calls[i].agreement >= min_agreement) {
-                        if (p.Calls[i].base == '+' || p.Calls[i].base == '-') {
+                if (c.diversity >= min_diversity) {
+                    if (c.agreement >= min_agreement) {
+                        if (c.base == '+' || c.base == '-') {
                             // yuk ... time to think about a possible indel call
-                            if (p.Calls[i].depth() >= min_idepth) {
+                            if (c.depth() >= min_idepth) {
                                 // should really pick more than 1
                                 // but need to allow "similar" indels to pile up
                                 // should group into distinct bins, using some homology thing
-                                sort(p.Calls[i].seqs.begin(), p.Calls[i].seqs.end());
-                                string prev, maxs;
-                                int pcnt=0, maxc=0, j;
-                                for (j=0;j<p.Calls[i].seqs.size();++j) {
-                                    if (prev == p.Calls[i].seqs[j]) {
-                                        ++pcnt;
-                                    } else {
-                                        if (pcnt > maxc) {
-                                            maxs=prev;
-                                            maxc=pcnt;
-                                        }
-                                        prev=p.Calls[i].seqs[j];
-                                        pcnt=1;
-                                    }
-                                }
-                                if (pcnt > maxc) {
-                                    maxs=prev;
-                                    maxc=pcnt;
-                                }
+                                string maxs;
+                                int maxc = p.Seqs.Top(c.base, maxs);
                                 if (maxc >= min_idepth && maxc >= min_adepth) {
                                     // only calls 1 indel at a given position
                                     if ((repeat_filter == 0) || (p.RepeatCount < repeat_filter)) {
                                         // maybe use rms here... see if it helps
-                                        double mean_qual = p.Calls[i].qual/(double)p.Calls[i].depth();
+                                        double mean_qual = c.qual/(double)c.depth();
                                         double err_rate = mean_qual < max_phred ? pow(10,-mean_qual/10.0) : global_error_rate;
                                         // expected number of non-reference = error_rate*depth
-                                        double pval=(p.Depth*err_rate==0)?0:gsl_ran_poisson_pdf(p.Calls[i].depth(), p.Depth*err_rate);
+                                        double pval=(p.Depth*err_rate==0)?0:Poisson.Pdf(c.depth(), p.Depth*err_rate);
                                         double padj=total_locii ? pval*total_locii : pval;           // multiple-testing adjustment
 
                                         if (alpha>=1 || padj <= alpha) {
-                                            vfinal final(p.Calls[i]);
+                                            vfinal final(c);
 
-                                            double mq_padj=max(total_locii*pow(10,-p.Calls[i].mq_sum/10.0),padj);      // never report pval as better than the total mapping quality
-                                            if (debug_xpos) fprintf(stderr,"xpos-debug-pval\tbase:%c, err:%g, pval:%g, padj:%g, mq_padj:%g, mq_sum:%d\n", p.Calls[i].base, err_rate, pval, padj, mq_padj, p.Calls[i].mq_sum);
+                                            double mq_padj=max(total_locii*pow(10,-c.mq_sum/10.0),padj);      // never report pval as better than the total mapping quality
+                                            if (debug_xpos) fprintf(stderr,"xpos-debug-pval\tbase:%c, err:%g, pval:%g, padj:%g, mq_padj:%g, mq_sum:%d\n", c.base, err_rate, pval, padj, mq_padj, c.mq_sum);
 
                                             if (mq_padj > 1) mq_padj=1;
 
@@ -1740,82 +3069,82 @@ void VarCallVisitor::Visit(PileupSummary &p) {
                                             final.max_idl_seq=maxs;
                                             final_calls.push_back(final);
                                         } else {
-                                            skipped_alpha+=p.Calls[i].depth();
+                                            skipped_alpha+=c.depth();
                                         }
                                         // implicitly skip all the ohter indel calls at the same locus
-                                        skipped_indel+=p.Calls[i].depth()-maxc;
+                                        skipped_indel+=c.depth()-maxc;
                                     } else {
-                                        skipped_repeat+=p.Calls[i].depth();
+                                        skipped_repeat+=c.depth();
                                     }
                                 } else {
-                                    skipped_indel+=p.Calls[i].depth();
+                                    skipped_indel+=c.depth();
                                 }
                             } else {
-                                skipped_indel+=p.Calls[i].depth();
+                                skipped_indel+=c.depth();
                             }
                         } else {
-                            if (p.Calls[i].base == '*' && (
+                            if (c.base == '*' && (
                                         ((repeat_filter > 0) && (p.RepeatCount >= repeat_filter)) || 
-                                        (p.Calls[i].depth() < min_idepth)
+                                        (c.depth() < min_idepth)
                                         )) {
-                                skipped_indel+=p.Calls[i].depth();
+                                skipped_indel+=c.depth();
                             } else {
                                 // subtract inserts from reference .. perhaps > 0 is correct here....
-                                if (p.Calls[i].is_ref && (ins_rev+ins_fwd) > max(min_idepth,min_adepth)) {
-                                    p.Calls[i].fwd-=ins_fwd;
-                                    p.Calls[i].rev-=ins_rev;
+                                if (c.is_ref && (ins_rev+ins_fwd) > max(min_idepth,min_adepth)) {
+                                    c.fwd-=ins_fwd;
+                                    c.rev-=ins_rev;
                                 }
 
-                                double mean_qual = p.Calls[i].qual/(double)p.Calls[i].depth();
+                                double mean_qual = c.qual/(double)c.depth();
 
                                 /*
                                    if ( (repeat_filter > 0) && (p.RepeatCount >= repeat_filter) ) {
-                                   p.Calls[i].fwd-=p.Calls[i].tail_fwd; 
-                                   p.Calls[i].rev-=p.Calls[i].tail_rev;
-                                   skipped_tail_hom+=p.Calls[i].tail_fwd+p.Calls[i].tail_rev;
+                                   c.fwd-=c.tail_fwd; 
+                                   c.rev-=c.tail_rev;
+                                   skipped_tail_hom+=c.tail_fwd+c.tail_rev;
                                    }
                                  */
-                                if (p.Calls[i].depth() >= min_adepth && p.Calls[i].depth() > 0) {
-                                    double err_rate = mean_qual < vse_max_phred[b2i(p.Base)][b2i(p.Calls[i].base)] ? pow(10,-mean_qual/10.0) : vse_rate[b2i(p.Base)][b2i(p.Calls[i].base)];
+                                if (c.depth() >= min_adepth && c.depth() > 0) {
+                                    double err_rate = mean_qual < vse_max_phred[b2i(p.Base)][b2i(c.base)] ? pow(10,-mean_qual/10.0) : vse_rate[b2i(p.Base)][b2i(c.base)];
                                     // expected number of non-reference bases at this position is error_rate*depth
-                                    double pval=(p.Depth*err_rate==0)?0:gsl_ran_poisson_pdf(p.Calls[i].depth(), p.Depth*err_rate);
+                                    double pval=(p.Depth*err_rate==0)?0:Poisson.Pdf(c.depth(), p.Depth*err_rate);
                                     double padj=total_locii ? pval*total_locii : pval;           // multiple-testing adjustment
 
                                     if (alpha>=1 || padj <= alpha) {
-                                        double mq_padj=max(total_locii*pow(10,-p.Calls[i].mq_sum/10.0),padj);      // never report as better than the mapping quality
+                                        double mq_padj=max(total_locii*pow(10,-c.mq_sum/10.0),padj);      // never report as better than the mapping quality
 
                                         if (mq_padj > 1) mq_padj=1;
 
-                                        if (debug_xpos) fprintf(stderr,"xpos-debug-pval\tbase:%c, err:%g, pval:%g, padj:%g, mq_padj:%g, mq_sum:%d\n", p.Calls[i].base, err_rate, pval, padj, mq_padj, p.Calls[i].mq_sum);
+                                        if (debug_xpos) fprintf(stderr,"xpos-debug-pval\tbase:%c, err:%g, pval:%g, padj:%g, mq_padj:%g, mq_sum:%d\n", c.base, err_rate, pval, padj, mq_padj, c.mq_sum);
 
-                                        if (!p.Calls[i].is_ref || debug_xpos || output_ref) {
+                                        if (!c.is_ref || debug_xpos || output_ref) {
                                             if (need_out == -1)
                                                 need_out = i;
                                         }
-                                        vfinal final(p.Calls[i]);
+                                        vfinal final(c);
                                         final.padj=mq_padj;
                                         final_calls.push_back(final);
                                     } else {
-                                        skipped_alpha+=p.Calls[i].depth();
+                                        skipped_alpha+=c.depth();
                                     }
                                 }
                             }
                         }
                     } else {
 		                if (debug_xpos) {
-                            warn("xpos-skipped-agree-%c\t%g\n", p.Calls[i].base, p.Calls[i].agreement);
+                            warn("xpos-skipped-agree-%c\t%g\n", c.base, c.agreement);
                         }
-                        skipped_agreement+=p.Calls[i].depth();
+                        skipped_agreement+=c.depth();
                     } 
                 } else {
-                    skipped_diversity+=p.Calls[i].depth();
+                    skipped_diversity+=c.depth();
                 } 
             } else {
-                skipped_balance+=p.Calls[i].depth();
+                skipped_balance+=c.depth();
             }
         } else {
             // depth is too low now.... technically you can just add all the rest of the calls to skipped_depth without checking
-            skipped_depth+=p.Calls[i].depth();
+            skipped_depth+=c.depth();
         }
     }
 
@@ -1859,64 +3188,85 @@ void VarCallVisitor::Visit(PileupSummary &p) {
         }
 
         /// INTERNAL VAR FILE
-        if (var_f) {
+        if (Out[OUT_VAR]) {
             int i;
             string pil;
             for (i=0;i<final_calls.size();++i) {
                vfinal &f=final_calls[i];
+               pil += '\t';
+               pil += f.pcall->base;
                if (f.is_indel()) {
-                    pil += string_format("\t%c%s:%d,%d,%.1e,%.2g,%.2g",f.pcall->base,f.max_idl_seq.c_str(),f.max_idl_cnt,f.pcall->qual/f.pcall->depth(),f.padj, f.pcall->diversity, f.pcall->agreement);
+                    pil += f.max_idl_seq; pil += ':';
+                    str_int(pil, f.max_idl_cnt);
                } else {
-                    pil += string_format("\t%c:%d,%d,%.1e,%.2g,%.2g",f.pcall->base,f.pcall->depth(),f.pcall->qual/f.pcall->depth(),f.padj, f.pcall->diversity, f.pcall->agreement);
+                    pil += ':';
+                    str_int(pil, f.pcall->depth());
                }
+               pil += ','; str_int(pil, f.pcall->qual/f.pcall->depth());
+               pil += ','; str_sci(pil, f.padj, 1);
+               pil += ','; str_gen(pil, f.pcall->diversity, 2);
+               pil += ','; str_gen(pil, f.pcall->agreement, 2);
             }
-            fprintf(var_f,"%s\t%d\t%c\t%d\t%d\t%2.2f%s%s\n",p.Chr.c_str(), p.Pos, p.Base, p.Depth, skipped_diversity+skipped_agreement+skipped_alpha+skipped_depth+skipped_balance+p.SkipAmp+p.SkipN+p.SkipDupReads+p.SkipMinMapq+p.SkipMinQual, pct_allele, Manager->UseAnnot==1?(p.InTarget ? "\t1" : "\t0"):"", pil.c_str());
-
-            if (tgt_var_f) {
+            string row;
+            row += p.Chr; row += '\t';
+            str_int(row, p.Pos); row += '\t';
+            row += p.Base; row += '\t';
+            str_int(row, p.Depth); row += '\t';
+            str_int(row, skipped_diversity+skipped_agreement+skipped_alpha+skipped_depth+skipped_balance+p.SkipAmp+p.SkipN+p.SkipDupReads+p.SkipMinMapq+p.SkipMinQual); row += '\t';
+            str_fix(row, pct_allele, 2);
+
+            VarOut += row;
+            if (Manager->UseAnnot==1) 
+                VarOut += p.InTarget ? "\t1" : "\t0";
+            VarOut += pil;
+            VarOut += '\n';
+
+            if (Out[OUT_TGT_VAR]) {
                 if (p.InTarget) {
-                    fprintf(tgt_var_f,"%s\t%d\t%c\t%d\t%d\t%2.2f%s\n",p.Chr.c_str(), p.Pos, p.Base, p.Depth, skipped_diversity+skipped_agreement+skipped_alpha+skipped_depth+skipped_balance+p.SkipAmp+p.SkipN+p.SkipDupReads+p.SkipMinMapq+p.SkipMinQual, pct_allele, pil.c_str());
+                    TgtVarOut += row;
+                    TgtVarOut += pil;
+                    TgtVarOut += '\n';
                 }
             }
         }
 
-       if (vcf_f) {
+       if (Out[OUT_VCF]) {
+            string &o = VcfOut;
             for (i=0;i<final_calls.size();++i) {
                vfinal &f=final_calls[i];
                int qual = f.padj>0?min(40,10*(-log10(f.padj))):40;
 
+               o += p.Chr; o += '\t';
+               str_int(o, p.Pos); o += "\t.\t";
+               double freq_allele;
                if (f.is_indel()) {
-                    string base;
-                    string alt;
                     if (f.pcall->base =='-') {
-                        base = p.Base + f.max_idl_seq;
-                        alt = p.Base;
+                        o += p.Base; o += f.max_idl_seq; o += '\t';
+                        o += p.Base;
                     } else {
-                        base = p.Base;
-                        alt = p.Base + f.max_idl_seq;
+                        o += p.Base; o += '\t';
+                        o += p.Base; o += f.max_idl_seq;
                     }
-                    double freq_allele = f.max_idl_cnt / (double) p.Depth;
-                    fprintf(vcf_f,"%s\t%d\t.\t%s\t%s\t%2d\tPASS\tMQ=%d;BQ=%d;DP=%d;AF=%2.2f\n", 
-                        p.Chr.c_str(), p.Pos, base.c_str(), alt.c_str(), qual, 
-                        (int) f.pcall->mq_rms(),
-                        (int) f.pcall->qual_rms(),
-                        total_call_depth,
-                        freq_allele);
+                    o += '\t'; str_int(o, qual, 2);
+                    freq_allele = f.max_idl_cnt / (double) p.Depth;
                 } else {
                     char alt = f.pcall->base;
                     if (f.pcall->is_ref) 
                         alt = '.';
-                    double freq_allele = f.pcall->depth() / (double) p.Depth;
-                    fprintf(vcf_f,"%s\t%d\t.\t%c\t%c\t%d\tPASS\tMQ=%d;BQ=%d;DP=%d;AF=%2.2f\n",
-                        p.Chr.c_str(), p.Pos, p.Base, alt, qual,
-                        (int) f.pcall->mq_rms(),
-                        (int) f.pcall->qual_rms(),
-                        total_call_depth,
-                        freq_allele);
+                    o += p.Base; o += '\t';
+                    o += alt;
+                    o += '\t'; str_int(o, qual);
+                    freq_allele = f.pcall->depth() / (double) p.Depth;
                 }
+                o += "\tPASS\tMQ="; str_int(o, (int) f.pcall->mq_rms());
+                o += ";BQ="; str_int(o, (int) f.pcall->qual_rms());
+                o += ";DP="; str_int(o, total_call_depth);
+                o += ";AF="; str_fix(o, freq_allele, 2);
+                o += '\n';
            }
         }
 
-        if (eav_f) {
+        if (Out[OUT_EAV]) {
 //            printf(eav_f,"chr\tpos\tref\tdepth\tnum_states\ttop_consensus\ttop_freq\tvar_base\tvar_depth\tvar_qual\tvar_strands\tforward_strands\treverse_strands\n");
             string top_cons, var_base, var_depth, var_qual, var_strands, forward, reverse, diversity, agreement;
            
@@ -1939,22 +3289,44 @@ void VarCallVisitor::Visit(PileupSummary &p) {
                     var_base += f.max_idl_seq;
                 }
                 if (i > 0) var_depth+= ";";
-                var_depth+= string_format("%d",f.pcall->depth());
+                str_int(var_depth, f.pcall->depth());
                 if (i > 0) var_qual+= ";";
-                var_qual+= string_format("%d",f.pcall->qual_rms());
+                str_int(var_qual, f.pcall->qual_rms());
                 if (i > 0) var_strands+= ";";
-                var_strands+= string_format("%d",(f.pcall->fwd>0)+(f.pcall->rev>0));
+                str_int(var_strands, (f.pcall->fwd>0)+(f.pcall->rev>0));
                 if (i > 0) forward += ";";
-                forward+= string_format("%d",f.pcall->fwd);
+                str_int(forward, f.pcall->fwd);
                 if (i > 0) reverse += ";";
-                reverse+= string_format("%d",f.pcall->rev);
+                str_int(reverse, f.pcall->rev);
                 if (i > 0) agreement += ";";
-                agreement+= string_format("%g",f.pcall->agreement);
+                str_gen(agreement, f.pcall->agreement);
                 if (i > 0) diversity += ";";
-                diversity+= string_format("%g",f.pcall->diversity);
+                str_gen(diversity, f.pcall->diversity);
             }
-            fprintf(eav_f,"%s\t%d\t%c\t%d\t%d\t%s\t%2.2f\t%s\t%s\t%s\t%s\t%s\t%s\t%.1e\t%s\t%s%s\n",p.Chr.c_str(), p.Pos, p.Base, p.Depth, (int) final_calls.size(),top_cons.c_str(), pct_allele, var_base.c_str(), var_depth.c_str(), var_qual.c_str(), var_strands.c_str(), forward.c_str(), reverse.c_str(), padj, diversity.c_str(), agreement.c_str(), Manager->UseAnnot==1?(p.InTarget?"\t1":"\t0"):regions);
+            string &o = EavOut;
+            o += p.Chr; o += '\t';
+            str_int(o, p.Pos); o += '\t';
+            o += p.Base; o += '\t';
+            str_int(o, p.Depth); o += '\t';
+            str_int(o, (int) final_calls.size()); o += '\t';
+            o += top_cons; o += '\t';
+            str_fix(o, pct_allele, 2); o += '\t';
+            o += var_base; o += '\t';
+            o += var_depth; o += '\t';
+            o += var_qual; o += '\t';
+            o += var_strands; o += '\t';
+            o += forward; o += '\t';
+            o += reverse; o += '\t';
+            str_sci(o, padj, 1); o += '\t';
+            o += diversity; o += '\t';
+            o += agreement;
+            if (Manager->UseAnnot==1) 
+                o += p.InTarget ? "\t1" : "\t0";
+            else
+                o += regions;
+            o += '\n';
         }
+        Flush(false);
 
 		if (debug_xpos) {
 		    fprintf(stderr,"xpos-skip-dup\t%d\n",p.SkipDupReads);
@@ -1972,32 +3344,54 @@ void VarCallVisitor::Visit(PileupSummary &p) {
                 fprintf(stderr,"repeat-filter\t%d\n",repeat_filter);
                 fprintf(stderr,"repeat-base\t%c\n",p.RepeatBase);
             }
+            Flush(true);
 			exit(0);
 		}
 	}
 }
 
+// rows go out once there's enough of them, all of them at the end
+void VarCallVisitor::Flush(bool all) {
+    size_t min = all ? 1 : OUT_FLUSH;
+    if (VarOut.size() >= min) out_flush(VarOut, Out[OUT_VAR]);
+    if (TgtVarOut.size() >= min) out_flush(TgtVarOut, Out[OUT_TGT_VAR]);
+    if (EavOut.size() >= min) out_flush(EavOut, Out[OUT_EAV]);
+    if (VcfOut.size() >= min) out_flush(VcfOut, Out[OUT_VCF]);
+    if (CseOut.size() >= min) out_flush(CseOut, Out[OUT_CSE]);
+    if (TgtCseOut.size() >= min) out_flush(TgtCseOut, Out[OUT_TGT_CSE]);
+}
+
+// once per locus, the samples of a joint pileup share it
 void PileupManager::FillReference(int refSize) {
+    if (RefFilled && Reference.size() == refSize)
+        return;
+    RefFilled=true;
+
     int flank=(refSize-1)/2;
     Reference.resize(refSize);
 
+    if (Pileup[0].Chr != FaiChr) {
+        FaiChr = Pileup[0].Chr;
+        FaiEnt = faidx.Chrdex(FaiChr);
+    }
+
     // if you're in the middle of a window
-    if (WinDex==flank && Win.size()==refSize) {
+    if (WinDex==flank && WinLen==refSize) {
         bool needfai=0;
         int i;
         for (i=WinDex-flank;i<refSize;++i) {
-            if (!isalpha(Win[i].Base)) {
+            if (!isalpha(WinAt(i).Base)) {
                 needfai=1;
                 break;
             } else {
-                Reference[i-(WinDex-flank)]=Win[i].Base;
+                Reference[i-(WinDex-flank)]=WinAt(i).Base;
             }
         }
         if (needfai) {
-            faidx.Fetch((char *)Reference.data(), Pileup.Chr, Pileup.Pos-flank-1, Pileup.Pos+flank-1);
+            faidx.Fetch((char *)Reference.data(), FaiEnt, Pileup[0].Pos-flank-1, Pileup[0].Pos+flank-1);
         }
     } else {
-        faidx.Fetch((char *)Reference.data(), Pileup.Chr, Pileup.Pos-flank-1, Pileup.Pos+flank-1);
+        faidx.Fetch((char *)Reference.data(), FaiEnt, Pileup[0].Pos-flank-1, Pileup[0].Pos+flank-1);
     }
 }
 
@@ -2042,7 +3436,8 @@ void PileupManager::LoadAnnot(const char *path) {
         //    void build(const char *path, const char *sep, int nchr, int nbeg, int nend, int skip_i, char skip_c, int sub_e);
             AnnotDex.build(path, "\t", 0, 1, 2, 0, '#', AnnotType=='b' ? 1 : 0);
         }
-        die("Either %s.tidx must be a valid tidx indexed file, or %s must be a BED or GTF file\n", path, path);
+        if (!AnnotType || !AnnotDex.read(path))
+            die("Either %s.tidx must be a valid tidx indexed file, or %s must be a BED or GTF file\n", path, path);
     }
 
     UseAnnot=1;
@@ -2083,20 +3478,21 @@ void VarStatVisitor::Visit(PileupSummary &p) {
 	if (p.Calls.size() > 5) 
 		p.Calls.resize(5);		// toss N's and inserts before sort
 
-	sort(p.Calls.begin(), p.Calls.end(), hitolocall);
+    int ord[T_CNT];
+    p.Calls.Order(ord);
 
 	double noise;
 	double qnoise;
     if (p.Calls.size() > 1) {
         // assume non-reference is noise
-        noise = (double) p.Calls[1].depth()/p.Depth;
-        qnoise = (double) p.Calls[1].qual/p.TotQual;
+        noise = (double) p.Calls[ord[1]].depth()/p.Depth;
+        qnoise = (double) p.Calls[ord[1]].qual/p.TotQual;
         if (noise > .25) {
             // unless maybe that was a het or something....
             if (p.Calls.size() > 2) {
                 // but 3rd allele is always noise
-                noise = (double) p.Calls[2].depth()/p.Depth;
-                qnoise = (double) p.Calls[2].qual/p.TotQual;
+                noise = (double) p.Calls[ord[2]].depth()/p.Depth;
+                qnoise = (double) p.Calls[ord[2]].qual/p.TotQual;
             } else {
                 // this is weird... but ok
                 noise = 0;
@@ -2109,7 +3505,7 @@ void VarStatVisitor::Visit(PileupSummary &p) {
 
 	double mnqual = (double)p.TotQual/p.Depth;
 
-	char pbase = p.Calls.size() > 1 ? p.Calls[1].base : '.';
+	char pbase = p.Calls.size() > 1 ? p.Calls[ord[1]].base : '.';
 
 	if (noise_f) {
 		fprintf(noise_f,"%d\t%c\t%c\t%f\t%f\t%f\n", p.Depth, p.Base, pbase, noise, qnoise, mnqual);
@@ -2125,9 +3521,79 @@ void VarStatVisitor::Visit(PileupSummary &p) {
 
 	tot_depth += p.Depth;
 	num_reads += p.NumReads;
-	stats.push_back(Noise(p.Base, p.Calls[1].base, p.Depth, noise, qnoise, mnqual));
-	ins_stats.push_back(Noise(p.Base, p.Calls[1].base, p.Depth, ins_noise, ins_qnoise, mnqual));
-	del_stats.push_back(Noise(p.Base, p.Calls[1].base, p.Depth, del_noise, del_qnoise, mnqual));
+    Noise n(p.Base, pbase, p.Depth, noise, qnoise, mnqual, ins_noise, del_noise);
+    n.seq = num_noise;
+    AddDepth(p.Depth, 1);
+    AddNoise(n);
+}
+
+void VarStatVisitor::AddNoise(const Noise &n) {
+    if (top.size() < NOISE_TOP) {
+        top.push_back(n);
+        push_heap(top.begin(), top.end(), noisebydepthseq);
+    } else if (noisebydepthseq(n, top.front())) {
+        pop_heap(top.begin(), top.end(), noisebydepthseq);
+        top.back() = n;
+        push_heap(top.begin(), top.end(), noisebydepthseq);
+    }
+}
+
+void VarStatVisitor::Merge(const VarStatVisitor &x) {
+    tot_locii+=x.tot_locii; tot_depth+=x.tot_depth; num_reads+=x.num_reads;
+    long base = num_noise;          // x's locii come after these
+    int d;
+    for (d=0;d<DEPTH_HIST_MAX;++d) 
+        if (x.depth_cnt[d]) 
+            AddDepth(d, x.depth_cnt[d]);
+    map<int,long>::const_iterator it;
+    for (it=x.depth_big.begin();it!=x.depth_big.end();++it) 
+        AddDepth(it->first, it->second);
+    size_t i;
+    for (i=0;i<x.top.size();++i) {
+        Noise n = x.top[i];
+        n.seq += base;
+        AddNoise(n);
+    }
+}
+
+// depth of the r'th deepest sampled locus
+int VarStatVisitor::DepthAt(long r) const {
+    map<int,long>::const_reverse_iterator it;
+    for (it=depth_big.rbegin();it!=depth_big.rend();++it) {
+        if (r < it->second) 
+            return it->first;
+        r -= it->second;
+    }
+    int d;
+    for (d=DEPTH_HIST_MAX-1;d>0;--d) {
+        if (r < depth_cnt[d]) 
+            return d;
+        r -= depth_cnt[d];
+    }
+    return 0;
+}
+
+double VarStatVisitor::DepthQuantile(double p) const {
+    assert(num_noise > 0);
+    double t = ((double)num_noise-1)*p;
+    long it = (long) t;
+    int v=DepthAt(it);
+    if (t > (double)it) {
+        return (v + (t-it) * (DepthAt(it+1) - v));
+    } else {
+        return v;
+    }
+}
+
+long VarStatVisitor::DepthCount(int min) const {
+    long n = 0;
+    int d;
+    for (d=max(min,0);d<DEPTH_HIST_MAX;++d) 
+        n += depth_cnt[d];
+    map<int,long>::const_iterator it;
+    for (it=depth_big.lower_bound(min);it!=depth_big.end();++it) 
+        n += it->second;
+    return n;
 }
 
 
@@ -2162,6 +3628,7 @@ void usage(FILE *f) {
 "-S FILE     Read in statistics and params from a previous run with -s (do this!)\n"
 "-A ANNOT    Calculate in-target stats using the annotation file (requires -o)\n"
 "-o PREFIX   Output prefix (works with -s or -v)\n"
+"-t INT      Threads, indexed bams are split up by chromosome (1)\n"
 "-F files    List of file types to output (var, varsum, eav, vcf)\n"
 "\n"
 "Extended Options\n"
@@ -2171,6 +3638,14 @@ void usage(FILE *f) {
 "--diversity|d FLOAT    Alias for -d\n"
 "--agreement|G FLOAT    Alias for -G\n"
 "--no-indels            Ignore all indels\n"
+"--target-only          With -A, only call locii in the annotation.  With this or\n"
+"                       --pcr-annot, indexed bams, or a bgzipped pileup with a\n"
+"                       tabix index, are only read over the annotated regions\n"
+"--one-pass             With -s and -v, pileup once: parsed locii are saved to a\n"
+"                       temp file (in TMPDIR) while stats run, then replayed\n"
+"--samples NAME,...     Joint calling, one sample per bam, or per depth/reads/quals\n"
+"                       columns of a multi-sample pileup.  Each is called on its own,\n"
+"                       with stats pooled, to PREFIX.NAME.var and so on (requires -o)\n"
 "\n"
 "Input files\n"
 "\n"
@@ -2228,31 +3703,6 @@ std::string string_format(const std::string &fmt, ...) {
        }
 }
 
-void to_upper(const std::string str) {
-	static int i;
-    static char c;
-	for ( i=0;i<str.size();++i ) {
-        c=((char *)(void *)str.data())[i];
-		if (c >= 'a' && c <= 'z') {
-            ((char *)(void *)str.data())[i]=c-32;
-        }
-	}
-}
-
-// returns quantile depth 
-double quantile_depth(const std::vector<Noise> &vec, double p) {
-        int l = vec.size();
-        assert(l > 0);
-        double t = ((double)l-1)*p;
-        int it = (int) t;
-        int v=vec[it].depth;
-        if (t > (double)it) {
-                return (v + (t-it) * (vec[it+1].depth - v));
-        } else {
-                return v;
-        }
-}
-
 double quantile(const std::vector<int> &vec, double p) {
         int l = vec.size();
         double t = ((double)l-1)*p;
@@ -2306,12 +3756,12 @@ std::vector<char *> split(char* str, char delim)
     return result;
 }
 
-int split(char **buf, char* str, char delim)
+// buf has room for max pointers, the last field gets the rest of the line
+int split(char **buf, char* str, char delim, int max)
 {
     char **bb=buf;
     char *p=strchr(str,delim);
-    std::vector<char *> result;
-    while(p != NULL)
+    while(p != NULL && bb-buf < max-2)
     {
         *p='\0';
         *bb=str;
@@ -2327,6 +3777,200 @@ int split(char **buf, char* str, char delim)
     return bb-buf;
 }
 
+// printf-style number formatting without stdio, for the per-locus outputs.  rounding is the same
+// as printf's: the exact value is compared with the halfway point, ties go to even.
+// anything that can't be done exactly with doubles is passed on to snprintf.
+// b needs FMT_MAX bytes, for %f of a huge value
+
+#define FMT_MAX 400
+
+static const double fmt_p10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// x*10^k rounded to an integer, for x >= 0
+static bool fmt_round(double x, int k, long long &n) {
+    if (k < 0 || k > 22) 
+        return false;
+    double s = fmt_p10[k];
+    double p = x*s;
+    if (!(p < 1e15)) 
+        return false;
+    // exact product is p+e (dekker)
+    const double c = 134217729.0;
+    double t = c*x, xh = t-(t-x), xl = x-xh;
+    t = c*s; double sh = t-(t-s), sl = s-sh;
+    double e = ((xh*sh - p) + xh*sl + xl*sh) + xl*sl;
+    double fl = floor(p);
+    double a = (p - fl) - 0.5;
+    n = (long long) fl;
+    if (a > -e || (a == -e && (n & 1))) 
+        ++n;
+    return true;
+}
+
+static int fmt_uint(char *b, unsigned long long v) {
+    char t[24];
+    int i = 0, n = 0;
+    do {
+        t[i++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (i) 
+        b[n++] = t[--i];
+    return n;
+}
+
+// %d, %ld, %<width>d
+static int fmt_int(char *b, long long v, int width=0) {
+    char t[24];
+    int n = 0;
+    if (v < 0) 
+        t[n++] = '-';
+    n += fmt_uint(t+n, v < 0 ? -(unsigned long long) v : v);
+    int o = 0;
+    while (o + n < width) 
+        b[o++] = ' ';
+    memcpy(b+o, t, n);
+    return o+n;
+}
+
+// %.<prec>f
+static int fmt_fix(char *b, double x, int prec) {
+    long long n;
+    if (!isfinite(x) || !fmt_round(fabs(x), prec, n)) 
+        return snprintf(b, FMT_MAX, "%.*f", prec, x);
+    int o = 0;
+    if (signbit(x)) 
+        b[o++] = '-';
+    long long s = (long long) fmt_p10[prec];
+    o += fmt_uint(b+o, n / s);
+    if (prec > 0) {
+        b[o++] = '.';
+        long long f = n % s;
+        int i;
+        for (i=prec-1;i>=0;--i) {
+            b[o+i] = '0' + f % 10;
+            f /= 10;
+        }
+        o += prec;
+    }
+    return o;
+}
+
+// round |x| to prec significant digits: n has exactly prec digits, and x ~ n * 10^(ex-prec+1)
+static bool fmt_digits(double ax, int prec, long long &n, int &ex) {
+    long long lo = (long long) fmt_p10[prec-1];
+    long long hi = lo * 10;
+    ex = (int) floor(log10(ax));
+    int tries;
+    for (tries=0;tries<3;++tries) {
+        if (!fmt_round(ax, prec-1-ex, n)) 
+            return false;
+        if (n < lo) {
+            --ex;
+        } else if (n > hi) {
+            ++ex;
+        } else {
+            if (n == hi) {
+                // rounded up to the next power of ten
+                n = lo;
+                ++ex;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// %.<prec>g
+static int fmt_gen(char *b, double x, int prec=6) {
+    if (prec == 0) 
+        prec = 1;
+    if (x == 0) {
+        int o = 0;
+        if (signbit(x)) 
+            b[o++] = '-';
+        b[o++] = '0';
+        return o;
+    }
+    long long n;
+    int ex;
+    if (!isfinite(x) || prec > 15 || !fmt_digits(fabs(x), prec, n, ex) || ex < -4 || ex >= prec) 
+        return snprintf(b, FMT_MAX, "%.*g", prec, x);
+    char d[24];
+    fmt_uint(d, n);
+    int nd = prec;
+    while (nd > ex+1 && nd > 0 && d[nd-1] == '0') 
+        --nd;
+    int o = 0;
+    if (x < 0) 
+        b[o++] = '-';
+    int i;
+    if (ex >= 0) {
+        memcpy(b+o, d, ex+1);
+        o += ex+1;
+        if (nd > ex+1) {
+            b[o++] = '.';
+            memcpy(b+o, d+ex+1, nd-ex-1);
+            o += nd-ex-1;
+        }
+    } else {
+        b[o++] = '0';
+        b[o++] = '.';
+        for (i=0;i<-ex-1;++i) 
+            b[o++] = '0';
+        memcpy(b+o, d, nd);
+        o += nd;
+    }
+    return o;
+}
+
+// %.<prec>e
+static int fmt_sci(char *b, double x, int prec) {
+    long long n;
+    int ex;
+    if (x == 0 || !isfinite(x) || prec > 14 || !fmt_digits(fabs(x), prec+1, n, ex)) 
+        return snprintf(b, FMT_MAX, "%.*e", prec, x);
+    char d[24];
+    fmt_uint(d, n);
+    int o = 0;
+    if (x < 0) 
+        b[o++] = '-';
+    b[o++] = d[0];
+    if (prec > 0) {
+        b[o++] = '.';
+        memcpy(b+o, d+1, prec);
+        o += prec;
+    }
+    b[o++] = 'e';
+    b[o++] = ex < 0 ? '-' : '+';
+    if (ex < 0) 
+        ex = -ex;
+    if (ex < 10) 
+        b[o++] = '0';
+    o += fmt_uint(b+o, ex);
+    return o;
+}
+
+void str_int(string &s, long long v, int width) {
+    char b[FMT_MAX];
+    s.append(b, fmt_int(b, v, width));
+}
+
+void str_fix(string &s, double x, int prec) {
+    char b[FMT_MAX];
+    s.append(b, fmt_fix(b, x, prec));
+}
+
+void str_gen(string &s, double x, int prec) {
+    char b[FMT_MAX];
+    s.append(b, fmt_gen(b, x, prec));
+}
+
+void str_sci(string &s, double x, int prec) {
+    char b[FMT_MAX];
+    s.append(b, fmt_sci(b, x, prec));
+}
+
 int rand_round(double x) {
     return floor(x)+((rand()>(x-int(x))) ? 1 : 0);
 //warn("rr:%f=%d\n",x);
@@ -2340,8 +3984,7 @@ void check_ref_fai(const char * ref) {
     }
 
     if (!hasdata(string(ref)+".fai")) {
-        int ret=system(string_format("samtools faidx '%s'", ref).c_str());
-        if (ret) {
+        if (fai_build(ref)) {
             warn("Need a %s.fai file, run samtools faidx\n", ref);
             exit(1);
         }
@@ -2349,7 +3992,19 @@ void check_ref_fai(const char * ref) {
 }
 
 void Faidx::Load(const char *path) {
-    fa_f = openordie(path, "r");
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) 
+        die("Can't open %s: %s\n", path, strerror(errno));
+    fa_n = path;
+    fa_len = st.st_size;
+    if (fa_len) {
+        void *m = mmap(NULL, fa_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) 
+            die("Can't map %s: %s\n", path, strerror(errno));
+        fa_m = (const char *) m;
+    }
+    close(fd);
     FILE *fp = openordie(string_format("%s.fai", path).c_str(), "r");
 
     char *buf = (char*)calloc(0x10000, 1);
@@ -2368,20 +4023,41 @@ void Faidx::Load(const char *path) {
 bool Faidx::Fetch(char *buf, const Faient *ent, int pos_from, int pos_to) {
     int len = (pos_to-pos_from+1);
 
-    if (fseek(fa_f, ent->offset + pos_from / ent->line_blen * ent->line_len + pos_from % ent->line_blen, SEEK_SET) == -1) {
+    if (!ent) 
         return false;
-    }
+
+    long long off = ent->offset + pos_from / ent->line_blen * ent->line_len + pos_from % ent->line_blen;
+    if (off < 0)
+        return false;
+
     int l = 0;
-    char c;
-    while (((c=fgetc(fa_f))!= EOF) && (l < len)) {
-        if (isgraph(c)) buf[l++] = c;
+    if (pos_from >= 0 && pos_to < ent->len && ent->offset + (long long) (pos_to / ent->line_blen) * ent->line_len + pos_to % ent->line_blen < (long long) fa_len) {
+        // within the sequence, copy a line at a time
+        int pos = pos_from;
+        while (l < len) {
+            int col = pos % ent->line_blen;
+            int n = min(ent->line_blen - col, len - l);
+            memcpy(buf+l, fa_m + ent->offset + (long long) (pos / ent->line_blen) * ent->line_len + col, n);
+            l += n;
+            pos += n;
+        }
+        return true;
+    }
+
+    // off either end, take printable bytes as they come
+    const char *p = fa_m + min(off, (long long) fa_len);
+    const char *e = fa_m + fa_len;
+    while (p < e && l < len) {
+        if (isgraph(*p)) buf[l++] = *p;
+        ++p;
     }
     return l==len;
 }
 
 
-PileupSubscriber::PileupSubscriber(PileupManager &man) {
+PileupSubscriber::PileupSubscriber(PileupManager &man, int sample) {
     Manager = NULL; 
+    Sample = sample;
     SetManager(man);
 };
 
@@ -2398,21 +4074,24 @@ void output_stats(VarStatVisitor &vstat) {
     stat_out("min depth\t%d\n", minsampdepth);
     stat_out("alpha\t%f\n", alpha);
 
-    if (vstat.stats.size()) {
-        // sort by depth descending
-        sort(vstat.stats.begin(), vstat.stats.end(), noisebydepth);
+    if (vstat.num_noise) {
+        // sort by depth descending.  from input order, as a full sort of every locus did,
+        // so when they all fit the order (and the float sums) are the same
+        vector<Noise> &stats = vstat.top;
+        sort(stats.begin(), stats.end(), noisebyseq);
+        sort(stats.begin(), stats.end(), noisebydepth);
 
         // flip 3 and 1 because sorted in descending order for sampling (above)
-        double depth_q3=quantile_depth(vstat.stats, .25);
-        double depth_q2=quantile_depth(vstat.stats, .50);
-        double depth_q1=quantile_depth(vstat.stats, .75);
-        double depth_qx=quantile_depth(vstat.stats, .95);
+        double depth_q3=vstat.DepthQuantile(.25);
+        double depth_q2=vstat.DepthQuantile(.50);
+        double depth_q1=vstat.DepthQuantile(.75);
+        double depth_qx=vstat.DepthQuantile(.95);
 
         // number of locii to compute error rate
-        int ncnt=min(100000,vstat.stats.size());
+        int ncnt=stats.size();
 
         int i;
-        double nsum=0, nssq=0, dsum=0, dmin=vstat.stats[0].depth, qnsum=0, qnssq=0, qualsum=0;
+        double nsum=0, nssq=0, dsum=0, dmin=stats[0].depth, qnsum=0, qnssq=0, qualsum=0;
 
         double ins_nsum=0, ins_nssq=0, del_nsum=0, del_nssq=0;
 
@@ -2422,31 +4101,31 @@ void output_stats(VarStatVisitor &vstat) {
         meminit(qvcnt);
 
         for (i=0;i<ncnt;++i) {
-            if (vstat.stats[i].depth < depth_q1) {
+            if (stats[i].depth < depth_q1) {
                 continue;
             }
 
             int ref_i, var_i;
-            ref_i=b2i(vstat.stats[i].ref);
-            var_i=b2i(vstat.stats[i].var);
+            ref_i=b2i(stats[i].ref);
+            var_i=b2i(stats[i].var);
 
             if (ref_i < T_N && var_i < T_N) {
-                qvsum[ref_i][var_i]+=vstat.stats[i].qnoise;
-                qvssq[ref_i][var_i]+=vstat.stats[i].qnoise*vstat.stats[i].qnoise;
+                qvsum[ref_i][var_i]+=stats[i].qnoise;
+                qvssq[ref_i][var_i]+=stats[i].qnoise*stats[i].qnoise;
                 qvcnt[ref_i][var_i]+=1;
             }
 
-            nsum+=vstat.stats[i].noise;
-            nssq+=vstat.stats[i].noise*vstat.stats[i].noise;
-            dsum+=vstat.stats[i].depth;
-            qnsum+=vstat.stats[i].qnoise;
-            qnssq+=vstat.stats[i].qnoise*vstat.stats[i].qnoise;
-            qualsum+=vstat.stats[i].mnqual;
-            if (vstat.stats[i].depth < dmin) dmin = vstat.stats[i].depth;
-            ins_nsum+=vstat.ins_stats[i].noise;
-            ins_nssq+=vstat.ins_stats[i].noise*vstat.ins_stats[i].noise;
-            del_nsum+=vstat.del_stats[i].noise;
-            del_nssq+=vstat.del_stats[i].noise*vstat.del_stats[i].noise;
+            nsum+=stats[i].noise;
+            nssq+=stats[i].noise*stats[i].noise;
+            dsum+=stats[i].depth;
+            qnsum+=stats[i].qnoise;
+            qnssq+=stats[i].qnoise*stats[i].qnoise;
+            qualsum+=stats[i].mnqual;
+            if (stats[i].depth < dmin) dmin = stats[i].depth;
+            ins_nsum+=stats[i].ins;
+            ins_nssq+=stats[i].ins*stats[i].ins;
+            del_nsum+=stats[i].del;
+            del_nssq+=stats[i].del*stats[i].del;
         }
 
         double noise_mean =nsum/ncnt;
@@ -2481,17 +4160,7 @@ void output_stats(VarStatVisitor &vstat) {
         stat_out("depth median\t%.4f\n", depth_q2);
         stat_out("depth q3\t%.4f\n", depth_q3);
 
-        dsum=0;
-        for (i=0;i<vstat.stats.size();++i) {
-            dsum+=vstat.stats[i].depth;
-        }
-
-        int locii_gtmin=0;
-        for (i=0;i<vstat.stats.size();++i) {
-            if (vstat.stats[i].depth >= min_depth) {
-                ++locii_gtmin;
-            }
-        }
+        int locii_gtmin=vstat.DepthCount(min_depth);
         stat_out("locii >= min depth\t%d\n", locii_gtmin);
         stat_out("locii\t%d\n", vstat.tot_locii);
 